@@ -22,7 +22,12 @@
 
 #include "io_init.h"
 #include "io_config.h"
+#include "io_loader.h"
 #include "io_template.h"
 #include "io_lua_table.h"
+#include "io_array.h"
+#include "io_struct.h"
+#include "io_filter.h"
+#include "io_trace.h"
 
 #endif /* ! io_h_included */
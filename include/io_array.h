@@ -0,0 +1,62 @@
+/*
+ * Copyright 2014 Julian Maurice
+ *
+ * This file is part of libio
+ *
+ * libio is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef io_array_h_included
+#define io_array_h_included
+
+#include <stddef.h>
+
+typedef enum {
+	IO_ARRAY_INT64,
+	IO_ARRAY_DOUBLE,
+	IO_ARRAY_STRING
+} io_array_type_t;
+
+/* A contiguous C array given to templates without copying it. Templates
+ * see it as a read-only sequence: a[i], #a and ipairs(a). Elements of
+ * IO_ARRAY_STRING arrays are width bytes long, NUL-padded.
+ * Lua values of the array hold a reference to it, so it is only freed
+ * once the param and all of them are gone. */
+typedef struct {
+	io_array_type_t type;
+	const void *data;
+	size_t length;
+	size_t width;
+	void (*free)(void *data);
+	unsigned int refs;
+} io_array_t;
+
+/* free_data, if not NULL, is called on data when the array is freed.
+ * Pass the result to io_template_param() as emb_new("io_array", array). */
+io_array_t *
+io_array_new(
+	io_array_type_t type,
+	const void *data,
+	size_t length,
+	size_t width,
+	void (*free_data)(void *data)
+);
+
+/* Drops a reference to the array, and frees it with the last one. */
+void
+io_array_free(
+	io_array_t *array
+);
+
+#endif /* ! io_array_h_included */
@@ -22,6 +22,7 @@
 
 #include <sds.h>
 #include <libgends/slist.h>
+#include "io_loader.h"
 
 typedef struct {
 	sds code_start_tag;
@@ -32,6 +33,34 @@ typedef struct {
 	sds comm_end_tag;
 
 	gds_slist_t *directories;
+
+	/* Inline Io.include calls with a literal file name at compile time. */
+	int inline_includes;
+
+	/* Significant digits of numbers written by Io.output, 0 for the
+	 * shortest form that reads back to the same number. Defaults to 14,
+	 * as Lua's tostring. */
+	int number_precision;
+
+	/* Template files larger than this many bytes are parsed straight into
+	 * the Lua compiler each time they are rendered or included, instead of
+	 * being kept as generated code. 0 never streams. Defaults to 1 MiB.
+	 * Streamed files are not inlined. Ignored with a loader. */
+	size_t stream_size;
+
+	/* When NULL, templates are files searched in directories. */
+	io_loader_t *loader;
+
+	/* Generated code of included templates, keyed by loader key. */
+	struct io_cache_s *cache;
+
+	/* Set by io_config_watch(). */
+	struct io_watch_s *watch;
+
+	/* Params shared by every template using this config, see
+	 * io_config_param(). */
+	void **params;
+	unsigned long params_version;
 } io_config_t;
 
 io_config_t *
@@ -47,6 +76,66 @@ io_config_new(
 io_config_t *
 io_config_new_default(void);
 
+/* Returns the path of the first readable file named filename in
+ * config->directories, or NULL. */
+sds
+io_config_find_file(
+	io_config_t *config,
+	const char *filename
+);
+
+/* Watches config->directories for changes, so that templates read from
+ * them are recompiled when they change without checking the filesystem
+ * on each render. Returns -1 if they cannot be watched. */
+int
+io_config_watch(
+	io_config_t *config
+);
+
+/* Sets a param visible to every template using this config, behind the
+ * template's own params. Global params are converted to Lua once and kept
+ * in the Lua state of each template between renders; setting one makes
+ * templates convert them again. The config takes ownership of value, as
+ * io_template_param() does. Templates must not modify them. */
+void
+io_config_param(
+	io_config_t *config,
+	const char *name,
+	void *value
+);
+
+/* The config takes ownership of the loader. */
+void
+io_config_set_loader(
+	io_config_t *config,
+	io_loader_t *loader
+);
+
+sds
+io_config_lookup(
+	io_config_t *config,
+	const char *name
+);
+
+sds
+io_config_load(
+	io_config_t *config,
+	const char *key
+);
+
+/* Returns 1 if the template file key is larger than config->stream_size. */
+int
+io_config_streamed(
+	io_config_t *config,
+	const char *key
+);
+
+unsigned long
+io_config_version(
+	io_config_t *config,
+	const char *key
+);
+
 void
 io_config_free(
 	io_config_t *config
@@ -0,0 +1,70 @@
+/*
+ * Copyright 2014 Julian Maurice
+ *
+ * This file is part of libio
+ *
+ * libio is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef io_filter_h_included
+#define io_filter_h_included
+
+#include <stddef.h>
+#include <sds.h>
+
+struct lua_State;
+
+/* Filters are applied in expression tags with {{ value | name }} or
+ * {{ value | name(arg, ...) }}. A filter appends the transformation of
+ * in to *out. Its arguments are at indexes arg to arg + nargs - 1 of the
+ * Lua stack of L: they can be read with the functions below, or with the
+ * Lua API, and errors raised with luaL_error(). */
+typedef void (*io_filter_t)(sds *out, const char *in, size_t len,
+	struct lua_State *L, int arg, int nargs);
+
+/* Registers a filter, replacing any filter with the same name. Filters
+ * must be registered before rendering. Returns 0 on success. */
+int
+io_filter_register(
+	const char *name,
+	io_filter_t filter
+);
+
+/* Returns the filter registered under name, or NULL. */
+io_filter_t
+io_filter_get(
+	const char *name
+);
+
+/* Returns the filter argument at index arg as a number, raising an error
+ * if it is not one. */
+double
+io_filter_arg_number(
+	struct lua_State *L,
+	int arg
+);
+
+/* Returns the filter argument at index arg as a string, and its length in
+ * *len if len is not NULL, raising an error if it is not one. */
+const char *
+io_filter_arg_string(
+	struct lua_State *L,
+	int arg,
+	size_t *len
+);
+
+/* Unregisters all filters but the builtin ones. Called by io_finalize(). */
+void io_filter_free(void);
+
+#endif /* ! io_filter_h_included */
@@ -0,0 +1,63 @@
+/*
+ * Copyright 2014 Julian Maurice
+ *
+ * This file is part of libio
+ *
+ * libio is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef io_loader_h_included
+#define io_loader_h_included
+
+#include <sds.h>
+
+typedef struct io_loader_s io_loader_t;
+
+/* Where templates come from. lookup resolves a name, as given to
+ * Io.include, to a key (NULL if there is no such template), load returns
+ * the source of the template for a key. version is optional and must
+ * return a value that changes whenever the template does; it is used to
+ * invalidate cached includes. Returned strings are owned by the caller. */
+struct io_loader_s {
+	sds (*lookup)(io_loader_t *loader, const char *name);
+	sds (*load)(io_loader_t *loader, const char *key);
+	unsigned long (*version)(io_loader_t *loader, const char *key);
+	void (*free)(io_loader_t *loader);
+	void *data;
+};
+
+/* In-memory template store. Templates are looked up by name only, without
+ * any system call. */
+io_loader_t *
+io_loader_memory_new(void);
+
+int
+io_loader_memory_set(
+	io_loader_t *loader,
+	const char *name,
+	const char *source
+);
+
+int
+io_loader_memory_remove(
+	io_loader_t *loader,
+	const char *name
+);
+
+void
+io_loader_free(
+	io_loader_t *loader
+);
+
+#endif /* ! io_loader_h_included */
@@ -34,7 +34,10 @@ typedef struct {
 		LUA_VALUE_TYPE_CFUNCTION,
 		LUA_VALUE_TYPE_LIST,
 		LUA_VALUE_TYPE_TABLE,
-		LUA_VALUE_TYPE_LIGHTUSERDATA
+		LUA_VALUE_TYPE_LIGHTUSERDATA,
+		LUA_VALUE_TYPE_ARRAY,
+		LUA_VALUE_TYPE_STRUCT,
+		LUA_VALUE_TYPE_JSON
 	} type;
 	union {
 		int boolean;
@@ -46,6 +49,9 @@ typedef struct {
 		void *list;
 		void *table;
 		void *lightuserdata;
+		void *array;
+		void *structure;
+		void *json;
 	} value;
 } io_lua_value_t;
 
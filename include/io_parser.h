@@ -20,9 +20,16 @@
 #ifndef libio_parser_h_included
 #define libio_parser_h_included
 
+#include <stdio.h>
 #include <sds.h>
 #include "io_config.h"
 
+typedef struct io_parser_s io_parser_t;
+
+/* Fill buf with at most size bytes and return how many were written, 0
+ * means end of input. */
+typedef size_t (*io_parser_reader_t)(void *data, char *buf, size_t size);
+
 sds
 io_parser_parse(
 	const char *template,
@@ -41,5 +48,31 @@ io_parser_parse_file(
 	io_config_t *config
 );
 
+io_parser_t *
+io_parser_new(
+	io_parser_reader_t reader,
+	void *data,
+	io_config_t *config
+);
+
+io_parser_t *
+io_parser_new_filep(
+	FILE *filep,
+	io_config_t *config
+);
+
+/* Returns the next piece of generated code, or NULL when the whole input
+ * has been parsed. The returned buffer is reused by the next call. */
+const char *
+io_parser_next(
+	io_parser_t *parser,
+	size_t *len
+);
+
+void
+io_parser_free(
+	io_parser_t *parser
+);
+
 #endif /* ! libio_parser_h_included */
 
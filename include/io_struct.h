@@ -0,0 +1,107 @@
+/*
+ * Copyright 2014 Julian Maurice
+ *
+ * This file is part of libio
+ *
+ * libio is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef io_struct_h_included
+#define io_struct_h_included
+
+#include <stddef.h>
+
+typedef enum {
+	IO_FIELD_INT,		/* signed integer of any size */
+	IO_FIELD_UINT,		/* unsigned integer of any size */
+	IO_FIELD_DOUBLE,	/* float or double */
+	IO_FIELD_BOOL,
+	IO_FIELD_STRING,	/* char *, NULL is nil */
+	IO_FIELD_CHARS,		/* char[N], NUL-padded */
+	IO_FIELD_STRUCT,	/* pointer to a struct, NULL is nil */
+	IO_FIELD_INLINE		/* struct member */
+} io_field_type_t;
+
+typedef struct io_schema_s io_schema_t;
+
+typedef struct {
+	const char *name;
+	io_field_type_t type;
+	size_t offset;
+	size_t size;
+	const io_schema_t *schema;
+} io_field_t;
+
+/* Describes the fields of a struct that templates can read. Schemas are
+ * usually static data:
+ *
+ *     static const io_field_t book_fields[] = {
+ *         IO_FIELD(book_t, title, IO_FIELD_STRING),
+ *         IO_FIELD(book_t, price, IO_FIELD_DOUBLE),
+ *         IO_FIELD_REF(book_t, author, IO_FIELD_STRUCT, &author_schema),
+ *         IO_FIELD_END
+ *     };
+ *     static const io_schema_t book_schema = IO_SCHEMA(book_t, book_fields);
+ */
+struct io_schema_s {
+	const char *name;
+	size_t size;
+	const io_field_t *fields;
+};
+
+#define IO_FIELD(s, member, type) \
+	{ #member, type, offsetof(s, member), sizeof(((s *) 0)->member), NULL }
+#define IO_FIELD_REF(s, member, type, schema) \
+	{ #member, type, offsetof(s, member), sizeof(((s *) 0)->member), schema }
+#define IO_FIELD_END { NULL, 0, 0, 0, NULL }
+#define IO_SCHEMA(s, fields) { #s, sizeof(s), fields }
+
+/* A struct, or an array of structs, given to templates without copying
+ * it. Templates read fields directly from memory: s.title, and for arrays
+ * a[i].title, #a and ipairs(a).
+ * Lua values read from it hold a reference to it, so it is only freed
+ * once the param and all of them are gone. */
+typedef struct {
+	const io_schema_t *schema;
+	const void *data;
+	size_t length;
+	int array;
+	void (*free)(void *data);
+	unsigned int refs;
+} io_struct_t;
+
+/* free_data, if not NULL, is called on data when the struct is freed.
+ * Pass the result to io_template_param() as emb_new("io_struct", s). */
+io_struct_t *
+io_struct_new(
+	const io_schema_t *schema,
+	const void *data,
+	void (*free_data)(void *data)
+);
+
+io_struct_t *
+io_struct_array_new(
+	const io_schema_t *schema,
+	const void *data,
+	size_t length,
+	void (*free_data)(void *data)
+);
+
+/* Drops a reference to the struct, and frees it with the last one. */
+void
+io_struct_free(
+	io_struct_t *s
+);
+
+#endif /* ! io_struct_h_included */
@@ -20,9 +20,40 @@
 #ifndef libio_template_h_included
 #define libio_template_h_included
 
+#include <stddef.h>
 #include "io_config.h"
 
 typedef struct io_template_s io_template_t;
+typedef struct io_render_s io_render_t;
+
+typedef enum {
+	IO_ALLOCATOR_DEFAULT = 0,
+	IO_ALLOCATOR_ARENA
+} io_allocator_t;
+
+typedef enum {
+	IO_RENDER_OK = 0,
+	IO_RENDER_ERROR,
+	IO_RENDER_ERRMEM,
+	IO_RENDER_ERRTIME,
+	IO_RENDER_ERRINSTR,
+	IO_RENDER_CANCELLED
+} io_render_status_t;
+
+typedef struct {
+	size_t heap_peak;
+	size_t output_size;
+	unsigned long instructions;
+} io_render_stats_t;
+
+typedef void * (*io_template_lazy_t)(io_template_t *T, const char *name,
+	void *data);
+
+typedef enum {
+	IO_RENDER_DONE = 0,
+	IO_RENDER_CHUNK,
+	IO_RENDER_FETCH
+} io_render_step_t;
 
 io_template_t *
 io_template_new(
@@ -46,6 +77,86 @@ io_template_set_template_file(
 	const char *filename
 );
 
+/* Files inlined in the template when config->inline_includes is set.
+ * Returns NULL when i is out of range. */
+const char *
+io_template_get_dependency(
+	io_template_t *T,
+	unsigned int i
+);
+
+/* Returns 1 if one of the inlined files has changed since the template was
+ * compiled, in which case it should be set again. */
+int
+io_template_is_stale(
+	io_template_t *T
+);
+
+/* With IO_ALLOCATOR_ARENA, the Lua heap of each render is carved out of an
+ * arena owned by the template and released in one step when the render
+ * ends. */
+int
+io_template_set_allocator(
+	io_template_t *T,
+	io_allocator_t allocator
+);
+
+/* pause and stepmul are passed to lua_gc(); 0 keeps Lua's default.
+ * When enabled is 0, the garbage collector does not run during renders,
+ * which is mostly useful for short renders with the arena allocator. */
+int
+io_template_set_gc(
+	io_template_t *T,
+	int enabled,
+	int pause,
+	int stepmul
+);
+
+/* The Lua state of a template is kept between renders. Variables set by a
+ * template do not outlive its render, but changes made through references
+ * do: to _G, to library tables such as string or Io, to package.loaded,
+ * and to tables of params and global params. When isolated is 1, each
+ * render gets a new Lua state instead, at the cost of converting every
+ * param and global param again. */
+int
+io_template_set_isolated(
+	io_template_t *T,
+	int isolated
+);
+
+/* Maximum number of bytes the Lua heap and the output of a render may use
+ * together (0 means no limit). A render that exceeds it is aborted: its
+ * status becomes IO_RENDER_ERRMEM and io_template_render() returns NULL. */
+int
+io_template_set_memory_limit(
+	io_template_t *T,
+	size_t limit
+);
+
+/* Wall-clock time (in milliseconds) and number of Lua instructions a render
+ * may use (0 means no limit). They are checked by a count hook every
+ * IO_RENDER_HOOK_COUNT instructions, so the instruction count is
+ * approximate. A render that exceeds them is aborted with status
+ * IO_RENDER_ERRTIME or IO_RENDER_ERRINSTR. */
+int
+io_template_set_timeout(
+	io_template_t *T,
+	unsigned long msec
+);
+
+int
+io_template_set_instruction_limit(
+	io_template_t *T,
+	unsigned long count
+);
+
+/* Abort the render in progress with status IO_RENDER_CANCELLED, or the
+ * next render if none is in progress. Can be called from another thread. */
+void
+io_template_cancel(
+	io_template_t *T
+);
+
 void
 io_template_param(
 	io_template_t *T,
@@ -53,11 +164,112 @@ io_template_param(
 	void *value
 );
 
+/* Sets a param from a JSON document of len bytes. The text is copied, and
+ * parsed straight into Lua values when the param is converted, without
+ * building C containers first. Returns -1 if json is not valid. */
+int
+io_template_param_json(
+	io_template_t *T,
+	const char *name,
+	const char *json,
+	size_t len
+);
+
+/* Sets one param per member of a JSON object. */
+int
+io_template_params_json(
+	io_template_t *T,
+	const char *json,
+	size_t len
+);
+
+void
+io_template_param_remove(
+	io_template_t *T,
+	const char *name
+);
+
+/* Params converted to Lua are kept between renders, and only params that
+ * were set or removed since are converted again. Call this after
+ * modifying the value of a param in place. */
+void
+io_template_param_update(
+	io_template_t *T,
+	const char *name
+);
+
+/* The callback is called at most once per render, the first time the
+ * template reads name, and must return a new embody object (or NULL for
+ * nil) which is freed after conversion. A parameter set with
+ * io_template_param() under the same name takes precedence. */
+void
+io_template_param_lazy(
+	io_template_t *T,
+	const char *name,
+	io_template_lazy_t callback,
+	void *data
+);
+
 const char *
 io_template_render(
 	io_template_t *T
 );
 
+/* Pull-based rendering. The template runs in a coroutine which is suspended
+ * each time its output reaches threshold bytes. Each call to
+ * io_template_render_next() resumes it and returns IO_RENDER_CHUNK with the
+ * next piece of output, until IO_RENDER_DONE. Time spent suspended does not
+ * count towards the timeout. Output produced where the template cannot
+ * yield (inside a C function such as table.sort) is kept until the next
+ * Io.output call that can. */
+io_render_t *
+io_template_render_start(
+	io_template_t *T,
+	size_t threshold
+);
+
+io_render_step_t
+io_template_render_next(
+	io_render_t *R,
+	const char **chunk,
+	size_t *len
+);
+
+/* When a template calls Io.fetch(name), io_template_render_next() returns
+ * IO_RENDER_FETCH (after any buffered output has been returned). The host
+ * gets the requested name, obtains the value however it likes, and hands
+ * it over with io_template_render_fulfil(), which takes ownership of it as
+ * io_template_param() does. The next io_template_render_next() call
+ * resumes the template, with the value as the result of Io.fetch. */
+const char *
+io_template_render_get_fetch(
+	io_render_t *R
+);
+
+int
+io_template_render_fulfil(
+	io_render_t *R,
+	void *value
+);
+
+/* If the render is not finished, it is aborted with status
+ * IO_RENDER_CANCELLED. */
+void
+io_template_render_free(
+	io_render_t *R
+);
+
+io_render_status_t
+io_template_get_status(
+	io_template_t *T
+);
+
+void
+io_template_get_stats(
+	io_template_t *T,
+	io_render_stats_t *stats
+);
+
 void
 io_template_free(
 	io_template_t *T
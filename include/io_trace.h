@@ -0,0 +1,62 @@
+/*
+ * Copyright 2014 Julian Maurice
+ *
+ * This file is part of libio
+ *
+ * libio is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef io_trace_h_included
+#define io_trace_h_included
+
+#include <stdio.h>
+
+/* Events are recorded in a per-thread ring buffer of this many entries.
+ * When a buffer is full, the oldest events are overwritten. */
+#define IO_TRACE_BUFFER_SIZE 65536
+
+void
+io_trace_enable(void);
+
+void
+io_trace_disable(void);
+
+int
+io_trace_enabled(void);
+
+/* name must stay valid until the trace is dumped (string literals are fine) */
+void
+io_trace_begin(
+	const char *name
+);
+
+void
+io_trace_end(
+	const char *name
+);
+
+void
+io_trace_clear(void);
+
+/* Write all recorded events in Chrome trace-event JSON format.
+ * For a consistent snapshot, disable tracing before dumping. */
+int
+io_trace_dump(
+	FILE *fp
+);
+
+void
+io_trace_free(void);
+
+#endif /* ! io_trace_h_included */
@@ -0,0 +1,191 @@
+/*
+ * Copyright 2014 Julian Maurice
+ *
+ * This file is part of libio
+ *
+ * libio is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "io_arena.h"
+
+#define IO_ARENA_ALIGN 16
+#define io_arena_align(n) (((n) + IO_ARENA_ALIGN - 1) & ~((size_t) IO_ARENA_ALIGN - 1))
+
+struct io_arena_chunk_s {
+	io_arena_chunk_t *next;
+	char *base;
+	size_t size;
+	size_t used;
+};
+
+static io_arena_chunk_t * io_arena_chunk_new(size_t size)
+{
+	io_arena_chunk_t *chunk;
+	uintptr_t base;
+
+	chunk = malloc(sizeof(io_arena_chunk_t) + IO_ARENA_ALIGN + size);
+	if (chunk == NULL) {
+		return NULL;
+	}
+
+	base = (uintptr_t) (chunk + 1);
+	chunk->base = (char *) io_arena_align(base);
+	chunk->size = size;
+	chunk->used = 0;
+	chunk->next = NULL;
+
+	return chunk;
+}
+
+io_arena_t * io_arena_new(size_t chunk_size)
+{
+	io_arena_t *arena;
+
+	arena = malloc(sizeof(io_arena_t));
+	if (arena == NULL) {
+		return NULL;
+	}
+
+	arena->chunk_size = chunk_size;
+	arena->chunks = io_arena_chunk_new(chunk_size);
+	arena->total = 0;
+	arena->allocated = arena->chunks ? chunk_size : 0;
+	arena->last = NULL;
+
+	return arena;
+}
+
+void * io_arena_alloc(io_arena_t *arena, size_t size)
+{
+	io_arena_chunk_t *chunk;
+	void *ptr;
+
+	size = io_arena_align(size);
+	chunk = arena->chunks;
+	if (chunk == NULL || chunk->size - chunk->used < size) {
+		size_t chunk_size = arena->chunk_size;
+		if (chunk_size < size) {
+			chunk_size = size;
+		}
+		chunk = io_arena_chunk_new(chunk_size);
+		if (chunk == NULL) {
+			return NULL;
+		}
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+		arena->allocated += chunk_size;
+	}
+
+	ptr = chunk->base + chunk->used;
+	chunk->used += size;
+	arena->total += size;
+	arena->last = ptr;
+
+	return ptr;
+}
+
+/* Release everything at once. If the previous round needed more than one
+ * chunk, replace them with a single chunk big enough to hold it all, so
+ * that steady-state rounds never have to allocate again. */
+void io_arena_reset(io_arena_t *arena)
+{
+	io_arena_chunk_t *chunk, *next;
+
+	if (arena == NULL) {
+		return;
+	}
+
+	chunk = arena->chunks;
+	if (chunk && chunk->next) {
+		size_t size = arena->total;
+		if (size < arena->chunk_size) {
+			size = arena->chunk_size;
+		}
+		while (chunk) {
+			next = chunk->next;
+			free(chunk);
+			chunk = next;
+		}
+		arena->chunks = io_arena_chunk_new(size);
+		arena->allocated = arena->chunks ? size : 0;
+	} else if (chunk) {
+		chunk->used = 0;
+	}
+
+	arena->total = 0;
+	arena->last = NULL;
+}
+
+void io_arena_free(io_arena_t *arena)
+{
+	io_arena_chunk_t *chunk, *next;
+
+	if (arena) {
+		chunk = arena->chunks;
+		while (chunk) {
+			next = chunk->next;
+			free(chunk);
+			chunk = next;
+		}
+		free(arena);
+	}
+}
+
+/* lua_Alloc implementation. Freed blocks are only reclaimed when they are
+ * the most recent allocation; everything else is released by
+ * io_arena_reset(). */
+void * io_arena_lua_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+	io_arena_t *arena = ud;
+	io_arena_chunk_t *chunk = arena->chunks;
+	void *newptr;
+
+	if (nsize == 0) {
+		if (ptr && ptr == arena->last) {
+			size_t old = chunk->base + chunk->used - (char *) ptr;
+			chunk->used -= old;
+			arena->total -= old;
+			arena->last = NULL;
+		}
+		return NULL;
+	}
+
+	if (ptr == NULL) {
+		return io_arena_alloc(arena, nsize);
+	}
+
+	if (nsize <= osize) {
+		return ptr;
+	}
+
+	if (ptr == arena->last) {
+		size_t offset = (char *) ptr - chunk->base;
+		size_t size = io_arena_align(nsize);
+		if (chunk->size - offset >= size) {
+			arena->total += offset + size - chunk->used;
+			chunk->used = offset + size;
+			return ptr;
+		}
+	}
+
+	newptr = io_arena_alloc(arena, nsize);
+	if (newptr) {
+		memcpy(newptr, ptr, osize);
+	}
+
+	return newptr;
+}
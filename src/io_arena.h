@@ -0,0 +1,64 @@
+/*
+ * Copyright 2014 Julian Maurice
+ *
+ * This file is part of libio
+ *
+ * libio is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef io_arena_h_included
+#define io_arena_h_included
+
+#include <stddef.h>
+
+typedef struct io_arena_chunk_s io_arena_chunk_t;
+
+typedef struct {
+	io_arena_chunk_t *chunks;
+	size_t chunk_size;
+	size_t total;
+	size_t allocated;	/* size of all chunks */
+	void *last;
+} io_arena_t;
+
+io_arena_t *
+io_arena_new(
+	size_t chunk_size
+);
+
+void *
+io_arena_alloc(
+	io_arena_t *arena,
+	size_t size
+);
+
+void
+io_arena_reset(
+	io_arena_t *arena
+);
+
+void
+io_arena_free(
+	io_arena_t *arena
+);
+
+void *
+io_arena_lua_alloc(
+	void *ud,
+	void *ptr,
+	size_t osize,
+	size_t nsize
+);
+
+#endif /* ! io_arena_h_included */
@@ -0,0 +1,172 @@
+/*
+ * Copyright 2014 Julian Maurice
+ *
+ * This file is part of libio
+ *
+ * libio is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include "io_array.h"
+#include "io_template_private.h"
+
+static const char IO_ARRAY_METATABLE[] = "io_array";
+
+io_array_t * io_array_new(io_array_type_t type, const void *data,
+	size_t length, size_t width, void (*free_data)(void *data))
+{
+	io_array_t *array;
+
+	array = malloc(sizeof(io_array_t));
+	if (array == NULL) {
+		fprintf(stderr, "Memory allocation error\n");
+		return NULL;
+	}
+
+	array->type = type;
+	array->data = data;
+	array->length = length;
+	array->width = width;
+	array->free = free_data;
+	array->refs = 1;
+
+	return array;
+}
+
+void io_array_free(io_array_t *array)
+{
+	if (array && __sync_sub_and_fetch(&(array->refs), 1) == 0) {
+		if (array->free) {
+			array->free((void *) array->data);
+		}
+		free(array);
+	}
+}
+
+static void io_array_push_element(lua_State *L, io_array_t *array, size_t i)
+{
+	const char *s;
+
+	switch (array->type) {
+		case IO_ARRAY_INT64:
+			lua_pushinteger(L, ((const int64_t *) array->data)[i]);
+			break;
+		case IO_ARRAY_DOUBLE:
+			lua_pushnumber(L, ((const double *) array->data)[i]);
+			break;
+		case IO_ARRAY_STRING:
+			s = (const char *) array->data + i * array->width;
+			lua_pushlstring(L, s, strnlen(s, array->width));
+			break;
+		default:
+			lua_pushnil(L);
+	}
+}
+
+static io_array_t * io_array_check(lua_State *L, int idx)
+{
+	return *((io_array_t **) luaL_checkudata(L, idx, IO_ARRAY_METATABLE));
+}
+
+static int io_array_index(lua_State *L)
+{
+	io_array_t *array = io_array_check(L, 1);
+	lua_Number n = lua_tonumber(L, 2);
+
+	if (n >= 1 && n <= array->length && n == (size_t) n) {
+		io_array_push_element(L, array, (size_t) n - 1);
+	} else {
+		lua_pushnil(L);
+	}
+
+	return 1;
+}
+
+static int io_array_len(lua_State *L)
+{
+	io_array_t *array = io_array_check(L, 1);
+
+	lua_pushunsigned(L, array->length);
+
+	return 1;
+}
+
+static int io_array_next(lua_State *L)
+{
+	io_array_t *array = io_array_check(L, 1);
+	lua_Unsigned i = luaL_checkunsigned(L, 2);
+
+	if (i >= array->length) {
+		return 0;
+	}
+
+	lua_pushunsigned(L, i + 1);
+	io_array_push_element(L, array, i);
+
+	return 2;
+}
+
+static int io_array_ipairs(lua_State *L)
+{
+	io_array_check(L, 1);
+
+	lua_pushcfunction(L, io_array_next);
+	lua_pushvalue(L, 1);
+	lua_pushinteger(L, 0);
+
+	return 3;
+}
+
+static int io_array_gc(lua_State *L)
+{
+	io_array_free(io_array_check(L, 1));
+
+	return 0;
+}
+
+static const luaL_Reg io_array_metamethods[] = {
+	{ "__index", io_array_index },
+	{ "__gc", io_array_gc },
+	{ "__len", io_array_len },
+	{ "__ipairs", io_array_ipairs },
+	{ NULL, NULL }
+};
+
+/* The userdata holds a reference to the array, so that it outlives a
+ * param freed or replaced while the value is still reachable, as with
+ * lazy params, fetched values and kept states. */
+void io_array_to_lua_stack(io_array_t *array, lua_State *L)
+{
+	io_array_t **ud;
+
+	/* The metatable is set up first so that nothing can fail between
+	 * taking the reference and setting __gc. */
+	if (luaL_newmetatable(L, IO_ARRAY_METATABLE)) {
+		luaL_setfuncs(L, io_array_metamethods, 0);
+		lua_pushliteral(L, "io_array");
+		lua_setfield(L, -2, "__metatable");
+	}
+	ud = lua_newuserdata(L, sizeof(io_array_t *));
+	*ud = array;
+	__sync_add_and_fetch(&(array->refs), 1);
+	lua_insert(L, -2);
+	lua_setmetatable(L, -2);
+}
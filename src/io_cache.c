@@ -0,0 +1,180 @@
+/*
+ * Copyright 2014 Julian Maurice
+ *
+ * This file is part of libio
+ *
+ * libio is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sds.h>
+#include <libgends/hash_map.h>
+#include <libgends/hash_functions.h>
+#include "io_config.h"
+#include "io_parser.h"
+#include "io_inline.h"
+#include "io_cache.h"
+
+#define IO_CACHE_SIZE 64
+
+typedef struct {
+	sds code;
+	unsigned long version;
+	io_dependency_t *dependencies;
+} io_cache_entry_t;
+
+/* The cache belongs to a config, which can be shared by templates rendered
+ * on several threads. Code is compiled outside of the lock. Entries are
+ * keyed by loader key. */
+struct io_cache_s {
+	gds_hash_map_t *entries;
+	pthread_mutex_t lock;
+};
+
+static void io_cache_entry_free(io_cache_entry_t *entry)
+{
+	sdsfree(entry->code);
+	io_dependency_free(entry->dependencies);
+	free(entry);
+}
+
+static gds_hash_map_t * io_cache_entries_new(void)
+{
+	return gds_hash_map_new(IO_CACHE_SIZE, gds_hash_djb2, strcmp, NULL,
+		sdsfree, io_cache_entry_free);
+}
+
+io_cache_t * io_cache_new(void)
+{
+	io_cache_t *cache;
+
+	cache = calloc(1, sizeof(io_cache_t));
+	if (cache != NULL) {
+		cache->entries = io_cache_entries_new();
+	}
+	if (cache == NULL || cache->entries == NULL) {
+		fprintf(stderr, "Memory allocation error\n");
+		free(cache);
+		return NULL;
+	}
+
+	pthread_mutex_init(&(cache->lock), NULL);
+
+	return cache;
+}
+
+static sds io_cache_compile(io_config_t *config, const char *key,
+	io_dependency_t **dependencies)
+{
+	sds source, code;
+
+	source = io_config_load(config, key);
+	if (source == NULL) {
+		return NULL;
+	}
+
+	code = io_parser_parse(source, config);
+	sdsfree(source);
+
+	if (config->inline_includes) {
+		code = io_inline_includes(code, config, dependencies);
+	}
+
+	return code;
+}
+
+/* Returns a copy of the generated code of the template identified by key,
+ * compiling it if it is not cached or if its version (or the version of a
+ * template inlined in it) has changed. */
+sds io_cache_get(io_cache_t *cache, io_config_t *config, const char *key)
+{
+	io_cache_entry_t *found;
+	io_dependency_t *dependencies = NULL;
+	unsigned long version;
+	sds code;
+
+	version = io_config_version(config, key);
+
+	if (cache == NULL) {
+		code = io_cache_compile(config, key, &dependencies);
+		io_dependency_free(dependencies);
+		return code;
+	}
+
+	pthread_mutex_lock(&(cache->lock));
+	found = gds_hash_map_get(cache->entries, key);
+	if (found && found->version == version
+	&& !io_dependency_changed(found->dependencies, config)) {
+		code = sdsdup(found->code);
+		pthread_mutex_unlock(&(cache->lock));
+		return code;
+	}
+	pthread_mutex_unlock(&(cache->lock));
+
+	code = io_cache_compile(config, key, &dependencies);
+	if (code == NULL) {
+		return NULL;
+	}
+
+	found = malloc(sizeof(io_cache_entry_t));
+	if (found == NULL) {
+		io_dependency_free(dependencies);
+		return code;
+	}
+	found->code = sdsdup(code);
+	found->version = version;
+	found->dependencies = dependencies;
+
+	/* Another thread may have replaced the entry meanwhile. */
+	pthread_mutex_lock(&(cache->lock));
+	gds_hash_map_unset(cache->entries, key);
+	gds_hash_map_set(cache->entries, sdsnew(key), found);
+	pthread_mutex_unlock(&(cache->lock));
+
+	return code;
+}
+
+void io_cache_clear(io_cache_t *cache)
+{
+	gds_hash_map_t *entries;
+
+	if (cache == NULL) {
+		return;
+	}
+
+	entries = io_cache_entries_new();
+	if (entries == NULL) {
+		fprintf(stderr, "Memory allocation error\n");
+		return;
+	}
+
+	pthread_mutex_lock(&(cache->lock));
+	gds_hash_map_free(cache->entries);
+	cache->entries = entries;
+	pthread_mutex_unlock(&(cache->lock));
+}
+
+void io_cache_free(io_cache_t *cache)
+{
+	if (cache) {
+		gds_hash_map_free(cache->entries);
+		pthread_mutex_destroy(&(cache->lock));
+		free(cache);
+	}
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright 2014 Julian Maurice
+ *
+ * This file is part of libio
+ *
+ * libio is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef io_cache_h_included
+#define io_cache_h_included
+
+#include <sds.h>
+#include "io_config.h"
+
+typedef struct io_cache_s io_cache_t;
+
+io_cache_t *
+io_cache_new(void);
+
+sds
+io_cache_get(
+	io_cache_t *cache,
+	io_config_t *config,
+	const char *key
+);
+
+void
+io_cache_clear(
+	io_cache_t *cache
+);
+
+void
+io_cache_free(
+	io_cache_t *cache
+);
+
+#endif /* ! io_cache_h_included */
@@ -17,8 +17,18 @@
  * along with libio.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <embody/embody.h>
+#include <libgends/hash_map.h>
+#include <libgends/hash_functions.h>
 #include "io_config.h"
+#include "io_cache.h"
+#include "io_watch.h"
 
 static const char io_default_code_start_tag[] = "{%";
 static const char io_default_code_end_tag[] = "%}";
@@ -54,6 +64,15 @@ io_config_t * io_config_new(const char *code_start_tag,
 	config->directories = gds_slist_new(sdsfree);
 	gds_slist_push(config->directories, sdsnew("."));
 
+	config->inline_includes = 0;
+	config->number_precision = 14;
+	config->stream_size = 1 << 20;
+	config->loader = NULL;
+	config->cache = io_cache_new();
+	config->watch = NULL;
+	config->params = NULL;
+	config->params_version = 0;
+
 	return config;
 }
 
@@ -62,6 +81,143 @@ io_config_t * io_config_new_default(void)
 	return io_config_new(NULL, NULL, NULL, NULL, NULL, NULL);
 }
 
+sds io_config_find_file(io_config_t *config, const char *filename)
+{
+	sds filepath = NULL;
+	sds d;
+	FILE *fp;
+	int exists;
+
+	gds_slist_foreach(d, config->directories) {
+		filepath = sdsdup(d);
+		filepath = sdscat(filepath, "/");
+		filepath = sdscat(filepath, filename);
+		exists = config->watch
+			? io_watch_exists(config->watch, filepath) : -1;
+		if (exists == 1) {
+			break;
+		}
+		if (exists < 0 && (fp = fopen(filepath, "r"))) {
+			/* File exists and is readable */
+			fclose(fp);
+			break;
+		}
+		sdsfree(filepath);
+		filepath = NULL;
+	}
+
+	return filepath;
+}
+
+void io_config_param(io_config_t *config, const char *name, void *value)
+{
+	gds_hash_map_t *params;
+
+	if (config == NULL) {
+		fprintf(stderr, "config is NULL in io_config_param\n");
+		return;
+	}
+
+	if (config->params == NULL) {
+		params = gds_hash_map_new(128, gds_hash_djb2, strcmp, NULL,
+			emb_container_free, emb_container_free);
+		config->params = emb_new("gds_hash_map", params);
+	}
+
+	gds_hash_map_set(*(config->params), emb_new("sds", sdsnew(name)), value);
+	config->params_version++;
+}
+
+int io_config_watch(io_config_t *config)
+{
+	if (config == NULL) {
+		return -1;
+	}
+
+	if (config->watch == NULL) {
+		config->watch = io_watch_new(config->directories);
+		if (config->watch == NULL) {
+			return -1;
+		}
+		io_cache_clear(config->cache);
+	}
+
+	return 0;
+}
+
+void io_config_set_loader(io_config_t *config, io_loader_t *loader)
+{
+	if (config) {
+		io_loader_free(config->loader);
+		config->loader = loader;
+		io_cache_clear(config->cache);
+	}
+}
+
+sds io_config_lookup(io_config_t *config, const char *name)
+{
+	if (config->loader) {
+		return config->loader->lookup(config->loader, name);
+	}
+
+	return io_config_find_file(config, name);
+}
+
+sds io_config_load(io_config_t *config, const char *key)
+{
+	char buf[4096];
+	sds source;
+	size_t n;
+	FILE *fp;
+
+	if (config->loader) {
+		return config->loader->load(config->loader, key);
+	}
+
+	fp = fopen(key, "r");
+	if (fp == NULL) {
+		return NULL;
+	}
+
+	source = sdsempty();
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		source = sdscatlen(source, buf, n);
+	}
+	fclose(fp);
+
+	return source;
+}
+
+int io_config_streamed(io_config_t *config, const char *key)
+{
+	struct stat st;
+
+	if (config->loader || config->stream_size == 0) {
+		return 0;
+	}
+
+	return stat(key, &st) == 0 && (size_t) st.st_size > config->stream_size;
+}
+
+unsigned long io_config_version(io_config_t *config, const char *key)
+{
+	unsigned long version;
+	struct stat st;
+
+	if (config->loader) {
+		if (config->loader->version) {
+			return config->loader->version(config->loader, key);
+		}
+		return 0;
+	}
+
+	if (config->watch && io_watch_version(config->watch, key, &version) == 0) {
+		return version;
+	}
+
+	return stat(key, &st) == 0 ? (unsigned long) st.st_mtime : 0;
+}
+
 void io_config_free(io_config_t *config)
 {
 	if (config) {
@@ -73,6 +229,12 @@ void io_config_free(io_config_t *config)
 		sdsfree(config->comm_end_tag);
 
 		gds_slist_free(config->directories);
+		io_watch_free(config->watch);
+		io_loader_free(config->loader);
+		io_cache_free(config->cache);
+		if (config->params) {
+			emb_free(config->params);
+		}
 
 		free(config);
 	}
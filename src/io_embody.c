@@ -28,6 +28,8 @@
 #include <embody/embody.h>
 #include <lua.h>
 #include "io_lua_value.h"
+#include "io_array.h"
+#include "io_struct.h"
 
 static void io_bool_to_lua_value(_Bool *data, io_lua_value_t *lua_value)
 {
@@ -75,6 +77,9 @@ IO_PTR_TO_LUA_VALUE_FUNC(string, char *, LUA_VALUE_TYPE_STRING, string);
 IO_PTR_TO_LUA_VALUE_FUNC(cfunction, lua_CFunction, LUA_VALUE_TYPE_CFUNCTION, cfunction);
 IO_PTR_TO_LUA_VALUE_FUNC(list, void *, LUA_VALUE_TYPE_LIST, list);
 IO_PTR_TO_LUA_VALUE_FUNC(table, void *, LUA_VALUE_TYPE_TABLE, table);
+IO_PTR_TO_LUA_VALUE_FUNC(array, void *, LUA_VALUE_TYPE_ARRAY, array);
+IO_PTR_TO_LUA_VALUE_FUNC(json, void *, LUA_VALUE_TYPE_JSON, json);
+IO_PTR_TO_LUA_VALUE_FUNC(struct, void *, LUA_VALUE_TYPE_STRUCT, structure);
 
 static void io_emb_register_callback(emb_type_t *type, const char *name,
 	void *callback)
@@ -186,6 +191,18 @@ static void io_emb_initialize_lua_types(void)
 
 	type = emb_type_get("cfunction");
 	io_emb_register_to_lua_value(type, io_cfunction_to_lua_value);
+
+	type = emb_type_get("io_array");
+	io_emb_register_to_lua_value(type, io_array_to_lua_value);
+	io_emb_register_free(type, io_array_free);
+
+	type = emb_type_get("io_struct");
+	io_emb_register_to_lua_value(type, io_struct_to_lua_value);
+	io_emb_register_free(type, io_struct_free);
+
+	type = emb_type_get("io_json");
+	io_emb_register_to_lua_value(type, io_json_to_lua_value);
+	io_emb_register_free(type, sdsfree);
 }
 
 static void io_emb_initialize_gds_types(void)
@@ -0,0 +1,204 @@
+/*
+ * Copyright 2014 Julian Maurice
+ *
+ * This file is part of libio
+ *
+ * libio is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sds.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include "io_filter.h"
+#include "io_strlib.h"
+
+typedef struct {
+	sds name;
+	io_filter_t filter;
+} io_filter_entry_t;
+
+static io_filter_entry_t *io_filters = NULL;
+static size_t io_filters_count = 0;
+
+static void io_filter_trim(sds *out, const char *in, size_t len,
+	lua_State *L, int arg, int nargs)
+{
+	(void) L; (void) arg; (void) nargs;
+
+	while (len && strchr(" \t\r\n", *in)) {
+		in++;
+		len--;
+	}
+	while (len && strchr(" \t\r\n", in[len - 1])) {
+		len--;
+	}
+
+	*out = sdscatlen(*out, in, len);
+}
+
+static void io_filter_upper(sds *out, const char *in, size_t len,
+	lua_State *L, int arg, int nargs)
+{
+	size_t i, start = sdslen(*out);
+
+	(void) L; (void) arg; (void) nargs;
+
+	*out = sdscatlen(*out, in, len);
+	for (i = start; i < start + len; i++) {
+		if ((*out)[i] >= 'a' && (*out)[i] <= 'z') {
+			(*out)[i] -= 'a' - 'A';
+		}
+	}
+}
+
+static void io_filter_lower(sds *out, const char *in, size_t len,
+	lua_State *L, int arg, int nargs)
+{
+	size_t i, start = sdslen(*out);
+
+	(void) L; (void) arg; (void) nargs;
+
+	*out = sdscatlen(*out, in, len);
+	for (i = start; i < start + len; i++) {
+		if ((*out)[i] >= 'A' && (*out)[i] <= 'Z') {
+			(*out)[i] += 'a' - 'A';
+		}
+	}
+}
+
+/* HTML escaping. */
+static void io_filter_escape(sds *out, const char *in, size_t len,
+	lua_State *L, int arg, int nargs)
+{
+	const char *run = in, *entity;
+	size_t i;
+
+	(void) L; (void) arg; (void) nargs;
+
+	for (i = 0; i < len; i++) {
+		switch (in[i]) {
+			case '&': entity = "&amp;"; break;
+			case '<': entity = "&lt;"; break;
+			case '>': entity = "&gt;"; break;
+			case '"': entity = "&quot;"; break;
+			case '\'': entity = "&#39;"; break;
+			default: continue;
+		}
+		*out = sdscatlen(*out, run, in + i - run);
+		*out = sdscat(*out, entity);
+		run = in + i + 1;
+	}
+	*out = sdscatlen(*out, run, in + len - run);
+}
+
+/* truncate(n [, ellipsis]), see Io.truncate. */
+static void io_filter_truncate(sds *out, const char *in, size_t len,
+	lua_State *L, int arg, int nargs)
+{
+	lua_Integer n;
+	const char *ellipsis = "...";
+	size_t ellipsis_len = 3, cut;
+
+	luaL_argcheck(L, nargs >= 1, arg, "truncate expects a length");
+	n = luaL_checkinteger(L, arg);
+	luaL_argcheck(L, n >= 0, arg, "must be non-negative");
+	if (nargs >= 2) {
+		ellipsis = luaL_checklstring(L, arg + 1, &ellipsis_len);
+	}
+
+	cut = io_utf8_offset(in, len, n);
+	*out = sdscatlen(*out, in, cut);
+	if (cut < len) {
+		*out = sdscatlen(*out, ellipsis, ellipsis_len);
+	}
+}
+
+static const io_filter_entry_t io_filters_builtin[] = {
+	{ "escape", io_filter_escape },
+	{ "lower", io_filter_lower },
+	{ "trim", io_filter_trim },
+	{ "truncate", io_filter_truncate },
+	{ "upper", io_filter_upper },
+	{ NULL, NULL }
+};
+
+double io_filter_arg_number(lua_State *L, int arg)
+{
+	return luaL_checknumber(L, arg);
+}
+
+const char * io_filter_arg_string(lua_State *L, int arg, size_t *len)
+{
+	return luaL_checklstring(L, arg, len);
+}
+
+int io_filter_register(const char *name, io_filter_t filter)
+{
+	io_filter_entry_t *filters;
+	size_t i;
+
+	for (i = 0; i < io_filters_count; i++) {
+		if (!strcmp(io_filters[i].name, name)) {
+			io_filters[i].filter = filter;
+			return 0;
+		}
+	}
+
+	filters = realloc(io_filters,
+		(io_filters_count + 1) * sizeof(io_filter_entry_t));
+	if (filters == NULL) {
+		fprintf(stderr, "Memory allocation error\n");
+		return -1;
+	}
+	io_filters = filters;
+	io_filters[io_filters_count].name = sdsnew(name);
+	io_filters[io_filters_count].filter = filter;
+	io_filters_count++;
+
+	return 0;
+}
+
+io_filter_t io_filter_get(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < io_filters_count; i++) {
+		if (!strcmp(io_filters[i].name, name)) {
+			return io_filters[i].filter;
+		}
+	}
+
+	for (i = 0; io_filters_builtin[i].name; i++) {
+		if (!strcmp(io_filters_builtin[i].name, name)) {
+			return io_filters_builtin[i].filter;
+		}
+	}
+
+	return NULL;
+}
+
+void io_filter_free(void)
+{
+	size_t i;
+
+	for (i = 0; i < io_filters_count; i++) {
+		sdsfree(io_filters[i].name);
+	}
+	free(io_filters);
+	io_filters = NULL;
+	io_filters_count = 0;
+}
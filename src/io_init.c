@@ -19,6 +19,9 @@
 
 #include "io_globals.h"
 #include "io_embody.h"
+#include "io_trace.h"
+#include "io_filter.h"
+#include "io_pool.h"
 
 static int io_initialized = 0;
 void io_initialize(void)
@@ -32,6 +35,9 @@ void io_initialize(void)
 
 void io_finalize(void)
 {
+	io_pool_free();
 	io_globals_free();
+	io_trace_free();
+	io_filter_free();
 	io_initialized = 0;
 }
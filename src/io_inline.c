@@ -0,0 +1,350 @@
+/*
+ * Copyright 2014 Julian Maurice
+ *
+ * This file is part of libio
+ *
+ * libio is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sds.h>
+#include "io_config.h"
+#include "io_parser.h"
+#include "io_inline.h"
+
+/* Included files are compiled into functions stored in a local table of
+ * the main chunk:
+ *
+ *   local __io_inc = {} local __io_main = function(...) <main>
+ *   end __io_inc[1] = function(_ENV, ...) <header.inc>
+ *   end return __io_main(...)
+ *
+ * and Io.include('header.inc') is replaced by __io_inc[1](_ENV), which
+ * gives the included code the _ENV of the caller as Io.include does. The
+ * main code starts on the first line so line numbers in error messages are
+ * unchanged. */
+
+typedef struct io_inline_file_s {
+	sds name;
+	unsigned int index;
+	struct io_inline_file_s *next;
+} io_inline_file_t;
+
+typedef struct {
+	io_config_t *config;
+	io_inline_file_t *files;
+	unsigned int n;
+	sds defs;
+	io_dependency_t **dependencies;
+} io_inline_t;
+
+static size_t io_inline_skip_string(const char *code, size_t i, size_t len)
+{
+	char quote = code[i];
+
+	for (i++; i < len && code[i] != quote; i++) {
+		if (code[i] == '\\') {
+			i++;
+		}
+	}
+
+	return i < len ? i + 1 : len;
+}
+
+/* If a long bracket ([[, [=[, ...) starts at i, returns the position right
+ * after the matching closing bracket. Otherwise returns i. */
+static size_t io_inline_skip_long_bracket(const char *code, size_t i,
+	size_t len)
+{
+	size_t level = 0, j, k;
+
+	if (code[i] != '[') {
+		return i;
+	}
+
+	for (j = i + 1; j < len && code[j] == '='; j++) level++;
+	if (j >= len || code[j] != '[') {
+		return i;
+	}
+
+	for (j++; j < len; j++) {
+		if (code[j] != ']') continue;
+		for (k = 1; k <= level && j + k < len && code[j + k] == '='; k++);
+		if (k > level && j + k < len && code[j + k] == ']') {
+			return j + k + 1;
+		}
+	}
+
+	return len;
+}
+
+static size_t io_inline_skip_space(const char *code, size_t i, size_t len)
+{
+	while (i < len && isspace((unsigned char) code[i])) i++;
+
+	return i;
+}
+
+/* Parses the argument list of a call to Io.include starting at i. On
+ * success, name is set to the file name and the position after the call
+ * is returned. Returns 0 if the argument is not a single literal string. */
+static size_t io_inline_parse_call(const char *code, size_t i, size_t len,
+	sds *name)
+{
+	size_t start, end;
+	int parens = 0;
+	char quote;
+
+	i = io_inline_skip_space(code, i, len);
+	if (i < len && code[i] == '(') {
+		parens = 1;
+		i = io_inline_skip_space(code, i + 1, len);
+	}
+
+	if (i >= len || (code[i] != '\'' && code[i] != '"')) {
+		return 0;
+	}
+
+	quote = code[i];
+	start = i + 1;
+	for (end = start; end < len && code[end] != quote; end++) {
+		if (code[end] == '\\' || code[end] == '\n') {
+			return 0;
+		}
+	}
+	if (end >= len) {
+		return 0;
+	}
+
+	i = end + 1;
+	if (parens) {
+		i = io_inline_skip_space(code, i, len);
+		if (i >= len || code[i] != ')') {
+			return 0;
+		}
+		i++;
+	}
+
+	*name = sdsnewlen(code + start, end - start);
+
+	return i;
+}
+
+static void io_inline_add_dependency(io_inline_t *ctx, sds key,
+	unsigned long version)
+{
+	io_dependency_t *dep;
+
+	dep = malloc(sizeof(io_dependency_t));
+	if (dep == NULL) {
+		return;
+	}
+
+	dep->key = sdsdup(key);
+	dep->version = version;
+	dep->next = *(ctx->dependencies);
+	*(ctx->dependencies) = dep;
+}
+
+static sds io_inline_code(io_inline_t *ctx, sds code);
+
+/* Returns the index of the function for the file, or 0 if the file cannot
+ * be found or is streamed, in which case the call is left to Io.include at
+ * runtime. */
+static unsigned int io_inline_file(io_inline_t *ctx, sds name)
+{
+	io_inline_file_t *file;
+	unsigned long version;
+	sds key, source, code;
+
+	for (file = ctx->files; file; file = file->next) {
+		if (!strcmp(file->name, name)) {
+			return file->index;
+		}
+	}
+
+	key = io_config_lookup(ctx->config, name);
+	if (key == NULL) {
+		return 0;
+	}
+
+	if (io_config_streamed(ctx->config, key)) {
+		sdsfree(key);
+		return 0;
+	}
+
+	/* Version is taken before loading, so that a change made meanwhile is
+	 * seen on the next check. */
+	version = io_config_version(ctx->config, key);
+	source = io_config_load(ctx->config, key);
+	if (source == NULL) {
+		sdsfree(key);
+		return 0;
+	}
+	code = io_parser_parse(source, ctx->config);
+	sdsfree(source);
+	if (code == NULL) {
+		sdsfree(key);
+		return 0;
+	}
+
+	/* Registered before its own includes are inlined, so that recursive
+	 * includes refer to the same function. */
+	file = malloc(sizeof(io_inline_file_t));
+	if (file == NULL) {
+		sdsfree(code);
+		sdsfree(key);
+		return 0;
+	}
+	file->name = sdsdup(name);
+	file->index = ++ctx->n;
+	file->next = ctx->files;
+	ctx->files = file;
+
+	io_inline_add_dependency(ctx, key, version);
+	sdsfree(key);
+
+	code = io_inline_code(ctx, code);
+	ctx->defs = sdscatprintf(ctx->defs, "__io_inc[%u] = function(_ENV, ...) ",
+		file->index);
+	ctx->defs = sdscatsds(ctx->defs, code);
+	ctx->defs = sdscat(ctx->defs, "\nend ");
+	sdsfree(code);
+
+	return file->index;
+}
+
+static int io_inline_is_ident(char c)
+{
+	return isalnum((unsigned char) c) || c == '_';
+}
+
+static sds io_inline_code(io_inline_t *ctx, sds code)
+{
+	static const char call[] = "Io.include";
+	size_t call_len = sizeof(call) - 1;
+	size_t len = sdslen(code), i = 0, last = 0, j;
+	unsigned int index;
+	sds out = NULL, name;
+
+	while (i < len) {
+		char c = code[i];
+
+		if (c == '-' && i + 1 < len && code[i + 1] == '-') {
+			j = io_inline_skip_long_bracket(code, i + 2, len);
+			if (j == i + 2) {
+				while (j < len && code[j] != '\n') j++;
+			}
+			i = j;
+		} else if (c == '\'' || c == '"') {
+			i = io_inline_skip_string(code, i, len);
+		} else if (c == '[' && (j = io_inline_skip_long_bracket(code, i, len)) > i) {
+			i = j;
+		} else if (io_inline_is_ident(c)) {
+			if ((i == 0 || (code[i - 1] != '.' && code[i - 1] != ':'))
+			&& len - i > call_len && !memcmp(code + i, call, call_len)
+			&& !io_inline_is_ident(code[i + call_len])
+			&& (j = io_inline_parse_call(code, i + call_len, len, &name))) {
+				index = io_inline_file(ctx, name);
+				sdsfree(name);
+				if (index) {
+					if (out == NULL) out = sdsempty();
+					out = sdscatlen(out, code + last, i - last);
+					out = sdscatprintf(out, "__io_inc[%u](_ENV)", index);
+					last = i = j;
+					continue;
+				}
+			}
+			while (i < len && io_inline_is_ident(code[i])) i++;
+		} else {
+			i++;
+		}
+	}
+
+	if (out == NULL) {
+		return code;
+	}
+
+	out = sdscatlen(out, code + last, len - last);
+	sdsfree(code);
+
+	return out;
+}
+
+sds io_inline_includes(sds code, io_config_t *config,
+	io_dependency_t **dependencies)
+{
+	io_inline_file_t *file, *next;
+	io_inline_t ctx;
+	sds out;
+
+	if (code == NULL) {
+		return NULL;
+	}
+
+	ctx.config = config;
+	ctx.files = NULL;
+	ctx.n = 0;
+	ctx.defs = sdsempty();
+	ctx.dependencies = dependencies;
+
+	code = io_inline_code(&ctx, code);
+
+	if (ctx.n > 0) {
+		out = sdsnew("local __io_inc = {} local __io_main = function(...) ");
+		out = sdscatsds(out, code);
+		out = sdscat(out, "\nend ");
+		out = sdscatsds(out, ctx.defs);
+		out = sdscat(out, "return __io_main(...)");
+		sdsfree(code);
+		code = out;
+	}
+
+	for (file = ctx.files; file; file = next) {
+		next = file->next;
+		sdsfree(file->name);
+		free(file);
+	}
+	sdsfree(ctx.defs);
+
+	return code;
+}
+
+int io_dependency_changed(io_dependency_t *dependencies, io_config_t *config)
+{
+	io_dependency_t *dep;
+
+	for (dep = dependencies; dep; dep = dep->next) {
+		if (io_config_version(config, dep->key) != dep->version) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+void io_dependency_free(io_dependency_t *dependencies)
+{
+	io_dependency_t *dep, *next;
+
+	for (dep = dependencies; dep; dep = next) {
+		next = dep->next;
+		sdsfree(dep->key);
+		free(dep);
+	}
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright 2014 Julian Maurice
+ *
+ * This file is part of libio
+ *
+ * libio is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef io_inline_h_included
+#define io_inline_h_included
+
+#include <sds.h>
+#include "io_config.h"
+
+typedef struct io_dependency_s {
+	sds key;
+	unsigned long version;
+	struct io_dependency_s *next;
+} io_dependency_t;
+
+sds
+io_inline_includes(
+	sds code,
+	io_config_t *config,
+	io_dependency_t **dependencies
+);
+
+int
+io_dependency_changed(
+	io_dependency_t *dependencies,
+	io_config_t *config
+);
+
+void
+io_dependency_free(
+	io_dependency_t *dependencies
+);
+
+#endif /* ! io_inline_h_included */
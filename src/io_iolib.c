@@ -25,107 +25,272 @@
 #include <sds.h>
 #include "io_template.h"
 #include "io_template_private.h"
+#include "io_iolib.h"
+#include "io_cache.h"
+#include "io_trace.h"
+#include "io_value.h"
+#include "io_strlib.h"
+#include "io_json.h"
+#include "io_number.h"
 
-static sds io_iolib_find_file(gds_slist_t *directories, const char *filename)
+/* Continuation of Io.include, called instead of returning from lua_pcallk
+ * when the included template yielded. */
+static int io_iolib_include_continue(lua_State *L)
 {
-	sds filepath = NULL;
-	sds d;
-	FILE *fp;
-
-	gds_slist_foreach(d, directories) {
-		filepath = sdsdup(d);
-		filepath = sdscat(filepath, "/");
-		filepath = sdscat(filepath, filename);
-		if ( (fp = fopen(filepath, "r")) ) {
-			/* File exists and is readable */
-			fclose(fp);
-			break;
-		}
-		sdsfree(filepath);
+	int ctx;
+
+	if (lua_getctx(L, &ctx) != LUA_YIELD) {
+		fprintf(stderr, "ERROR: %s\n", lua_tostring(L, -1));
 	}
 
-	return filepath;
+	io_trace_end("io_iolib_include");
+
+	return 0;
 }
 
 int io_iolib_include(lua_State *L)
 {
 	const char *filename;
-	sds filepath;
-	io_template_t *T, *template;
-	char *code;
-	int n;
+	sds key, code;
+	io_render_t *R;
+	io_template_t *T;
+	int n, status = LUA_ERRRUN;
 	lua_Debug ar;
 
+	io_trace_begin("io_iolib_include");
+
 	n = lua_gettop(L);
 
-	lua_getfield(L, LUA_REGISTRYINDEX, "io_template");
-	T = lua_touserdata(L, -1);
+	lua_getfield(L, LUA_REGISTRYINDEX, "io_render");
+	R = lua_touserdata(L, -1);
 	lua_pop(L, 1);
+	T = R->T;
 
 	filename = lua_tostring(L, 1);
-	filepath = io_iolib_find_file(T->config->directories, filename);
-	if (filepath == NULL) {
+	key = io_config_lookup(T->config, filename);
+	if (key == NULL) {
 		fprintf(stderr, "File %s not found\n", filename);
-		return -1;
-	}
-
-	template = io_template_new(T->config);
-	io_template_set_template_file(template, filepath);
-	code = template->code;
-	if (code != NULL) {
-		int status = luaL_loadbuffer(L, code, strlen(code), filename);
-		if (status == LUA_OK) {
-			if (n > 1) {
-				/* Set _ENV to given parameter. */
-				lua_pushvalue(L, 2);
-				lua_setupvalue(L, -2, 1);
-			} else if (lua_getstack(L, 1, &ar) && lua_getinfo(L, "fn", &ar) && !lua_iscfunction(L, -1)) {
-				/* Set _ENV = _ENV */
-				lua_getupvalue(L, -1, 1);
-				lua_setupvalue(L, -3, 1);
-				lua_pop(L, 1);
-			}
-			if(lua_pcall(L, 0, 0, 0) != LUA_OK) {
-				fprintf(stderr, "ERROR: %s\n", lua_tostring(L, -1));
-			}
-		} else {
+		io_trace_end("io_iolib_include");
+		return 0;
+	}
+
+	/* status stays LUA_ERRRUN, which lua_load never returns, when the
+	 * file could not be parsed. */
+	code = NULL;
+	if (io_config_streamed(T->config, key)) {
+		status = io_render_load_file(L, T->config, key, filename);
+	} else if ((code = io_cache_get(T->config->cache, T->config, key))) {
+		io_trace_begin("lua_load");
+		status = luaL_loadbuffer(L, code, sdslen(code), filename);
+		io_trace_end("lua_load");
+	}
+	sdsfree(code);
+	sdsfree(key);
+
+	if (status == LUA_OK) {
+		if (n > 1) {
+			/* Set _ENV to given parameter. */
+			lua_pushvalue(L, 2);
+			lua_setupvalue(L, -2, 1);
+		} else if (lua_getstack(L, 1, &ar) && lua_getinfo(L, "fn", &ar) && !lua_iscfunction(L, -1)) {
+			/* Set _ENV = _ENV */
+			lua_getupvalue(L, -1, 1);
+			lua_setupvalue(L, -3, 1);
+			lua_pop(L, 1);
+		}
+	} else if (status != LUA_ERRRUN) {
+		fprintf(stderr, "ERROR: %s\n", lua_tostring(L, -1));
+	}
+
+	if (status == LUA_OK) {
+		/* Nothing must be left to clean up past this point, as the
+		 * included template may yield. */
+		status = lua_pcallk(L, 0, 0, 0, 0, io_iolib_include_continue);
+		if (status != LUA_OK) {
 			fprintf(stderr, "ERROR: %s\n", lua_tostring(L, -1));
 		}
 	}
-	io_template_free(template);
-	sdsfree(filepath);
+
+	io_trace_end("io_iolib_include");
+
+	return 0;
+}
+
+/* Io.output can only yield when no C function other than the ones in
+ * registry.io_yieldable (pcall and friends) is running below it. */
+static int io_iolib_yieldable(lua_State *L)
+{
+	lua_Debug ar;
+	int level, yieldable = 1;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, "io_yieldable");
+	for (level = 1; yieldable && lua_getstack(L, level, &ar); level++) {
+		lua_getinfo(L, "Sf", &ar);
+		if (ar.what[0] == 'C') {
+			lua_rawget(L, -2);
+			yieldable = lua_toboolean(L, -1);
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+
+	return yieldable;
+}
+
+/* Arguments are appended to the output as they are: strings without a
+ * copy, numbers formatted in a local buffer. */
+const char * io_iolib_tostring(lua_State *L, io_render_t *R, int idx,
+	char *buf, size_t *len)
+{
+	const char *s;
+
+	switch (lua_type(L, idx)) {
+		case LUA_TBOOLEAN:
+			*len = 1;
+			return lua_toboolean(L, idx) ? "1" : "0";
+		case LUA_TNUMBER:
+			*len = io_number_format(buf, lua_tonumber(L, idx),
+				R->number_precision);
+			return buf;
+		case LUA_TSTRING:
+			return lua_tolstring(L, idx, len);
+		default:
+			s = lua_typename(L, lua_type(L, idx));
+			*len = strlen(s);
+			return s;
+	}
+}
+
+void io_iolib_write(lua_State *L, io_render_t *R, const char *s, size_t len)
+{
+	if (io_render_output_exceeds(R, len)) {
+		luaL_error(L, "memory limit exceeded");
+	}
+	R->output = sdscatlen(R->output, s, len);
+}
+
+int io_iolib_written(lua_State *L, io_render_t *R)
+{
+	if (L == R->co && sdslen(R->output) >= R->threshold
+	&& io_iolib_yieldable(L)) {
+		return lua_yield(L, 0);
+	}
 
 	return 0;
 }
 
 int io_iolib_output(lua_State *L)
 {
-	sds *output_p;
-	sds s;
+	io_render_t *R;
+	char buf[IO_NUMBER_BUFSIZE];
+	const char *s;
+	size_t len;
 	int i, n;
 
 	n = lua_gettop(L);
 
-	lua_getfield(L, LUA_REGISTRYINDEX, "io_output");
-	output_p = lua_touserdata(L, -1);
+	lua_getfield(L, LUA_REGISTRYINDEX, "io_render");
+	R = lua_touserdata(L, -1);
 	lua_pop(L, 1);
 
-	for (i = -n; i < 0; i++) {
-		switch (lua_type(L, i)) {
-			case LUA_TBOOLEAN:
-				s = sdsfromlonglong(lua_toboolean(L, i));
-				break;
-			case LUA_TNUMBER:
-			case LUA_TSTRING:
-				s = sdsnew(lua_tostring(L, i));
-				break;
-
-			default:
-				s = sdsnew(lua_typename(L, lua_type(L, i)));
-		}
-		//fprintf(stderr, "DEBUG: %s (%s)\n", s, lua_typename(L, lua_type(L, i)));
-		*output_p = sdscat(*output_p, s);
-		sdsfree(s);
+	for (i = 1; i <= n; i++) {
+		s = io_iolib_tostring(L, R, i, buf, &len);
+		io_iolib_write(L, R, s, len);
+	}
+
+	return io_iolib_written(L, R);
+}
+
+/* Suspend the render until the host provides the value named by the first
+ * argument, see io_template_render_fulfil(). */
+int io_iolib_fetch(lua_State *L)
+{
+	io_render_t *R;
+	const char *name;
+
+	name = luaL_checkstring(L, 1);
+
+	lua_getfield(L, LUA_REGISTRYINDEX, "io_render");
+	R = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+
+	if (L != R->co || !io_iolib_yieldable(L)) {
+		return luaL_error(L, "Io.fetch('%s') needs a pull-based render"
+			" and cannot be called from a C function", name);
+	}
+
+	R->fetch = sdsnew(name);
+
+	return lua_yield(L, 0);
+}
+
+/* Io.spawn(filename [, params]) renders filename on another thread, in its
+ * own Lua state with a copy of params as environment, and inserts its
+ * output at the current position. */
+int io_iolib_spawn(lua_State *L)
+{
+	const char *filename;
+	sds key, params = NULL;
+	io_render_t *R;
+
+	filename = luaL_checkstring(L, 1);
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+	}
+
+	lua_getfield(L, LUA_REGISTRYINDEX, "io_render");
+	R = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+
+	key = io_config_lookup(R->T->config, filename);
+	if (key == NULL) {
+		fprintf(stderr, "File %s not found\n", filename);
+		return 0;
+	}
+
+	if (!lua_isnoneornil(L, 2)) {
+		params = io_value_dump(L, 2, sdsempty());
+	}
+
+	io_render_spawn(R, key, params);
+
+	return 0;
+}
+
+/* Io.spawn_each(name, filename [, params [, partitions]]) renders filename
+ * once per element of the stash list name, on worker threads, with item
+ * and index set in the environment, and inserts the outputs in order at
+ * the current position. */
+int io_iolib_spawn_each(lua_State *L)
+{
+	const char *name, *filename;
+	sds key, params = NULL;
+	unsigned int partitions;
+	io_render_t *R;
+
+	name = luaL_checkstring(L, 1);
+	filename = luaL_checkstring(L, 2);
+	if (!lua_isnoneornil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+	}
+	partitions = luaL_optunsigned(L, 4, 0);
+
+	lua_getfield(L, LUA_REGISTRYINDEX, "io_render");
+	R = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+
+	key = io_config_lookup(R->T->config, filename);
+	if (key == NULL) {
+		fprintf(stderr, "File %s not found\n", filename);
+		return 0;
+	}
+
+	if (!lua_isnoneornil(L, 3)) {
+		params = io_value_dump(L, 3, sdsempty());
+	}
+
+	if (io_render_spawn_each(R, name, key, params, partitions) < 0) {
+		return luaL_error(L, "%s is not a list", name);
 	}
 
 	return 0;
@@ -133,14 +298,66 @@ int io_iolib_output(lua_State *L)
 
 static const char IO_IOLIB_NAME[] = "Io";
 static const luaL_Reg io_iolib_functions[] = {
+	{ "fetch", io_iolib_fetch },
+	{ "filter", io_strlib_filter },
+	{ "format_date", io_strlib_format_date },
+	{ "format_number", io_strlib_format_number },
 	{ "include", io_iolib_include },
+	{ "join", io_strlib_join },
+	{ "json", io_json_encode },
 	{ "output", io_iolib_output },
+	{ "spawn", io_iolib_spawn },
+	{ "spawn_each", io_iolib_spawn_each },
+	{ "truncate", io_strlib_truncate },
+	{ "url_encode", io_strlib_url_encode },
+	{ "utf8_len", io_strlib_utf8_len },
+	{ "utf8_sub", io_strlib_utf8_sub },
+	{ NULL, NULL }
+};
+
+/* Io.out: the same helpers, writing to the output. */
+static const luaL_Reg io_iolib_out_functions[] = {
+	{ "filter", io_strlib_out_filter },
+	{ "format_date", io_strlib_out_format_date },
+	{ "format_number", io_strlib_out_format_number },
+	{ "join", io_strlib_out_join },
+	{ "json", io_json_out_encode },
+	{ "truncate", io_strlib_out_truncate },
+	{ "url_encode", io_strlib_out_url_encode },
+	{ "utf8_sub", io_strlib_out_utf8_sub },
 	{ NULL, NULL }
 };
 
+static void io_iolib_set_yieldable(lua_State *L, int yieldable, int idx,
+	const char *name)
+{
+	lua_getfield(L, idx, name);
+	if (lua_iscfunction(L, -1)) {
+		lua_pushboolean(L, 1);
+		lua_rawset(L, yieldable);
+	} else {
+		lua_pop(L, 1);
+	}
+}
+
 int io_luaopen_iolib(lua_State *L)
 {
+	int lib, yieldable, globals;
+
 	luaL_newlib(L, io_iolib_functions);
+	lib = lua_gettop(L);
+	luaL_newlib(L, io_iolib_out_functions);
+	lua_setfield(L, lib, "out");
+
+	lua_newtable(L);
+	yieldable = lua_gettop(L);
+	lua_pushglobaltable(L);
+	globals = lua_gettop(L);
+	io_iolib_set_yieldable(L, yieldable, globals, "pcall");
+	io_iolib_set_yieldable(L, yieldable, globals, "xpcall");
+	io_iolib_set_yieldable(L, yieldable, lib, "include");
+	lua_pop(L, 1);
+	lua_setfield(L, LUA_REGISTRYINDEX, "io_yieldable");
 
 	return 1;
 }
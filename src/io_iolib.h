@@ -20,7 +20,43 @@
 #ifndef libio_iolib_h_included
 #define libio_iolib_h_included
 
+#include <stddef.h>
+#include <lua.h>
+#include "io_template.h"
+
 int io_require_io(lua_State *L);
 
+/* Returns the text Io.output writes for the value at idx: "1" or "0" for
+ * booleans, numbers formatted with the precision of the render, strings
+ * as they are and the type name of other values. Numbers are formatted in
+ * buf, which must hold IO_NUMBER_BUFSIZE bytes. */
+const char *
+io_iolib_tostring(
+	lua_State *L,
+	io_render_t *R,
+	int idx,
+	char *buf,
+	size_t *len
+);
+
+/* Appends to the output of the render, raising an error when it would
+ * exceed the memory limit. */
+void
+io_iolib_write(
+	lua_State *L,
+	io_render_t *R,
+	const char *s,
+	size_t len
+);
+
+/* Ends a C function called by a template that wrote to the output, as
+ * return io_iolib_written(L, R): a pull render is suspended once its
+ * threshold is reached. */
+int
+io_iolib_written(
+	lua_State *L,
+	io_render_t *R
+);
+
 #endif /* ! libio_iolib_h_included */
 
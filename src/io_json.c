@@ -0,0 +1,790 @@
+/*
+ * Copyright 2014 Julian Maurice
+ *
+ * This file is part of libio
+ *
+ * libio is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <sds.h>
+#include "io_template_private.h"
+#include "io_json.h"
+#include "io_number.h"
+#include "io_iolib.h"
+#include "io_readonly.h"
+
+#define IO_JSON_MAX_DEPTH 128
+
+/* JSON is always written at the end of the render output; Io.json() then
+ * takes it back as a string. */
+typedef struct {
+	lua_State *L;
+	io_render_t *R;
+	int depth;
+} io_json_encoder_t;
+
+static void io_json_cat(io_json_encoder_t *E, const char *s, size_t len)
+{
+	E->R->output = sdscatlen(E->R->output, s, len);
+}
+
+#define io_json_cat_literal(E, s) io_json_cat(E, s, sizeof(s) - 1)
+
+static void io_json_check_memory(io_json_encoder_t *E)
+{
+	io_render_t *R = E->R;
+
+	if (io_render_output_exceeds(R, 0)) {
+		luaL_error(E->L, "memory limit exceeded");
+	}
+}
+
+/* Strings are escaped so that the JSON can be embedded in a <script>
+ * element or an HTML attribute: <, >, &, ' and the JavaScript line
+ * terminators U+2028 and U+2029 are written as \u escapes. */
+static void io_json_encode_string(io_json_encoder_t *E, const char *s,
+	size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	char escape[6] = { '\\', 'u', '0', '0', 0, 0 };
+	const char *run = s;
+	size_t i;
+	unsigned char c;
+
+	io_json_cat_literal(E, "\"");
+	for (i = 0; i < len; i++) {
+		c = s[i];
+		if (c >= 0x20 && c != '"' && c != '\\' && c != '<' && c != '>'
+		&& c != '&' && c != '\'' && c != 0xE2) {
+			continue;
+		}
+		if (c == 0xE2 && !(i + 2 < len && (unsigned char) s[i + 1] == 0x80
+		&& ((unsigned char) s[i + 2] & 0xFE) == 0xA8)) {
+			continue;
+		}
+
+		io_json_cat(E, run, s + i - run);
+		switch (c) {
+			case '"': io_json_cat_literal(E, "\\\""); break;
+			case '\\': io_json_cat_literal(E, "\\\\"); break;
+			case '\n': io_json_cat_literal(E, "\\n"); break;
+			case '\r': io_json_cat_literal(E, "\\r"); break;
+			case '\t': io_json_cat_literal(E, "\\t"); break;
+			case 0xE2:
+				if ((unsigned char) s[i + 2] == 0xA8) {
+					io_json_cat_literal(E, "\\u2028");
+				} else {
+					io_json_cat_literal(E, "\\u2029");
+				}
+				i += 2;
+				break;
+			default:
+				escape[4] = hex[c >> 4];
+				escape[5] = hex[c & 0xf];
+				io_json_cat(E, escape, 6);
+		}
+		run = s + i + 1;
+	}
+	io_json_cat(E, run, s + len - run);
+	io_json_cat_literal(E, "\"");
+}
+
+/* Numbers are written in their shortest form that reads back exactly. */
+static void io_json_encode_number(io_json_encoder_t *E, lua_Number n)
+{
+	char buf[IO_NUMBER_BUFSIZE];
+
+	if (isinf(n) || isnan(n)) {
+		io_json_cat_literal(E, "null");
+		return;
+	}
+
+	io_json_cat(E, buf, io_number_format(buf, n, 0));
+}
+
+static void io_json_encode_value(io_json_encoder_t *E, int idx);
+
+static void io_json_encode_key(io_json_encoder_t *E, int idx)
+{
+	const char *s;
+	size_t len;
+
+	switch (lua_type(E->L, idx)) {
+		case LUA_TSTRING:
+			s = lua_tolstring(E->L, idx, &len);
+			io_json_encode_string(E, s, len);
+			break;
+		case LUA_TNUMBER:
+			io_json_cat_literal(E, "\"");
+			io_json_encode_number(E, lua_tonumber(E->L, idx));
+			io_json_cat_literal(E, "\"");
+			break;
+		default:
+			luaL_error(E->L, "cannot use a %s as a JSON key",
+				luaL_typename(E->L, idx));
+	}
+	io_json_cat_literal(E, ":");
+}
+
+/* A table is an array when its keys are exactly 1 to #t. */
+static int io_json_table_is_array(lua_State *L, int idx, size_t *length)
+{
+	size_t len = lua_rawlen(L, idx), count = 0;
+	lua_Number k;
+
+	if (len == 0) {
+		return 0;
+	}
+
+	lua_pushnil(L);
+	while (lua_next(L, idx)) {
+		lua_pop(L, 1);
+		k = lua_tonumber(L, -1);
+		if (lua_type(L, -1) != LUA_TNUMBER || k < 1 || k > len
+		|| k != (size_t) k) {
+			lua_pop(L, 1);
+			return 0;
+		}
+		count++;
+	}
+	*length = len;
+
+	return count == len;
+}
+
+static void io_json_encode_table(io_json_encoder_t *E, int idx)
+{
+	lua_State *L = E->L;
+	size_t i, length;
+	int first = 1;
+
+	io_readonly_unwrap(L, idx);
+	if (io_json_table_is_array(L, idx, &length)) {
+		io_json_cat_literal(E, "[");
+		for (i = 1; i <= length; i++) {
+			if (i > 1) {
+				io_json_cat_literal(E, ",");
+			}
+			lua_rawgeti(L, idx, i);
+			io_json_encode_value(E, lua_gettop(L));
+			lua_pop(L, 1);
+		}
+		io_json_cat_literal(E, "]");
+		return;
+	}
+
+	io_json_cat_literal(E, "{");
+	lua_pushnil(L);
+	while (lua_next(L, idx)) {
+		if (!first) {
+			io_json_cat_literal(E, ",");
+		}
+		first = 0;
+		io_json_encode_key(E, -2);
+		io_json_encode_value(E, lua_gettop(L));
+		lua_pop(L, 1);
+	}
+	io_json_cat_literal(E, "}");
+}
+
+/* Userdata such as io_array and io_struct are read through their
+ * metamethods: __pairs makes an object, __len and __index an array. */
+static void io_json_encode_userdata(io_json_encoder_t *E, int idx)
+{
+	lua_State *L = E->L;
+	size_t i, length;
+	int first = 1;
+
+	if (luaL_getmetafield(L, idx, "__pairs")) {
+		lua_pushvalue(L, idx);
+		lua_call(L, 1, 3);
+		io_json_cat_literal(E, "{");
+		for (;;) {
+			lua_pushvalue(L, -3);
+			lua_pushvalue(L, -3);
+			lua_pushvalue(L, -3);
+			lua_call(L, 2, 2);
+			if (lua_isnil(L, -2)) {
+				lua_pop(L, 5);
+				break;
+			}
+			if (!first) {
+				io_json_cat_literal(E, ",");
+			}
+			first = 0;
+			io_json_encode_key(E, -2);
+			io_json_encode_value(E, lua_gettop(L));
+			lua_pop(L, 1);
+			lua_replace(L, -2);
+		}
+		io_json_cat_literal(E, "}");
+		return;
+	}
+
+	if (luaL_getmetafield(L, idx, "__len")) {
+		lua_pop(L, 1);
+		length = luaL_len(L, idx);
+		io_json_cat_literal(E, "[");
+		for (i = 1; i <= length; i++) {
+			if (i > 1) {
+				io_json_cat_literal(E, ",");
+			}
+			lua_pushunsigned(L, i);
+			lua_gettable(L, idx);
+			io_json_encode_value(E, lua_gettop(L));
+			lua_pop(L, 1);
+		}
+		io_json_cat_literal(E, "]");
+		return;
+	}
+
+	luaL_error(L, "cannot convert a userdata to JSON");
+}
+
+static void io_json_encode_value(io_json_encoder_t *E, int idx)
+{
+	lua_State *L = E->L;
+	const char *s;
+	size_t len;
+
+	switch (lua_type(L, idx)) {
+		case LUA_TNIL:
+			io_json_cat_literal(E, "null");
+			break;
+		case LUA_TBOOLEAN:
+			if (lua_toboolean(L, idx)) {
+				io_json_cat_literal(E, "true");
+			} else {
+				io_json_cat_literal(E, "false");
+			}
+			break;
+		case LUA_TNUMBER:
+			io_json_encode_number(E, lua_tonumber(L, idx));
+			break;
+		case LUA_TSTRING:
+			s = lua_tolstring(L, idx, &len);
+			io_json_encode_string(E, s, len);
+			break;
+		case LUA_TTABLE:
+		case LUA_TUSERDATA:
+			if (++E->depth > IO_JSON_MAX_DEPTH) {
+				luaL_error(L, "cannot convert to JSON: nested too deep");
+			}
+			luaL_checkstack(L, 8, "cannot convert to JSON");
+			if (lua_istable(L, idx)) {
+				io_json_encode_table(E, idx);
+			} else {
+				io_json_encode_userdata(E, idx);
+			}
+			E->depth--;
+			io_json_check_memory(E);
+			break;
+		default:
+			luaL_error(L, "cannot convert a %s to JSON",
+				luaL_typename(L, idx));
+	}
+}
+
+static void io_json_encoder_init(io_json_encoder_t *E, lua_State *L)
+{
+	E->L = L;
+	E->depth = 0;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, "io_render");
+	E->R = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+}
+
+static int io_json_encode_protected(lua_State *L)
+{
+	io_json_encode_value(lua_touserdata(L, 1), 2);
+
+	return 0;
+}
+
+/* Encodes the value at index 1 at the end of the output. On error, what was
+ * written is removed before the error is raised again, so that a template
+ * catching it does not output partial JSON. */
+static void io_json_encode_output(io_json_encoder_t *E)
+{
+	lua_State *L = E->L;
+	size_t mark = sdslen(E->R->output);
+	int status;
+
+	lua_pushcfunction(L, io_json_encode_protected);
+	lua_pushlightuserdata(L, E);
+	lua_pushvalue(L, 1);
+	status = lua_pcall(L, 2, 0, 0);
+	if (status != LUA_OK) {
+		sdsIncrLen(E->R->output, -(int) (sdslen(E->R->output) - mark));
+		if (status == LUA_ERRMEM && E->R->status == IO_RENDER_OK) {
+			E->R->status = IO_RENDER_ERRMEM;
+		}
+		lua_error(L);
+	}
+}
+
+int io_json_encode(lua_State *L)
+{
+	io_json_encoder_t E;
+	size_t mark;
+
+	luaL_checkany(L, 1);
+	lua_settop(L, 1);
+	io_json_encoder_init(&E, L);
+
+	mark = sdslen(E.R->output);
+	io_json_encode_output(&E);
+	lua_pushlstring(L, E.R->output + mark, sdslen(E.R->output) - mark);
+	sdsIncrLen(E.R->output, -(int) (sdslen(E.R->output) - mark));
+
+	return 1;
+}
+
+int io_json_out_encode(lua_State *L)
+{
+	io_json_encoder_t E;
+
+	luaL_checkany(L, 1);
+	lua_settop(L, 1);
+	io_json_encoder_init(&E, L);
+	io_json_encode_output(&E);
+	io_json_check_memory(&E);
+
+	return io_iolib_written(L, E.R);
+}
+
+static const char * io_json_skip_space(const char *p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+		p++;
+	}
+
+	return p;
+}
+
+static int io_json_hex(const char *p, const char *end)
+{
+	int i, c, n = 0;
+
+	if (end - p < 4) {
+		return -1;
+	}
+
+	for (i = 0; i < 4; i++) {
+		c = p[i];
+		n <<= 4;
+		if (c >= '0' && c <= '9') {
+			n |= c - '0';
+		} else if (c >= 'a' && c <= 'f') {
+			n |= c - 'a' + 10;
+		} else if (c >= 'A' && c <= 'F') {
+			n |= c - 'A' + 10;
+		} else {
+			return -1;
+		}
+	}
+
+	return n;
+}
+
+/* p is on the opening quote. */
+static const char * io_json_skip_string(const char *p, const char *end)
+{
+	for (p++; p < end; p++) {
+		if (*p == '"') {
+			return p + 1;
+		}
+		if ((unsigned char) *p < 0x20) {
+			return NULL;
+		}
+		if (*p == '\\') {
+			if (++p == end) {
+				return NULL;
+			}
+			if (*p == 'u') {
+				if (io_json_hex(p + 1, end) < 0) {
+					return NULL;
+				}
+				p += 4;
+			} else if (*p == 0 || !strchr("\"\\/bfnrt", *p)) {
+				return NULL;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+#define io_json_is_digit(c) ((c) >= '0' && (c) <= '9')
+
+static const char * io_json_skip_number(const char *p, const char *end)
+{
+	if (p < end && *p == '-') {
+		p++;
+	}
+	if (p == end || !io_json_is_digit(*p)) {
+		return NULL;
+	}
+	if (*p == '0') {
+		p++;
+	} else {
+		while (p < end && io_json_is_digit(*p)) p++;
+	}
+	if (p < end && *p == '.') {
+		if (++p == end || !io_json_is_digit(*p)) {
+			return NULL;
+		}
+		while (p < end && io_json_is_digit(*p)) p++;
+	}
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		p++;
+		if (p < end && (*p == '+' || *p == '-')) {
+			p++;
+		}
+		if (p == end || !io_json_is_digit(*p)) {
+			return NULL;
+		}
+		while (p < end && io_json_is_digit(*p)) p++;
+	}
+
+	return p;
+}
+
+static const char * io_json_skip_literal(const char *p, const char *end,
+	const char *literal, size_t len)
+{
+	if ((size_t) (end - p) < len || memcmp(p, literal, len)) {
+		return NULL;
+	}
+
+	return p + len;
+}
+
+static const char * io_json_skip_value(const char *p, const char *end,
+	int depth)
+{
+	char close;
+
+	p = io_json_skip_space(p, end);
+	if (p == end) {
+		return NULL;
+	}
+
+	switch (*p) {
+		case '{':
+		case '[':
+			if (depth >= IO_JSON_MAX_DEPTH) {
+				return NULL;
+			}
+			close = *p == '{' ? '}' : ']';
+			p = io_json_skip_space(p + 1, end);
+			if (p < end && *p == close) {
+				return p + 1;
+			}
+			for (;;) {
+				if (close == '}') {
+					if (p == end || *p != '"'
+					|| !(p = io_json_skip_string(p, end))) {
+						return NULL;
+					}
+					p = io_json_skip_space(p, end);
+					if (p == end || *p++ != ':') {
+						return NULL;
+					}
+				}
+				p = io_json_skip_value(p, end, depth + 1);
+				if (p == NULL) {
+					return NULL;
+				}
+				p = io_json_skip_space(p, end);
+				if (p < end && *p == ',') {
+					p = io_json_skip_space(p + 1, end);
+				} else if (p < end && *p == close) {
+					return p + 1;
+				} else {
+					return NULL;
+				}
+			}
+		case '"':
+			return io_json_skip_string(p, end);
+		case 't':
+			return io_json_skip_literal(p, end, "true", 4);
+		case 'f':
+			return io_json_skip_literal(p, end, "false", 5);
+		case 'n':
+			return io_json_skip_literal(p, end, "null", 4);
+		default:
+			return io_json_skip_number(p, end);
+	}
+}
+
+const char * io_json_skip(const char *p, const char *end)
+{
+	p = io_json_skip_value(p, end, 0);
+
+	return p ? io_json_skip_space(p, end) : NULL;
+}
+
+static size_t io_json_utf8(char *out, unsigned long c)
+{
+	if (c < 0x80) {
+		out[0] = c;
+		return 1;
+	}
+	if (c < 0x800) {
+		out[0] = 0xC0 | (c >> 6);
+		out[1] = 0x80 | (c & 0x3F);
+		return 2;
+	}
+	if (c < 0x10000) {
+		out[0] = 0xE0 | (c >> 12);
+		out[1] = 0x80 | ((c >> 6) & 0x3F);
+		out[2] = 0x80 | (c & 0x3F);
+		return 3;
+	}
+	out[0] = 0xF0 | (c >> 18);
+	out[1] = 0x80 | ((c >> 12) & 0x3F);
+	out[2] = 0x80 | ((c >> 6) & 0x3F);
+	out[3] = 0x80 | (c & 0x3F);
+	return 4;
+}
+
+size_t io_json_unescape(char *out, const char *in, size_t len)
+{
+	const char *end = in + len, *run;
+	size_t n = 0;
+	long c, low;
+
+	while (in < end) {
+		run = in;
+		while (in < end && *in != '\\') in++;
+		memcpy(out + n, run, in - run);
+		n += in - run;
+		if (in == end || ++in == end) {
+			break;
+		}
+
+		switch (*in++) {
+			case 'b': out[n++] = '\b'; break;
+			case 'f': out[n++] = '\f'; break;
+			case 'n': out[n++] = '\n'; break;
+			case 'r': out[n++] = '\r'; break;
+			case 't': out[n++] = '\t'; break;
+			case 'u':
+				c = io_json_hex(in, end);
+				if (c < 0) {
+					return n;
+				}
+				in += 4;
+				/* Surrogate pair */
+				if (c >= 0xD800 && c <= 0xDBFF && end - in >= 6
+				&& in[0] == '\\' && in[1] == 'u') {
+					low = io_json_hex(in + 2, end);
+					if (low >= 0xDC00 && low <= 0xDFFF) {
+						c = 0x10000 + ((c - 0xD800) << 10)
+							+ (low - 0xDC00);
+						in += 6;
+					}
+				}
+				n += io_json_utf8(out + n, c);
+				break;
+			default:
+				out[n++] = in[-1];
+		}
+	}
+
+	return n;
+}
+
+typedef struct {
+	lua_State *L;
+	const char *p;
+	const char *end;
+} io_json_decoder_t;
+
+static void io_json_decode_string(io_json_decoder_t *D)
+{
+	const char *start = ++D->p, *p = start;
+	luaL_Buffer b;
+	int escaped = 0;
+	size_t len;
+	char *out;
+
+	while (p < D->end && *p != '"') {
+		if (*p == '\\') {
+			escaped = 1;
+			p++;
+		}
+		p++;
+	}
+	D->p = p + 1;
+	len = p - start;
+
+	if (!escaped) {
+		lua_pushlstring(D->L, start, len);
+		return;
+	}
+
+	out = luaL_buffinitsize(D->L, &b, len);
+	luaL_pushresultsize(&b, io_json_unescape(out, start, len));
+}
+
+/* Integers of up to 15 digits are read directly, other numbers with
+ * strtod(). */
+/* The document has been validated, so the number ends where
+ * io_json_skip_number() says. */
+static void io_json_decode_number(io_json_decoder_t *D)
+{
+	const char *p = D->p, *end;
+	long long n = 0;
+	int negative = 0;
+
+	end = io_json_skip_number(p, D->end);
+
+	if (*p == '-') {
+		negative = 1;
+		p++;
+	}
+	/* Integers of up to 15 digits are exact, anything else goes through
+	 * strtod. */
+	if (end - p <= 15) {
+		while (p < end && io_json_is_digit(*p)) {
+			n = n * 10 + (*p++ - '0');
+		}
+	}
+
+	if (p == end) {
+		lua_pushnumber(D->L, negative ? -(lua_Number) n : (lua_Number) n);
+	} else {
+		lua_pushnumber(D->L, io_number_parse(D->p, end - D->p));
+	}
+	D->p = end;
+}
+
+static void io_json_decode_value(io_json_decoder_t *D)
+{
+	lua_State *L = D->L;
+	int i;
+
+	D->p = io_json_skip_space(D->p, D->end);
+	if (D->p == D->end) {
+		lua_pushnil(L);
+		return;
+	}
+
+	switch (*D->p) {
+		case '{':
+			luaL_checkstack(L, 4, "cannot convert JSON");
+			lua_newtable(L);
+			D->p = io_json_skip_space(D->p + 1, D->end);
+			while (D->p < D->end && *D->p == '"') {
+				io_json_decode_string(D);
+				D->p = io_json_skip_space(D->p, D->end) + 1;
+				io_json_decode_value(D);
+				if (lua_isnil(L, -1)) {
+					lua_pop(L, 2);
+				} else {
+					lua_rawset(L, -3);
+				}
+				D->p = io_json_skip_space(D->p, D->end);
+				if (D->p < D->end && *D->p == ',') {
+					D->p = io_json_skip_space(D->p + 1, D->end);
+				}
+			}
+			D->p++;
+			break;
+		case '[':
+			luaL_checkstack(L, 4, "cannot convert JSON");
+			lua_newtable(L);
+			D->p = io_json_skip_space(D->p + 1, D->end);
+			for (i = 1; D->p < D->end && *D->p != ']'; i++) {
+				io_json_decode_value(D);
+				lua_rawseti(L, -2, i);
+				D->p = io_json_skip_space(D->p, D->end);
+				if (D->p < D->end && *D->p == ',') {
+					D->p++;
+				}
+			}
+			D->p++;
+			break;
+		case '"':
+			io_json_decode_string(D);
+			break;
+		case 't':
+			lua_pushboolean(L, 1);
+			D->p += 4;
+			break;
+		case 'f':
+			lua_pushboolean(L, 0);
+			D->p += 5;
+			break;
+		case 'n':
+			lua_pushnil(L);
+			D->p += 4;
+			break;
+		default:
+			io_json_decode_number(D);
+	}
+}
+
+void io_json_to_lua_stack(sds json, lua_State *L)
+{
+	io_json_decoder_t D;
+
+	D.L = L;
+	D.p = json;
+	D.end = json + sdslen(json);
+	io_json_decode_value(&D);
+}
+
+void io_json_each_member(const char *json, size_t len,
+	void (*callback)(void *data, sds name, const char *value, size_t len),
+	void *data)
+{
+	const char *p, *end = json + len, *key, *value;
+	sds name;
+	size_t key_len;
+
+	p = io_json_skip_space(json, end);
+	if (p == end || *p != '{') {
+		return;
+	}
+	p = io_json_skip_space(p + 1, end);
+
+	while (p < end && *p == '"') {
+		key = p + 1;
+		p = io_json_skip_string(p, end);
+		key_len = p - 1 - key;
+		name = sdsnewlen(NULL, key_len);
+		sdsIncrLen(name, (int) io_json_unescape(name, key, key_len)
+			- (int) key_len);
+
+		p = io_json_skip_space(p, end) + 1;
+		value = io_json_skip_space(p, end);
+		p = io_json_skip_value(value, end, 1);
+		callback(data, name, value, p - value);
+		sdsfree(name);
+
+		p = io_json_skip_space(p, end);
+		if (p < end && *p == ',') {
+			p = io_json_skip_space(p + 1, end);
+		}
+	}
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright 2014 Julian Maurice
+ *
+ * This file is part of libio
+ *
+ * libio is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef io_json_h_included
+#define io_json_h_included
+
+#include <stddef.h>
+#include <lua.h>
+#include <sds.h>
+
+/* Io.json(value) returns value encoded as JSON; Io.out.json(value) writes
+ * it to the output. */
+int io_json_encode(lua_State *L);
+int io_json_out_encode(lua_State *L);
+
+/* Returns a pointer past the JSON value (and surrounding whitespace) that
+ * starts at p, or NULL if it is not valid JSON. */
+const char *
+io_json_skip(
+	const char *p,
+	const char *end
+);
+
+/* Writes the unescaped content of the JSON string of len bytes (without
+ * its quotes) at in to out, which must have room for len bytes. Returns
+ * the length written. */
+size_t
+io_json_unescape(
+	char *out,
+	const char *in,
+	size_t len
+);
+
+/* Calls callback for each member of the JSON object of len bytes at json,
+ * which must be valid. The value is passed as the span of its JSON text. */
+void
+io_json_each_member(
+	const char *json,
+	size_t len,
+	void (*callback)(void *data, sds name, const char *value, size_t len),
+	void *data
+);
+
+/* Pushes the value of a JSON document, which must be valid. Objects and
+ * arrays become tables, null becomes nil. */
+void
+io_json_to_lua_stack(
+	sds json,
+	lua_State *L
+);
+
+#endif /* ! io_json_h_included */
@@ -0,0 +1,197 @@
+/*
+ * Copyright 2014 Julian Maurice
+ *
+ * This file is part of libio
+ *
+ * libio is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sds.h>
+#include <libgends/hash_map.h>
+#include <libgends/hash_functions.h>
+#include "io_loader.h"
+
+#define IO_LOADER_MEMORY_SIZE 64
+
+typedef struct {
+	sds source;
+	unsigned long version;
+} io_loader_entry_t;
+
+/* Templates may be replaced while other threads render, so entries are
+ * protected by a read-write lock and sources are copied out. Entries are
+ * keyed by name. */
+typedef struct {
+	gds_hash_map_t *entries;
+	unsigned long version;
+	pthread_rwlock_t lock;
+} io_loader_memory_t;
+
+static void io_loader_entry_free(io_loader_entry_t *entry)
+{
+	sdsfree(entry->source);
+	free(entry);
+}
+
+static sds io_loader_memory_lookup(io_loader_t *loader, const char *name)
+{
+	io_loader_memory_t *store = loader->data;
+	sds key = NULL;
+
+	pthread_rwlock_rdlock(&(store->lock));
+	if (gds_hash_map_get(store->entries, name)) {
+		key = sdsnew(name);
+	}
+	pthread_rwlock_unlock(&(store->lock));
+
+	return key;
+}
+
+static sds io_loader_memory_load(io_loader_t *loader, const char *key)
+{
+	io_loader_memory_t *store = loader->data;
+	io_loader_entry_t *entry;
+	sds source = NULL;
+
+	pthread_rwlock_rdlock(&(store->lock));
+	entry = gds_hash_map_get(store->entries, key);
+	if (entry) {
+		source = sdsdup(entry->source);
+	}
+	pthread_rwlock_unlock(&(store->lock));
+
+	return source;
+}
+
+static unsigned long io_loader_memory_version(io_loader_t *loader,
+	const char *key)
+{
+	io_loader_memory_t *store = loader->data;
+	io_loader_entry_t *entry;
+	unsigned long version = 0;
+
+	pthread_rwlock_rdlock(&(store->lock));
+	entry = gds_hash_map_get(store->entries, key);
+	if (entry) {
+		version = entry->version;
+	}
+	pthread_rwlock_unlock(&(store->lock));
+
+	return version;
+}
+
+static void io_loader_memory_free(io_loader_t *loader)
+{
+	io_loader_memory_t *store = loader->data;
+
+	gds_hash_map_free(store->entries);
+	pthread_rwlock_destroy(&(store->lock));
+	free(store);
+}
+
+io_loader_t * io_loader_memory_new(void)
+{
+	io_loader_t *loader;
+	io_loader_memory_t *store;
+
+	loader = malloc(sizeof(io_loader_t));
+	store = calloc(1, sizeof(io_loader_memory_t));
+	if (store != NULL) {
+		store->entries = gds_hash_map_new(IO_LOADER_MEMORY_SIZE,
+			gds_hash_djb2, strcmp, NULL, sdsfree, io_loader_entry_free);
+	}
+	if (loader == NULL || store == NULL || store->entries == NULL) {
+		fprintf(stderr, "Memory allocation error\n");
+		free(loader);
+		free(store);
+		return NULL;
+	}
+
+	pthread_rwlock_init(&(store->lock), NULL);
+	store->version = 0;
+
+	loader->lookup = io_loader_memory_lookup;
+	loader->load = io_loader_memory_load;
+	loader->version = io_loader_memory_version;
+	loader->free = io_loader_memory_free;
+	loader->data = store;
+
+	return loader;
+}
+
+int io_loader_memory_set(io_loader_t *loader, const char *name,
+	const char *source)
+{
+	io_loader_memory_t *store;
+	io_loader_entry_t *entry;
+
+	if (loader == NULL || loader->lookup != io_loader_memory_lookup) {
+		return -1;
+	}
+	store = loader->data;
+
+	pthread_rwlock_wrlock(&(store->lock));
+	entry = gds_hash_map_get(store->entries, name);
+	if (entry == NULL) {
+		entry = malloc(sizeof(io_loader_entry_t));
+		if (entry == NULL) {
+			pthread_rwlock_unlock(&(store->lock));
+			return -1;
+		}
+		entry->source = NULL;
+		gds_hash_map_set(store->entries, sdsnew(name), entry);
+	}
+	sdsfree(entry->source);
+	entry->source = sdsnew(source);
+	entry->version = ++store->version;
+	pthread_rwlock_unlock(&(store->lock));
+
+	return 0;
+}
+
+int io_loader_memory_remove(io_loader_t *loader, const char *name)
+{
+	io_loader_memory_t *store;
+	int ret;
+
+	if (loader == NULL || loader->lookup != io_loader_memory_lookup) {
+		return -1;
+	}
+	store = loader->data;
+
+	pthread_rwlock_wrlock(&(store->lock));
+	ret = gds_hash_map_get(store->entries, name) ? 0 : -1;
+	if (ret == 0) {
+		gds_hash_map_unset(store->entries, name);
+	}
+	pthread_rwlock_unlock(&(store->lock));
+
+	return ret;
+}
+
+void io_loader_free(io_loader_t *loader)
+{
+	if (loader) {
+		if (loader->free) {
+			loader->free(loader);
+		}
+		free(loader);
+	}
+}
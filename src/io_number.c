@@ -0,0 +1,167 @@
+/*
+ * Copyright 2014 Julian Maurice
+ *
+ * This file is part of libio
+ *
+ * libio is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <locale.h>
+#include "io_number.h"
+
+static const char io_number_digits[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+/* Integers below this need no exponent with the given precision. */
+static const double io_number_limits[] = {
+	9007199254740992.0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+	1e10, 1e11, 1e12, 1e13, 1e14, 1e15
+};
+
+/* Writes the digits two at a time, from the end. */
+static size_t io_number_format_integer(char *buf, unsigned long long u,
+	int negative)
+{
+	char tmp[24], *p = tmp + sizeof(tmp);
+	size_t len;
+
+	while (u >= 100) {
+		p -= 2;
+		memcpy(p, io_number_digits + (u % 100) * 2, 2);
+		u /= 100;
+	}
+	if (u >= 10) {
+		p -= 2;
+		memcpy(p, io_number_digits + u * 2, 2);
+	} else {
+		*--p = '0' + u;
+	}
+	if (negative) {
+		*--p = '-';
+	}
+
+	len = tmp + sizeof(tmp) - p;
+	memcpy(buf, p, len);
+	buf[len] = '\0';
+
+	return len;
+}
+
+size_t io_number_fix_decimal_point(char *buf, size_t len)
+{
+	const char *point = localeconv()->decimal_point;
+	size_t point_len = strlen(point);
+	char *p;
+
+	if (point_len == 0 || (point_len == 1 && *point == '.')) {
+		return len;
+	}
+
+	p = strstr(buf, point);
+	if (p) {
+		*p = '.';
+		memmove(p + 1, p + point_len, buf + len - p - point_len + 1);
+		len -= point_len - 1;
+	}
+
+	return len;
+}
+
+size_t io_number_format(char *buf, lua_Number n, int precision)
+{
+	double limit;
+	int len;
+
+	if (precision < 0 || precision > 17) {
+		precision = 17;
+	}
+	limit = io_number_limits[precision < 15 ? precision : 15];
+	if (precision == 0) {
+		limit = io_number_limits[0];
+	}
+
+	if (n < limit && n > -limit && n == (lua_Number) (long long) n
+	&& !(n == 0 && signbit(n))) {
+		if (n < 0) {
+			return io_number_format_integer(buf,
+				-(unsigned long long) (long long) n, 1);
+		}
+		return io_number_format_integer(buf, (unsigned long long) n, 0);
+	}
+
+	if (precision) {
+		len = snprintf(buf, IO_NUMBER_BUFSIZE, "%.*g", precision, n);
+	} else {
+		/* Most numbers are exact with 15 digits, all with 17. */
+		for (precision = 15; precision < 17; precision++) {
+			len = snprintf(buf, IO_NUMBER_BUFSIZE, "%.*g", precision, n);
+			if (strtod(buf, NULL) == n) {
+				break;
+			}
+		}
+		if (precision == 17) {
+			len = snprintf(buf, IO_NUMBER_BUFSIZE, "%.17g", n);
+		}
+	}
+
+	return io_number_fix_decimal_point(buf, len);
+}
+
+lua_Number io_number_parse(const char *s, size_t len)
+{
+	const char *point = localeconv()->decimal_point;
+	size_t point_len = strlen(point);
+	char buf[64], *copy = buf, *dot;
+	lua_Number n;
+
+	if (point_len == 0) {
+		point = ".";
+		point_len = 1;
+	}
+	if (len + point_len > sizeof(buf)) {
+		copy = malloc(len + point_len);
+		if (copy == NULL) {
+			fprintf(stderr, "Memory allocation error\n");
+			return 0;
+		}
+	}
+
+	memcpy(copy, s, len);
+	copy[len] = '\0';
+	dot = memchr(copy, '.', len);
+	if (dot && !(point_len == 1 && *point == '.')) {
+		memmove(dot + point_len, dot + 1, copy + len - dot);
+		memcpy(dot, point, point_len);
+	}
+	n = strtod(copy, NULL);
+
+	if (copy != buf) {
+		free(copy);
+	}
+
+	return n;
+}
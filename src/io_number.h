@@ -0,0 +1,56 @@
+/*
+ * Copyright 2014 Julian Maurice
+ *
+ * This file is part of libio
+ *
+ * libio is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef io_number_h_included
+#define io_number_h_included
+
+#include <stddef.h>
+#include <lua.h>
+
+/* Large enough for any number formatted by io_number_format(). */
+#define IO_NUMBER_BUFSIZE 32
+
+/* Writes n to buf with up to precision significant digits (as %.*g), or
+ * with the shortest representation that reads back to n when precision
+ * is 0. The decimal point is always '.', whatever the locale. Returns the
+ * length written. */
+size_t
+io_number_format(
+	char *buf,
+	lua_Number n,
+	int precision
+);
+
+/* Replaces the decimal point of the locale, which printf writes, with '.'
+ * in the len bytes of buf (NUL-terminated). Returns the new length. */
+size_t
+io_number_fix_decimal_point(
+	char *buf,
+	size_t len
+);
+
+/* Reads the len bytes of s, a number with '.' as decimal point whatever
+ * the locale, as strtod would. */
+lua_Number
+io_number_parse(
+	const char *s,
+	size_t len
+);
+
+#endif /* ! io_number_h_included */
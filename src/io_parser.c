@@ -18,12 +18,14 @@
  */
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <sds.h>
-#include <libgends/inline/dlist.h>
 #include "io_config.h"
+#include "io_parser.h"
+#include "io_trace.h"
 
 typedef enum {
 	IO_CHOMP_NONE = 0,
@@ -42,459 +44,793 @@ typedef enum {
 	IO_TOKEN_TYPE_COMMENT
 } io_token_type_t;
 
+/* Chomps that collapse whitespace output a single space before or after
+ * the tag. */
+#define IO_TOKEN_SPACE_BEFORE 1
+#define IO_TOKEN_SPACE_AFTER 2
+
+/* Tokens are spans of the input window, so that scanning copies nothing.
+ * Chomping only changes their type. */
 typedef struct {
 	io_token_type_t type;
-	sds value;
-	gds_inline_dlist_node_t dlist;
+	unsigned int space;
+	size_t offset;
+	size_t length;
 } io_token_t;
 
-typedef struct {
-	io_token_t *tokens_head;
-	io_token_t *tokens_tail;
-	io_config_t *config;
-} io_parser_context_t;
+#define IO_PARSER_TOKENS_SIZE 16
 
-static io_token_t * io_token_new(io_token_type_t type, sds value)
-{
-	io_token_t *token;
+#define IO_PARSER_CHUNK_SIZE 8192
 
-	token = malloc(sizeof(io_token_t));
-	token->type = type;
-	token->value = value;
-	gds_inline_dlist_node_init(&(token->dlist));
+typedef enum {
+	IO_PARSER_NEED_MORE = 0,
+	IO_PARSER_TOKEN,
+	IO_PARSER_END
+} io_parser_scan_t;
+
+/* Input is kept in a window that starts at the first token not emitted
+ * yet, so a tag that straddles two reads is simply rescanned once more
+ * data is available. Tokens are only kept until no chomp can reach them
+ * anymore: the last tag (whose post chomp is still unknown to apply, it
+ * is then always the first token) and the whitespace that follows it.
+ * They are stored in an array that is reused for the whole parse. */
+struct io_parser_s {
+	io_config_t *config;
+	io_parser_reader_t reader;
+	void *data;
+	sds buf;
+	const char *in;
+	size_t len;
+	size_t pos;
+	int eof;
+	int done;
+	io_token_t *tokens;
+	size_t ntokens;
+	size_t tokens_size;
+	int pending;
+	io_chomp_type_t pending_chomp;
+	sds out;
+};
 
-	return token;
-}
+static void io_parser_add_token(io_parser_t *parser, io_token_type_t type,
+	size_t offset, size_t length);
 
-static void io_token_free(io_token_t *token)
+/* Returns 1 if tag is at pos, 0 if it is not, and -1 if the window ends
+ * before we can tell. */
+static int io_parser_match(io_parser_t *parser, size_t pos, sds tag)
 {
-	if (token) {
-		sdsfree(token->value);
-		free(token);
+	size_t tag_len = sdslen(tag);
+	size_t avail = parser->len - pos;
+
+	if (avail >= tag_len) {
+		return !memcmp(parser->in + pos, tag, tag_len);
+	}
+
+	if (parser->eof || memcmp(parser->in + pos, tag, avail)) {
+		return 0;
 	}
-}
 
-#define container_of(ptr, type, member) ({ \
-	const __typeof__( ((type *)0)->member ) *__mptr = (ptr); \
-	(type *)( (char *)__mptr - offsetof(type,member) ); \
-})
+	return -1;
+}
 
-static void io_token_list_push(io_parser_context_t *context, io_token_t *token)
+static int io_parser_match_start_tag(io_parser_t *parser, size_t pos)
 {
-	gds_inline_dlist_node_t *itail;
+	io_config_t *config = parser->config;
+	int comm, expr, code;
 
-	if (context->tokens_head) {
-		itail = &(context->tokens_tail->dlist);
-		gds_inline_dlist_node_append(itail, &(token->dlist), &itail);
-		context->tokens_tail = container_of(itail, io_token_t, dlist);
-	} else {
-		context->tokens_head = context->tokens_tail = token;
+	comm = io_parser_match(parser, pos, config->comm_start_tag);
+	expr = io_parser_match(parser, pos, config->expr_start_tag);
+	code = io_parser_match(parser, pos, config->code_start_tag);
+
+	if (comm > 0 || expr > 0 || code > 0) {
+		return 1;
 	}
+
+	return (comm < 0 || expr < 0 || code < 0) ? -1 : 0;
 }
 
-static void io_token_list_free_callback(gds_inline_dlist_node_t *node)
+static size_t io_parser_find_quote(const char *in, size_t pos, size_t len)
 {
-	io_token_t *token;
+	char quote = in[pos];
 
-	token = container_of(node, io_token_t, dlist);
-	io_token_free(token);
+	for (pos++; pos < len; pos++) {
+		if (in[pos] == quote && in[pos - 1] != '\\') {
+			return pos;
+		}
+	}
+
+	return len;
 }
 
-static void io_token_list_free(io_parser_context_t *context)
+static size_t io_parser_find_multiline_end(const char *in, size_t pos,
+	size_t len, size_t n_equals)
 {
-	gds_inline_dlist_node_t *head;
+	size_t i;
+
+	for (; pos + n_equals + 2 <= len; pos++) {
+		if (in[pos] != ']' || in[pos + n_equals + 1] != ']') {
+			continue;
+		}
+		for (i = 1; i <= n_equals && in[pos + i] == '='; i++);
+		if (i > n_equals) {
+			return pos + n_equals + 1;
+		}
+	}
 
-	head = &(context->tokens_head->dlist);
-	gds_inline_dlist_remove(head, 0, gds_inline_dlist_size(head),
-		io_token_list_free_callback, NULL, NULL);
+	return len;
 }
 
-static const char * io_parser_parse_string_single(const char *ptr)
+static int io_parser_scan_lua(io_parser_t *parser, sds start_tag,
+	sds end_tag, io_token_type_t type)
 {
-	ptr = strchr(ptr + 1, '\'');
-	while (ptr && *(ptr - 1) == '\\') {
-		ptr = strchr(ptr + 1, '\'');
+	const char *in = parser->in;
+	size_t len = parser->len;
+	size_t start = parser->pos + sdslen(start_tag);
+	size_t pos = start, end, next;
+	int match;
+
+	for (;;) {
+		if (pos >= len) {
+			if (!parser->eof) {
+				return IO_PARSER_NEED_MORE;
+			}
+			end = next = len;
+			break;
+		}
+
+		if (in[pos] == '\'' || in[pos] == '"') {
+			pos = io_parser_find_quote(in, pos, len);
+			if (pos == len) continue;
+		} else if (in[pos] == '[') {
+			size_t n_equals = 0;
+			while (pos + n_equals + 1 < len
+			&& in[pos + n_equals + 1] == '=') {
+				n_equals++;
+			}
+			if (pos + n_equals + 1 >= len && !parser->eof) {
+				return IO_PARSER_NEED_MORE;
+			}
+			if (pos + n_equals + 1 < len
+			&& in[pos + n_equals + 1] == '[') {
+				pos = io_parser_find_multiline_end(in, pos, len,
+					n_equals);
+				if (pos == len) continue;
+			}
+		} else {
+			match = io_parser_match(parser, pos, end_tag);
+			if (match < 0) {
+				return IO_PARSER_NEED_MORE;
+			}
+			if (match) {
+				end = pos;
+				next = pos + sdslen(end_tag);
+				break;
+			}
+		}
+		pos++;
 	}
 
-	return ptr;
+	parser->pos = next;
+	io_parser_add_token(parser, type, start, end - start);
+
+	return IO_PARSER_TOKEN;
 }
 
-static const char * io_parser_parse_string_double(const char *ptr)
+static int io_parser_scan_whitespace(io_parser_t *parser)
 {
-	ptr = strchr(ptr + 1, '"');
-	while (ptr && *(ptr - 1) == '\\') {
-		ptr = strchr(ptr + 1, '"');
+	const char *in = parser->in;
+	size_t pos = parser->pos, start = parser->pos;
+
+	while (pos < parser->len && (in[pos] == ' ' || in[pos] == '\t')) {
+		pos++;
+	}
+
+	if (pos == parser->len && !parser->eof
+	&& pos - parser->pos < IO_PARSER_CHUNK_SIZE) {
+		return IO_PARSER_NEED_MORE;
 	}
 
-	return ptr;
+	parser->pos = pos;
+	io_parser_add_token(parser, IO_TOKEN_TYPE_WHITESPACE, start, pos - start);
+
+	return IO_PARSER_TOKEN;
 }
 
-static const char * io_parser_parse_string_multiline(const char *ptr,
-	unsigned int n_equals)
+/* Long words are cut at IO_PARSER_CHUNK_SIZE rather than kept whole, two
+ * consecutive text tokens produce the same output as a single one. */
+static int io_parser_scan_text(io_parser_t *parser)
 {
-	char multi_end_tag[n_equals + 3];
+	const char *in = parser->in;
+	size_t pos = parser->pos, start = parser->pos;
+	int match = 0;
 
-	multi_end_tag[0] = ']';
-	memset(multi_end_tag + 1, '=', n_equals);
-	multi_end_tag[n_equals + 1] = ']';
-	multi_end_tag[n_equals + 2] = '\0';
+	while (pos < parser->len && in[pos] != '\n' && in[pos] != ' '
+	&& in[pos] != '\t')
+	{
+		match = io_parser_match_start_tag(parser, pos);
+		if (match) break;
+		pos++;
+	}
 
-	ptr = strstr(ptr, multi_end_tag);
-	if (ptr) {
-		ptr += n_equals + 1;
+	if ((pos == parser->len || match < 0) && !parser->eof
+	&& pos - parser->pos < IO_PARSER_CHUNK_SIZE) {
+		return IO_PARSER_NEED_MORE;
 	}
 
-	return ptr;
+	parser->pos = pos;
+	io_parser_add_token(parser, IO_TOKEN_TYPE_TEXT, start, pos - start);
+
+	return IO_PARSER_TOKEN;
 }
 
-static const char * io_parser_parse_lua(const char *ptr, sds end_tag,
-	io_token_type_t type, io_parser_context_t *context)
+static int io_parser_scan(io_parser_t *parser)
 {
-	size_t end_tag_len = sdslen(end_tag);
-	const char *tmp;
-	sds value;
+	io_config_t *config = parser->config;
+	int match;
+	char c;
 
-	tmp = ptr;
+	if (parser->pos >= parser->len) {
+		return parser->eof ? IO_PARSER_END : IO_PARSER_NEED_MORE;
+	}
 
-	while (ptr && *ptr) {
-		if (*ptr == '\'') {
-			ptr = io_parser_parse_string_single(ptr);
-		} else if (*ptr == '"') {
-			ptr = io_parser_parse_string_double(ptr);
-		} else if (*ptr == '[') {
-			int n_equals = 0;
-			while (ptr[n_equals + 1] == '=') n_equals++;
-			if (ptr[n_equals + 1] == '[') {
-				ptr = io_parser_parse_string_multiline(ptr,
-					n_equals);
-			}
-		} else if (!strncmp(ptr, end_tag, end_tag_len)) {
-			ptr += end_tag_len - 1;
-			break;
-		}
-		if (ptr && *ptr) ptr++;
+	c = parser->in[parser->pos];
+	if (c == '\n') {
+		io_parser_add_token(parser, IO_TOKEN_TYPE_NEWLINE, parser->pos++, 1);
+		return IO_PARSER_TOKEN;
 	}
 
-	if (ptr) {
-		if (*ptr == '\0') {
-			value = sdsnewlen(tmp, ptr - tmp);
-		} else {
-			value = sdsnewlen(tmp, ptr - tmp - end_tag_len + 1);
-		}
-	} else {
-		value = sdsnew(tmp);
+	if (c == ' ' || c == '\t') {
+		return io_parser_scan_whitespace(parser);
 	}
 
-	io_token_list_push(context, io_token_new(type, value));
+	match = io_parser_match(parser, parser->pos, config->comm_start_tag);
+	if (match) {
+		return match < 0 ? IO_PARSER_NEED_MORE : io_parser_scan_lua(parser,
+			config->comm_start_tag, config->comm_end_tag,
+			IO_TOKEN_TYPE_COMMENT);
+	}
 
-	return ptr;
-}
+	match = io_parser_match(parser, parser->pos, config->expr_start_tag);
+	if (match) {
+		return match < 0 ? IO_PARSER_NEED_MORE : io_parser_scan_lua(parser,
+			config->expr_start_tag, config->expr_end_tag,
+			IO_TOKEN_TYPE_EXPR);
+	}
 
-static const char * io_parser_parse_code(const char *ptr,
-	io_parser_context_t *context)
-{
-	ptr += sdslen(context->config->code_start_tag);
-	return io_parser_parse_lua(ptr, context->config->code_end_tag,
-		IO_TOKEN_TYPE_CODE, context);
+	match = io_parser_match(parser, parser->pos, config->code_start_tag);
+	if (match) {
+		return match < 0 ? IO_PARSER_NEED_MORE : io_parser_scan_lua(parser,
+			config->code_start_tag, config->code_end_tag,
+			IO_TOKEN_TYPE_CODE);
+	}
+
+	return io_parser_scan_text(parser);
 }
 
-static const char * io_parser_parse_expr(const char *ptr,
-	io_parser_context_t *context)
+static io_chomp_type_t io_parser_chomp_type(char c, int *flag)
 {
-	ptr += sdslen(context->config->expr_start_tag);
-	return io_parser_parse_lua(ptr, context->config->expr_end_tag,
-		IO_TOKEN_TYPE_EXPR, context);
+	*flag = 1;
+	switch (c) {
+		case '+': return IO_CHOMP_NONE;
+		case '-': return IO_CHOMP_ONE;
+		case ':': return IO_CHOMP_COLLAPSE;
+		case '~': return IO_CHOMP_GREEDY;
+	}
+	*flag = 0;
+
+	return IO_CHOMP_NONE;
 }
 
-static const char * io_parser_parse_comment(const char *ptr,
-	io_parser_context_t *context)
+static void io_parser_lua_token_set_chomps(io_parser_t *parser,
+	io_token_t *token, io_chomp_type_t *pre, io_chomp_type_t *post)
 {
-	ptr += sdslen(context->config->comm_start_tag);
-	return io_parser_parse_lua(ptr, context->config->comm_end_tag,
-		IO_TOKEN_TYPE_COMMENT, context);
+	const char *value = parser->in + token->offset;
+	int pre_flag, post_flag;
+
+	if (token->length == 0) {
+		return;
+	}
+
+	*pre = io_parser_chomp_type(value[0], &pre_flag);
+	*post = io_parser_chomp_type(value[token->length - 1], &post_flag);
+
+	token->offset += pre_flag;
+	if (token->length > (size_t) (pre_flag + post_flag)) {
+		token->length -= pre_flag + post_flag;
+	} else {
+		token->length = 0;
+	}
 }
 
-static const char * io_parser_parse_whitespace(const char *ptr,
-	io_parser_context_t *context)
+/* Whitespace tokens reached by a chomp are output as Lua code, which keeps
+ * line numbers intact. */
+static int io_parser_chomp_token(io_token_t *token, io_chomp_type_t chomp)
 {
-	const char *tmp = ptr;
-	sds value;
+	io_token_type_t oldtype = token->type;
 
-	while (*ptr == ' ' || *ptr == '\t') ptr++;
+	if (oldtype != IO_TOKEN_TYPE_WHITESPACE
+	&& oldtype != IO_TOKEN_TYPE_NEWLINE) {
+		return 0;
+	}
 
-	value = sdsnewlen(tmp, ptr - tmp);
-	io_token_list_push(context,
-		io_token_new(IO_TOKEN_TYPE_WHITESPACE, value));
+	token->type = IO_TOKEN_TYPE_PLAIN;
 
-	return ptr - 1;
+	return !(chomp == IO_CHOMP_ONE && oldtype == IO_TOKEN_TYPE_NEWLINE);
 }
 
-static const char * io_parser_parse_text(const char *ptr,
-	io_parser_context_t *context)
+static void io_parser_lua_token_pre_chomp(io_parser_t *parser, size_t i,
+	io_chomp_type_t chomp)
 {
-	sds code_start_tag = context->config->code_start_tag;
-	size_t code_start_tag_len = sdslen(code_start_tag);
-	sds expr_start_tag = context->config->expr_start_tag;
-	size_t expr_start_tag_len = sdslen(expr_start_tag);
-	sds comm_start_tag = context->config->comm_start_tag;
-	size_t comm_start_tag_len = sdslen(comm_start_tag);
-	const char *tmp;
-	sds value;
+	size_t j;
 
-	tmp = ptr;
-	while (*ptr && *ptr != '\n' && *ptr != ' ' && *ptr != '\t'
-	&& strncmp(ptr, code_start_tag, code_start_tag_len)
-	&& strncmp(ptr, expr_start_tag, expr_start_tag_len)
-	&& strncmp(ptr, comm_start_tag, comm_start_tag_len))
-	{
-		ptr++;
-	}
-
-	value = sdsnewlen(tmp, ptr - tmp);
-	io_token_list_push(context, io_token_new(IO_TOKEN_TYPE_TEXT, value));
-
-	return ptr - 1;
-}
-
-static const char * io_parser_parse_main(const char *ptr,
-	io_parser_context_t *context)
-{
-	sds code_start_tag = context->config->code_start_tag;
-	size_t code_start_tag_len = sdslen(code_start_tag);
-	sds expr_start_tag = context->config->expr_start_tag;
-	size_t expr_start_tag_len = sdslen(expr_start_tag);
-	sds comm_start_tag = context->config->comm_start_tag;
-	size_t comm_start_tag_len = sdslen(comm_start_tag);
-
-	while (ptr && *ptr) {
-		if (*ptr == '\n') {
-			io_token_t *token = io_token_new(IO_TOKEN_TYPE_NEWLINE,
-				sdsnew("\n"));
-			io_token_list_push(context, token);
-		} else if (*ptr == ' ' || *ptr == '\t') {
-			ptr = io_parser_parse_whitespace(ptr, context);
-		} else if (!strncmp(ptr, comm_start_tag, comm_start_tag_len)) {
-			ptr = io_parser_parse_comment(ptr, context);
-		} else if (!strncmp(ptr, expr_start_tag, expr_start_tag_len)) {
-			ptr = io_parser_parse_expr(ptr, context);
-		} else if (!strncmp(ptr, code_start_tag, code_start_tag_len)) {
-			ptr = io_parser_parse_code(ptr, context);
-		} else {
-			ptr = io_parser_parse_text(ptr, context);
+	if (!chomp) return;
+
+	for (j = i; j > 0 && io_parser_chomp_token(&(parser->tokens[j - 1]),
+		chomp); j--);
+
+	if (chomp == IO_CHOMP_COLLAPSE) {
+		/* Right after a tag collapsing after itself, both collapse to
+		 * the same single space. */
+		if (i > 0) {
+			parser->tokens[i - 1].space &= ~IO_TOKEN_SPACE_AFTER;
 		}
-		if (ptr && *ptr) ptr++;
+		parser->tokens[i].space |= IO_TOKEN_SPACE_BEFORE;
 	}
+}
 
-	return ptr;
+static void io_parser_lua_token_post_chomp(io_parser_t *parser, size_t i,
+	io_chomp_type_t chomp)
+{
+	size_t j;
+
+	if (!chomp) return;
+
+	for (j = i + 1; j < parser->ntokens
+		&& io_parser_chomp_token(&(parser->tokens[j]), chomp); j++);
+
+	if (chomp == IO_CHOMP_COLLAPSE) {
+		parser->tokens[i].space |= IO_TOKEN_SPACE_AFTER;
+	}
 }
 
-static void io_parser_lua_token_set_chomps(io_token_t *token,
-	io_chomp_type_t *pre, io_chomp_type_t *post)
+/* If a long bracket ([[ or [=*[) starts at pos, returns the position of
+ * its last character, else pos. */
+static size_t io_parser_skip_long_bracket(const char *in, size_t pos,
+	size_t len)
 {
-	const char *ptr;
-	int pre_flag = 1, post_flag = 1;
+	size_t n_equals = 0;
 
-	ptr = token->value;
-	switch (*ptr) {
-		case '+': *pre = IO_CHOMP_NONE; break;
-		case '-': *pre = IO_CHOMP_ONE; break;
-		case ':': *pre = IO_CHOMP_COLLAPSE; break;
-		case '~': *pre = IO_CHOMP_GREEDY; break;
-		default: pre_flag = 0;
+	while (pos + n_equals + 1 < len && in[pos + n_equals + 1] == '=') {
+		n_equals++;
+	}
+	if (pos + n_equals + 1 < len && in[pos + n_equals + 1] == '[') {
+		return io_parser_find_multiline_end(in, pos, len, n_equals);
 	}
 
-	ptr = token->value + sdslen(token->value) - 1;
-	switch (*ptr) {
-		case '+': *post = IO_CHOMP_NONE; break;
-		case '-': *post = IO_CHOMP_ONE; break;
-		case ':': *post = IO_CHOMP_COLLAPSE; break;
-		case '~': *post = IO_CHOMP_GREEDY; break;
-		default: post_flag = 0;
+	return pos;
+}
+
+/* Returns the position of the first c in in[pos..len[ that is not in a
+ * string, a comment or brackets, or len. */
+static size_t io_parser_find_outside(const char *in, size_t pos, size_t len,
+	char c)
+{
+	size_t next;
+	int depth = 0;
+
+	for (; pos < len; pos++) {
+		switch (in[pos]) {
+			case '\'':
+			case '"':
+				pos = io_parser_find_quote(in, pos, len);
+				break;
+			case '-':
+				if (pos + 1 < len && in[pos + 1] == '-') {
+					pos += 2;
+					next = io_parser_skip_long_bracket(in, pos, len);
+					if (next != pos) {
+						pos = next;
+						break;
+					}
+					while (pos < len && in[pos] != '\n') {
+						pos++;
+					}
+				}
+				break;
+			case '[':
+				next = io_parser_skip_long_bracket(in, pos, len);
+				if (next != pos) {
+					pos = next;
+					break;
+				}
+				/* Fall through */
+			case '(':
+			case '{':
+				depth++;
+				break;
+			case ']':
+			case ')':
+			case '}':
+				depth--;
+				break;
+			default:
+				if (in[pos] == c && depth == 0) {
+					return pos;
+				}
+		}
 	}
 
-	sdsrange(token->value, pre_flag, -(post_flag + 1));
+	return len;
 }
 
-static void io_parser_lua_token_pre_chomp(io_token_t *token,
-	io_chomp_type_t chomp)
+static int io_parser_is_space(char c)
 {
-	io_token_type_t oldtype;
-	gds_inline_dlist_node_t *it;
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
 
-	if (!chomp) return;
+/* Appends the arguments of Io.filter for one filter of a pipeline: its
+ * name, the number of its arguments and the arguments. Anything that is
+ * not a name optionally followed by arguments in parentheses is passed as
+ * a name, and fails as an unknown filter. */
+static sds io_parser_cat_filter(sds buf, const char *in, size_t len)
+{
+	size_t start = 0, i, end = len, nargs = 0;
 
-	it = token->dlist.prev;
-	while (it) {
-		token = container_of(it, io_token_t, dlist);
+	while (start < len && io_parser_is_space(in[start])) start++;
+	while (end > start && io_parser_is_space(in[end - 1])) end--;
 
-		if (token->type != IO_TOKEN_TYPE_WHITESPACE
-		&& token->type != IO_TOKEN_TYPE_NEWLINE) {
-			break;
-		}
+	for (i = start; i < end && (in[i] == '_' || (in[i] >= 'a' && in[i] <= 'z')
+	|| (in[i] >= 'A' && in[i] <= 'Z') || (in[i] >= '0' && in[i] <= '9'));
+	i++);
 
-		oldtype = token->type;
-		token->type = IO_TOKEN_TYPE_PLAIN;
+	buf = sdscat(buf, ", ");
+	if (i == start || (i < end && (in[i] != '(' || in[end - 1] != ')'))) {
+		buf = sdscatrepr(buf, in + start, end - start);
+		return sdscat(buf, ", 0");
+	}
+	buf = sdscatrepr(buf, in + start, i - start);
+	if (i == end) {
+		return sdscat(buf, ", 0");
+	}
 
-		if (chomp == IO_CHOMP_ONE && oldtype == IO_TOKEN_TYPE_NEWLINE) {
-			break;
+	/* Count the arguments between the parentheses. */
+	start = i + 1;
+	end--;
+	for (i = start; i < end && io_parser_is_space(in[i]); i++);
+	if (i < end) {
+		nargs = 1;
+		i = io_parser_find_outside(in, start, end, ',');
+		while (i < end) {
+			nargs++;
+			i = io_parser_find_outside(in, i + 1, end, ',');
 		}
+	}
 
-		it = it->prev;
+	buf = sdscatprintf(buf, ", %u", (unsigned int) nargs);
+	if (nargs) {
+		buf = sdscat(buf, ", ");
+		buf = sdscatlen(buf, in + start, end - start);
 	}
+
+	return buf;
 }
 
-static void io_parser_lua_token_post_chomp(io_token_t *token,
-	io_chomp_type_t chomp)
+/* {{ value | f | g(x) }} is compiled to
+ * Io.out.filter(value, "f", 0, "g", 1, x), which applies the filters in C
+ * and writes the result. */
+static sds io_parser_cat_expr(sds buf, const char *in, size_t len)
 {
-	io_token_type_t oldtype;
-	gds_inline_dlist_node_t *it;
+	size_t pipe, start;
 
-	if (!chomp) return;
+	pipe = io_parser_find_outside(in, 0, len, '|');
+	if (pipe == len) {
+		buf = sdscat(buf, "Io.output(");
+		buf = sdscatlen(buf, in, len);
+		return sdscat(buf, ");");
+	}
 
-	it = token->dlist.next;
-	while (it) {
-		token = container_of(it, io_token_t, dlist);
+	buf = sdscat(buf, "Io.out.filter(");
+	buf = sdscatlen(buf, in, pipe);
+	while (pipe < len) {
+		start = pipe + 1;
+		pipe = io_parser_find_outside(in, start, len, '|');
+		buf = io_parser_cat_filter(buf, in + start, pipe - start);
+	}
 
-		if (token->type != IO_TOKEN_TYPE_WHITESPACE
-		&& token->type != IO_TOKEN_TYPE_NEWLINE) {
-			break;
-		}
+	return sdscat(buf, ");");
+}
+
+static void io_parser_emit(io_parser_t *parser, io_token_t *token)
+{
+	const char *value = parser->in + token->offset;
+	sds buf = parser->out;
 
-		oldtype = token->type;
-		token->type = IO_TOKEN_TYPE_PLAIN;
+	if (token->space & IO_TOKEN_SPACE_BEFORE) {
+		buf = sdscat(buf, "Io.output(\" \");");
+	}
 
-		if (chomp == IO_CHOMP_ONE && oldtype == IO_TOKEN_TYPE_NEWLINE) {
+	switch (token->type) {
+		case IO_TOKEN_TYPE_PLAIN:
+		case IO_TOKEN_TYPE_CODE:
+			buf = sdscatlen(buf, value, token->length);
 			break;
-		}
+		case IO_TOKEN_TYPE_TEXT:
+			buf = sdscat(buf, "Io.output(");
+			buf = sdscatrepr(buf, value, token->length);
+			buf = sdscat(buf, ");");
+			break;
+		case IO_TOKEN_TYPE_WHITESPACE:
+			buf = sdscat(buf, "Io.output(\"");
+			buf = sdscatlen(buf, value, token->length);
+			buf = sdscat(buf, "\");");
+			break;
+		case IO_TOKEN_TYPE_NEWLINE:
+			buf = sdscat(buf, "Io.output(\"\\n\");\n");
+			break;
+		case IO_TOKEN_TYPE_EXPR:
+			buf = io_parser_cat_expr(buf, value, token->length);
+			break;
+		case IO_TOKEN_TYPE_COMMENT:
+			/* Do nothing */
+			break;
+	}
 
-		it = it->next;
+	if (token->space & IO_TOKEN_SPACE_AFTER) {
+		buf = sdscat(buf, "Io.output(\" \");");
 	}
+
+	parser->out = buf;
 }
 
-static void io_parser_process_lua_token(io_parser_context_t *context,
-	io_token_t *token)
+/* Emit the first n tokens and move the others to the front. */
+static void io_parser_flush(io_parser_t *parser, size_t n)
 {
-	io_chomp_type_t pre_chomp = 0, post_chomp = 0;
-	io_token_t *newtoken;
+	size_t i;
 
-	io_parser_lua_token_set_chomps(token, &pre_chomp, &post_chomp);
-	io_parser_lua_token_pre_chomp(token, pre_chomp);
-	io_parser_lua_token_post_chomp(token, post_chomp);
+	for (i = 0; i < n; i++) {
+		io_parser_emit(parser, &(parser->tokens[i]));
+	}
 
-	if (pre_chomp == IO_CHOMP_COLLAPSE) {
-		newtoken = io_token_new(IO_TOKEN_TYPE_WHITESPACE, sdsnew(" "));
-		gds_inline_dlist_node_prepend(&(token->dlist), &(newtoken->dlist), NULL);
-		if (newtoken->dlist.prev == NULL) {
-			context->tokens_head = newtoken;
-		}
+	parser->ntokens -= n;
+	if (parser->ntokens && n) {
+		memmove(parser->tokens, parser->tokens + n,
+			parser->ntokens * sizeof(io_token_t));
 	}
-	if (post_chomp == IO_CHOMP_COLLAPSE) {
-		newtoken = io_token_new(IO_TOKEN_TYPE_WHITESPACE, sdsnew(" "));
-		gds_inline_dlist_node_append(&(token->dlist), &(newtoken->dlist), NULL);
-		if (newtoken->dlist.next == NULL) {
-			context->tokens_tail = newtoken;
+}
+
+static void io_parser_add_token(io_parser_t *parser, io_token_type_t type,
+	size_t offset, size_t length)
+{
+	io_chomp_type_t pre_chomp = 0, post_chomp = 0;
+	io_token_t *token, *tokens;
+	size_t i;
+
+	if (parser->ntokens == parser->tokens_size) {
+		tokens = realloc(parser->tokens,
+			2 * parser->tokens_size * sizeof(io_token_t));
+		if (tokens == NULL) {
+			fprintf(stderr, "Memory allocation error\n");
+			return;
 		}
+		parser->tokens = tokens;
+		parser->tokens_size *= 2;
+	}
+
+	i = parser->ntokens++;
+	token = &(parser->tokens[i]);
+	token->type = type;
+	token->space = 0;
+	token->offset = offset;
+	token->length = length;
+
+	if (type == IO_TOKEN_TYPE_WHITESPACE || type == IO_TOKEN_TYPE_NEWLINE) {
+		return;
+	}
+
+	if (parser->pending) {
+		io_parser_lua_token_post_chomp(parser, 0, parser->pending_chomp);
+		parser->pending = 0;
+	}
+
+	if (type == IO_TOKEN_TYPE_CODE
+	|| type == IO_TOKEN_TYPE_EXPR
+	|| type == IO_TOKEN_TYPE_COMMENT)
+	{
+		io_parser_lua_token_set_chomps(parser, token, &pre_chomp,
+			&post_chomp);
+		io_parser_lua_token_pre_chomp(parser, i, pre_chomp);
+		parser->pending = 1;
+		parser->pending_chomp = post_chomp;
+		io_parser_flush(parser, i);
+	} else {
+		io_parser_flush(parser, parser->ntokens);
 	}
 }
 
-static void io_parser_process_lua_tokens(io_parser_context_t *context)
+static void io_parser_finish(io_parser_t *parser)
 {
-	io_token_t *token;
-	gds_inline_dlist_node_t *it;
-
-	it = &(context->tokens_head->dlist);
-	while (it) {
-		token = container_of(it, io_token_t, dlist);
-		if (token->type == IO_TOKEN_TYPE_CODE
-		|| token->type == IO_TOKEN_TYPE_EXPR
-		|| token->type == IO_TOKEN_TYPE_COMMENT)
-		{
-			io_parser_process_lua_token(context, token);
-		}
-		it = it->next;
+	if (parser->pending) {
+		io_parser_lua_token_post_chomp(parser, 0, parser->pending_chomp);
+		parser->pending = 0;
 	}
+	io_parser_flush(parser, parser->ntokens);
+	parser->done = 1;
 }
 
-sds io_parser_parse(const char *template, io_config_t *config)
+static void io_parser_fill(io_parser_t *parser)
 {
-	const char *ptr = template;
-	io_token_t *token;
-	sds buf;
-	gds_inline_dlist_node_t *it;
+	size_t size, n, keep, i;
 
-	io_parser_context_t context;
-	context.tokens_head = NULL;
-	context.tokens_tail = NULL;
-	context.config = config;
+	if (parser->reader == NULL) {
+		parser->eof = 1;
+		return;
+	}
 
-	io_parser_parse_main(ptr, &context);
+	/* Tokens not emitted yet point into the window. */
+	keep = parser->ntokens ? parser->tokens[0].offset : parser->pos;
+	if (keep > 0) {
+		sdsrange(parser->buf, keep, -1);
+		parser->len -= keep;
+		parser->pos -= keep;
+		for (i = 0; i < parser->ntokens; i++) {
+			parser->tokens[i].offset -= keep;
+		}
+	}
 
-	io_parser_process_lua_tokens(&context);
+	/* Read at least as much as what is already buffered, so that a tag
+	 * spanning many reads is rescanned a logarithmic number of times. */
+	size = parser->len > IO_PARSER_CHUNK_SIZE ? parser->len
+		: IO_PARSER_CHUNK_SIZE;
+	parser->buf = sdsMakeRoomFor(parser->buf, size);
+	n = parser->reader(parser->data, parser->buf + parser->len, size);
+	sdsIncrLen(parser->buf, n);
+	parser->in = parser->buf;
+	parser->len += n;
+
+	if (n == 0) {
+		parser->eof = 1;
+	}
+}
 
-	buf = sdsempty();
-	it = &(context.tokens_head->dlist);
-	while (it) {
-		token = container_of(it, io_token_t, dlist);
-		switch (token->type) {
-			case IO_TOKEN_TYPE_PLAIN:
-			case IO_TOKEN_TYPE_CODE:
-				buf = sdscat(buf, token->value);
-				break;
-			case IO_TOKEN_TYPE_TEXT:
-				buf = sdscat(buf, "Io.output(");
-				buf = sdscatrepr(buf, token->value, sdslen(token->value));
-				buf = sdscat(buf, ");");
-				break;
-			case IO_TOKEN_TYPE_WHITESPACE:
-				buf = sdscat(buf, "Io.output(\"");
-				buf = sdscat(buf, token->value);
-				buf = sdscat(buf, "\");");
-				break;
-			case IO_TOKEN_TYPE_NEWLINE:
-				buf = sdscat(buf, "Io.output(\"\\n\");\n");
-				break;
-			case IO_TOKEN_TYPE_EXPR:
-				buf = sdscat(buf, "Io.output(");
-				buf = sdscat(buf, token->value);
-				buf = sdscat(buf, ");");
+static void io_parser_run(io_parser_t *parser, size_t min)
+{
+	while (!parser->done && sdslen(parser->out) < min) {
+		switch (io_parser_scan(parser)) {
+			case IO_PARSER_NEED_MORE:
+				io_parser_fill(parser);
 				break;
-			case IO_TOKEN_TYPE_COMMENT:
-				/* Do nothing */
+			case IO_PARSER_END:
+				io_parser_finish(parser);
 				break;
 		}
-		it = it->next;
 	}
+}
 
-	io_token_list_free(&context);
-
-	return buf;
+static size_t io_parser_read_filep(void *data, char *buf, size_t size)
+{
+	return fread(buf, 1, size, data);
 }
 
-sds io_parser_parse_filep(FILE *filep, io_config_t *config)
+io_parser_t * io_parser_new(io_parser_reader_t reader, void *data,
+	io_config_t *config)
 {
-	char buf[1024];
-	sds out;
-	sds tpl;
+	io_parser_t *parser;
+
+	parser = malloc(sizeof(io_parser_t));
+	if (parser == NULL) {
+		fprintf(stderr, "Memory allocation error\n");
+		return NULL;
+	}
+
+	parser->tokens = malloc(IO_PARSER_TOKENS_SIZE * sizeof(io_token_t));
+	if (parser->tokens == NULL) {
+		fprintf(stderr, "Memory allocation error\n");
+		free(parser);
+		return NULL;
+	}
+
+	parser->config = config;
+	parser->reader = reader;
+	parser->data = data;
+	parser->buf = sdsempty();
+	parser->in = parser->buf;
+	parser->len = 0;
+	parser->pos = 0;
+	parser->eof = 0;
+	parser->done = 0;
+	parser->ntokens = 0;
+	parser->tokens_size = IO_PARSER_TOKENS_SIZE;
+	parser->pending = 0;
+	parser->pending_chomp = IO_CHOMP_NONE;
+	parser->out = sdsempty();
+
+	return parser;
+}
 
+io_parser_t * io_parser_new_filep(FILE *filep, io_config_t *config)
+{
 	if (filep == NULL) {
 		fprintf(stderr, "filep is NULL\n");
 		return NULL;
 	}
 
-	tpl = sdsempty();
+	return io_parser_new(io_parser_read_filep, filep, config);
+}
 
-	while (!feof(filep)) {
-		if(fgets(buf, 1024, filep)) {
-			tpl = sdscat(tpl, buf);
-		}
+const char * io_parser_next(io_parser_t *parser, size_t *len)
+{
+	io_trace_begin("io_parser_next");
+
+	sdsclear(parser->out);
+	io_parser_run(parser, IO_PARSER_CHUNK_SIZE);
+
+	io_trace_end("io_parser_next");
+
+	if (sdslen(parser->out) == 0) {
+		return NULL;
+	}
+
+	if (len) {
+		*len = sdslen(parser->out);
 	}
 
-	out = io_parser_parse(tpl, config);
-	sdsfree(tpl);
+	return parser->out;
+}
+
+void io_parser_free(io_parser_t *parser)
+{
+	if (parser) {
+		free(parser->tokens);
+		sdsfree(parser->buf);
+		sdsfree(parser->out);
+		free(parser);
+	}
+}
+
+static sds io_parser_parse_all(io_parser_t *parser)
+{
+	sds out;
+
+	io_trace_begin("io_parser_parse");
+
+	io_parser_run(parser, SIZE_MAX);
+	out = parser->out;
+	parser->out = NULL;
+	io_parser_free(parser);
+
+	io_trace_end("io_parser_parse");
 
 	return out;
 }
 
+sds io_parser_parse(const char *template, io_config_t *config)
+{
+	io_parser_t *parser;
+
+	parser = io_parser_new(NULL, NULL, config);
+	if (parser == NULL) {
+		return NULL;
+	}
+
+	parser->in = template;
+	parser->len = strlen(template);
+	parser->eof = 1;
+
+	return io_parser_parse_all(parser);
+}
+
+sds io_parser_parse_filep(FILE *filep, io_config_t *config)
+{
+	io_parser_t *parser;
+
+	parser = io_parser_new_filep(filep, config);
+	if (parser == NULL) {
+		return NULL;
+	}
+
+	return io_parser_parse_all(parser);
+}
+
 sds io_parser_parse_file(const char *filename, io_config_t *config)
 {
 	FILE *fp;
@@ -0,0 +1,128 @@
+/*
+ * Copyright 2014 Julian Maurice
+ *
+ * This file is part of libio
+ *
+ * libio is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "io_pool.h"
+
+static pthread_mutex_t io_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Signaled when a task is queued or the pool stops. */
+static pthread_cond_t io_pool_work = PTHREAD_COND_INITIALIZER;
+/* Broadcast when a task is done or a worker exits. */
+static pthread_cond_t io_pool_done = PTHREAD_COND_INITIALIZER;
+
+/* Every queued task has been given to an idle worker, which takes it from
+ * the queue as soon as it wakes up. */
+static io_pool_task_t *io_pool_queue = NULL;
+static io_pool_task_t *io_pool_queue_tail = NULL;
+static unsigned int io_pool_threads = 0;
+static unsigned int io_pool_idle = 0;
+static int io_pool_stopping = 0;
+
+static void * io_pool_worker(void *data)
+{
+	io_pool_task_t *task = data;
+
+	pthread_mutex_lock(&io_pool_lock);
+	while (task != NULL) {
+		pthread_mutex_unlock(&io_pool_lock);
+		task->run(task->data);
+		pthread_mutex_lock(&io_pool_lock);
+
+		task->done = 1;
+		pthread_cond_broadcast(&io_pool_done);
+		io_pool_idle++;
+
+		while (io_pool_queue == NULL && !io_pool_stopping) {
+			pthread_cond_wait(&io_pool_work, &io_pool_lock);
+		}
+		task = io_pool_queue;
+		if (task != NULL) {
+			io_pool_queue = task->next;
+			if (io_pool_queue == NULL) {
+				io_pool_queue_tail = NULL;
+			}
+		}
+	}
+	io_pool_idle--;
+	io_pool_threads--;
+	pthread_cond_broadcast(&io_pool_done);
+	pthread_mutex_unlock(&io_pool_lock);
+
+	return NULL;
+}
+
+int io_pool_submit(io_pool_task_t *task)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int ret = -1;
+
+	task->done = 0;
+	task->next = NULL;
+
+	pthread_mutex_lock(&io_pool_lock);
+	if (io_pool_idle > 0) {
+		/* The worker is taken now, so that another task cannot be
+		 * queued for it. */
+		io_pool_idle--;
+		if (io_pool_queue_tail) {
+			io_pool_queue_tail->next = task;
+		} else {
+			io_pool_queue = task;
+		}
+		io_pool_queue_tail = task;
+		pthread_cond_signal(&io_pool_work);
+		ret = 0;
+	} else if (io_pool_threads < IO_POOL_MAX_THREADS) {
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if (pthread_create(&thread, &attr, io_pool_worker, task) == 0) {
+			io_pool_threads++;
+			ret = 0;
+		}
+		pthread_attr_destroy(&attr);
+	}
+	pthread_mutex_unlock(&io_pool_lock);
+
+	return ret;
+}
+
+void io_pool_wait(io_pool_task_t *task)
+{
+	pthread_mutex_lock(&io_pool_lock);
+	while (!task->done) {
+		pthread_cond_wait(&io_pool_done, &io_pool_lock);
+	}
+	pthread_mutex_unlock(&io_pool_lock);
+}
+
+void io_pool_free(void)
+{
+	pthread_mutex_lock(&io_pool_lock);
+	io_pool_stopping = 1;
+	pthread_cond_broadcast(&io_pool_work);
+	while (io_pool_threads > 0) {
+		pthread_cond_wait(&io_pool_done, &io_pool_lock);
+	}
+	io_pool_stopping = 0;
+	pthread_mutex_unlock(&io_pool_lock);
+}
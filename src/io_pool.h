@@ -0,0 +1,54 @@
+/*
+ * Copyright 2014 Julian Maurice
+ *
+ * This file is part of libio
+ *
+ * libio is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef io_pool_h_included
+#define io_pool_h_included
+
+/* Worker threads are shared by every render of the process and kept idle
+ * between tasks, up to this many. */
+#define IO_POOL_MAX_THREADS 64
+
+typedef struct io_pool_task_s {
+	void (*run)(void *data);
+	void *data;
+	int done;
+	struct io_pool_task_s *next;
+} io_pool_task_t;
+
+/* Runs task->run(task->data) on an idle worker, or on a new one while the
+ * pool is not full. Returns -1 if every worker is busy, in which case the
+ * caller runs the task itself. Tasks are never queued behind busy workers,
+ * so a task waiting for tasks it submitted cannot deadlock. */
+int
+io_pool_submit(
+	io_pool_task_t *task
+);
+
+/* Waits until a submitted task has run. */
+void
+io_pool_wait(
+	io_pool_task_t *task
+);
+
+/* Stops idle workers and waits for them to exit. Called by io_finalize(),
+ * no task must be running. */
+void
+io_pool_free(void);
+
+#endif /* ! io_pool_h_included */
@@ -0,0 +1,130 @@
+/*
+ * Copyright 2014 Julian Maurice
+ *
+ * This file is part of libio
+ *
+ * libio is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <lua.h>
+#include <lauxlib.h>
+#include "io_readonly.h"
+
+/* A view is an empty table whose metatable has the table as __index. The
+ * metatable is hidden by __metatable, and recognized by its __newindex. */
+
+static int io_readonly_newindex(lua_State *L)
+{
+	return luaL_error(L, "attempt to modify a read-only table");
+}
+
+void io_readonly_unwrap(lua_State *L, int idx)
+{
+	idx = lua_absindex(L, idx);
+	if (!lua_istable(L, idx) || !lua_getmetatable(L, idx)) {
+		return;
+	}
+
+	lua_pushliteral(L, "__newindex");
+	lua_rawget(L, -2);
+	if (lua_tocfunction(L, -1) == io_readonly_newindex) {
+		lua_pushliteral(L, "__index");
+		lua_rawget(L, -3);
+		lua_replace(L, idx);
+	}
+	lua_pop(L, 2);
+}
+
+static int io_readonly_len(lua_State *L)
+{
+	io_readonly_unwrap(L, 1);
+	lua_pushunsigned(L, lua_rawlen(L, 1));
+
+	return 1;
+}
+
+static int io_readonly_next(lua_State *L)
+{
+	lua_settop(L, 2);
+	if (lua_next(L, 1)) {
+		return 2;
+	}
+	lua_pushnil(L);
+
+	return 1;
+}
+
+static int io_readonly_pairs(lua_State *L)
+{
+	io_readonly_unwrap(L, 1);
+	lua_pushcfunction(L, io_readonly_next);
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+
+	return 3;
+}
+
+static int io_readonly_inext(lua_State *L)
+{
+	lua_Integer i = luaL_checkinteger(L, 2) + 1;
+
+	lua_pushinteger(L, i);
+	lua_rawgeti(L, 1, i);
+
+	return lua_isnil(L, -1) ? 1 : 2;
+}
+
+static int io_readonly_ipairs(lua_State *L)
+{
+	io_readonly_unwrap(L, 1);
+	lua_pushcfunction(L, io_readonly_inext);
+	lua_pushvalue(L, 1);
+	lua_pushinteger(L, 0);
+
+	return 3;
+}
+
+static const luaL_Reg io_readonly_metamethods[] = {
+	{ "__newindex", io_readonly_newindex },
+	{ "__len", io_readonly_len },
+	{ "__pairs", io_readonly_pairs },
+	{ "__ipairs", io_readonly_ipairs },
+	{ NULL, NULL }
+};
+
+void io_readonly_seal(lua_State *L, int idx)
+{
+	idx = lua_absindex(L, idx);
+	luaL_checkstack(L, 6, "cannot seal params");
+
+	lua_pushnil(L);
+	while (lua_next(L, idx)) {
+		if (lua_istable(L, -1)) {
+			io_readonly_seal(L, -1);
+
+			// t[k] = setmetatable({}, { __index = t[k], ... })
+			lua_pushvalue(L, -2);
+			lua_newtable(L);
+			lua_createtable(L, 0, 6);
+			luaL_setfuncs(L, io_readonly_metamethods, 0);
+			lua_pushvalue(L, -4);
+			lua_setfield(L, -2, "__index");
+			lua_pushboolean(L, 0);
+			lua_setfield(L, -2, "__metatable");
+			lua_setmetatable(L, -2);
+			lua_rawset(L, idx);
+		}
+		lua_pop(L, 1);
+	}
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright 2014 Julian Maurice
+ *
+ * This file is part of libio
+ *
+ * libio is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef io_readonly_h_included
+#define io_readonly_h_included
+
+#include <lua.h>
+
+/* Replaces every table found in the values of the table at idx, at any
+ * depth, with a read-only view of it. Reading a view, or iterating it with
+ * pairs, ipairs or #, reads the table; writing to it raises an error. Can
+ * raise errors. */
+void
+io_readonly_seal(
+	lua_State *L,
+	int idx
+);
+
+/* If the value at idx is a read-only view, replaces it with its table, for
+ * C functions that read tables with raw accesses. */
+void
+io_readonly_unwrap(
+	lua_State *L,
+	int idx
+);
+
+#endif /* ! io_readonly_h_included */
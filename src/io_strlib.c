@@ -0,0 +1,408 @@
+/*
+ * Copyright 2014 Julian Maurice
+ *
+ * This file is part of libio
+ *
+ * libio is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <sds.h>
+#include "io_template_private.h"
+#include "io_filter.h"
+#include "io_strlib.h"
+#include "io_iolib.h"
+#include "io_number.h"
+#include "io_readonly.h"
+
+/* Helpers write their result either to a luaL_Buffer, from which a string
+ * is returned, or directly to the render output. With a luaL_Buffer,
+ * nothing may be left on the stack above the arguments while writing. */
+typedef struct {
+	lua_State *L;
+	io_render_t *R;
+	luaL_Buffer b;
+} io_strlib_out_t;
+
+static void io_strlib_start(lua_State *L, io_strlib_out_t *out, int direct)
+{
+	out->L = L;
+	out->R = NULL;
+
+	if (direct) {
+		lua_getfield(L, LUA_REGISTRYINDEX, "io_render");
+		out->R = lua_touserdata(L, -1);
+		lua_pop(L, 1);
+	} else {
+		luaL_buffinit(L, &(out->b));
+	}
+}
+
+static void io_strlib_write(io_strlib_out_t *out, const char *s, size_t len)
+{
+	if (out->R == NULL) {
+		luaL_addlstring(&(out->b), s, len);
+		return;
+	}
+
+	io_iolib_write(out->L, out->R, s, len);
+}
+
+/* Writes the string or number on top of the stack and pops it. */
+static void io_strlib_write_value(io_strlib_out_t *out)
+{
+	const char *s;
+	size_t len;
+
+	if (out->R == NULL) {
+		luaL_addvalue(&(out->b));
+		return;
+	}
+
+	s = lua_tolstring(out->L, -1, &len);
+	io_strlib_write(out, s, len);
+	lua_pop(out->L, 1);
+}
+
+/* Must be returned by the helper, as it may suspend a pull render. */
+static int io_strlib_finish(io_strlib_out_t *out)
+{
+	if (out->R) {
+		return io_iolib_written(out->L, out->R);
+	}
+
+	luaL_pushresult(&(out->b));
+
+	return 1;
+}
+
+#define IO_STRLIB_FUNCTIONS(name) \
+	int io_strlib_##name(lua_State *L) \
+	{ \
+		return io_strlib_##name##_impl(L, 0); \
+	} \
+	int io_strlib_out_##name(lua_State *L) \
+	{ \
+		return io_strlib_##name##_impl(L, 1); \
+	}
+
+/* join(list [, sep [, i [, j]]]) */
+static int io_strlib_join_impl(lua_State *L, int direct)
+{
+	io_strlib_out_t out;
+	const char *sep;
+	size_t sep_len;
+	lua_Integer i, j;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	io_readonly_unwrap(L, 1);
+	sep = luaL_optlstring(L, 2, "", &sep_len);
+	i = luaL_optinteger(L, 3, 1);
+	j = luaL_opt(L, luaL_checkinteger, 4, luaL_len(L, 1));
+
+	io_strlib_start(L, &out, direct);
+	for (; i <= j; i++) {
+		lua_rawgeti(L, 1, i);
+		if (!lua_isstring(L, -1)) {
+			return luaL_error(L, "invalid value (a %s) at index %d in list",
+				luaL_typename(L, -1), (int) i);
+		}
+		io_strlib_write_value(&out);
+		if (i < j) {
+			io_strlib_write(&out, sep, sep_len);
+		}
+	}
+
+	return io_strlib_finish(&out);
+}
+
+IO_STRLIB_FUNCTIONS(join)
+
+/* format_number(n [, decimals [, thousands_sep [, decimal_point]]]) */
+static int io_strlib_format_number_impl(lua_State *L, int direct)
+{
+	io_strlib_out_t out;
+	lua_Number n = luaL_checknumber(L, 1);
+	int decimals = luaL_optint(L, 2, 0);
+	const char *sep, *point;
+	size_t sep_len, point_len;
+	char buf[64], *digits, *end;
+	int len, lead;
+
+	sep = luaL_optlstring(L, 3, ",", &sep_len);
+	point = luaL_optlstring(L, 4, ".", &point_len);
+	luaL_argcheck(L, decimals >= 0 && decimals <= 20, 2, "out of range");
+
+	if (isinf(n) || isnan(n) || n >= 1e21 || n <= -1e21) {
+		len = snprintf(buf, sizeof(buf), "%.14g", n);
+		len = io_number_fix_decimal_point(buf, len);
+		io_strlib_start(L, &out, direct);
+		io_strlib_write(&out, buf, len);
+		return io_strlib_finish(&out);
+	}
+
+	len = snprintf(buf, sizeof(buf), "%.*f", decimals, n);
+	len = io_number_fix_decimal_point(buf, len);
+	digits = buf;
+	end = strchr(buf, '.');
+	if (end == NULL) {
+		end = buf + len;
+	}
+
+	io_strlib_start(L, &out, direct);
+	if (*digits == '-') {
+		io_strlib_write(&out, "-", 1);
+		digits++;
+	}
+
+	/* Integer part, by groups of three digits. */
+	lead = (end - digits) % 3;
+	if (lead == 0) {
+		lead = 3;
+	}
+	io_strlib_write(&out, digits, lead);
+	for (digits += lead; digits < end; digits += 3) {
+		io_strlib_write(&out, sep, sep_len);
+		io_strlib_write(&out, digits, 3);
+	}
+
+	if (*end == '.') {
+		io_strlib_write(&out, point, point_len);
+		io_strlib_write(&out, end + 1, buf + len - end - 1);
+	}
+
+	return io_strlib_finish(&out);
+}
+
+IO_STRLIB_FUNCTIONS(format_number)
+
+/* format_date(time [, format [, utc]]) */
+static int io_strlib_format_date_impl(lua_State *L, int direct)
+{
+	io_strlib_out_t out;
+	time_t t = (time_t) luaL_checknumber(L, 1);
+	const char *format = luaL_optstring(L, 2, "%Y-%m-%d");
+	char buf[256];
+	struct tm tm;
+	size_t len;
+
+	if (lua_toboolean(L, 3)) {
+		gmtime_r(&t, &tm);
+	} else {
+		localtime_r(&t, &tm);
+	}
+
+	len = strftime(buf, sizeof(buf), format, &tm);
+	if (len == 0 && *format) {
+		return luaL_error(L, "formatted date is too long");
+	}
+
+	io_strlib_start(L, &out, direct);
+	io_strlib_write(&out, buf, len);
+
+	return io_strlib_finish(&out);
+}
+
+IO_STRLIB_FUNCTIONS(format_date)
+
+/* url_encode(s): percent-encodes everything but unreserved characters. */
+static int io_strlib_url_encode_impl(lua_State *L, int direct)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	io_strlib_out_t out;
+	const char *s, *run;
+	char escape[3];
+	size_t len, i;
+	unsigned char c;
+
+	s = luaL_checklstring(L, 1, &len);
+
+	io_strlib_start(L, &out, direct);
+	run = s;
+	for (i = 0; i < len; i++) {
+		c = s[i];
+		if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z')
+		|| (c >= '0' && c <= '9')
+		|| c == '-' || c == '_' || c == '.' || c == '~') {
+			continue;
+		}
+		io_strlib_write(&out, run, s + i - run);
+		escape[0] = '%';
+		escape[1] = hex[c >> 4];
+		escape[2] = hex[c & 0xf];
+		io_strlib_write(&out, escape, 3);
+		run = s + i + 1;
+	}
+	io_strlib_write(&out, run, s + len - run);
+
+	return io_strlib_finish(&out);
+}
+
+IO_STRLIB_FUNCTIONS(url_encode)
+
+#define io_utf8_is_start(c) (((unsigned char) (c) & 0xC0) != 0x80)
+
+static size_t io_utf8_len(const char *s, size_t len)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i < len; i++) {
+		if (io_utf8_is_start(s[i])) {
+			n++;
+		}
+	}
+
+	return n;
+}
+
+size_t io_utf8_offset(const char *s, size_t len, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (io_utf8_is_start(s[i]) && n-- == 0) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+/* truncate(s, n [, ellipsis]): first n characters of s followed by the
+ * ellipsis, or s if it is not longer than n characters. */
+static int io_strlib_truncate_impl(lua_State *L, int direct)
+{
+	io_strlib_out_t out;
+	const char *s, *ellipsis;
+	size_t len, ellipsis_len, cut;
+	lua_Integer n;
+
+	s = luaL_checklstring(L, 1, &len);
+	n = luaL_checkinteger(L, 2);
+	ellipsis = luaL_optlstring(L, 3, "...", &ellipsis_len);
+	luaL_argcheck(L, n >= 0, 2, "must be non-negative");
+
+	cut = io_utf8_offset(s, len, n);
+
+	io_strlib_start(L, &out, direct);
+	io_strlib_write(&out, s, cut);
+	if (cut < len) {
+		io_strlib_write(&out, ellipsis, ellipsis_len);
+	}
+
+	return io_strlib_finish(&out);
+}
+
+IO_STRLIB_FUNCTIONS(truncate)
+
+/* utf8_sub(s, i [, j]): string.sub with character indices. */
+static int io_strlib_utf8_sub_impl(lua_State *L, int direct)
+{
+	io_strlib_out_t out;
+	const char *s;
+	size_t len, start, end;
+	lua_Integer i, j, n;
+
+	s = luaL_checklstring(L, 1, &len);
+	i = luaL_checkinteger(L, 2);
+	j = luaL_optinteger(L, 3, -1);
+
+	if (i < 0 || j < 0) {
+		n = io_utf8_len(s, len);
+		if (i < 0) i = n + i + 1;
+		if (j < 0) j = n + j + 1;
+	}
+	if (i < 1) {
+		i = 1;
+	}
+
+	io_strlib_start(L, &out, direct);
+	if (i <= j) {
+		start = io_utf8_offset(s, len, i - 1);
+		end = start + io_utf8_offset(s + start, len - start, j - i + 1);
+		io_strlib_write(&out, s + start, end - start);
+	}
+
+	return io_strlib_finish(&out);
+}
+
+IO_STRLIB_FUNCTIONS(utf8_sub)
+
+int io_strlib_utf8_len(lua_State *L)
+{
+	size_t len;
+	const char *s = luaL_checklstring(L, 1, &len);
+
+	lua_pushunsigned(L, io_utf8_len(s, len));
+
+	return 1;
+}
+
+/* filter(value, name, nargs, args..., name, nargs, args...): applies a
+ * pipeline of filters to tostring(value). Filters write to two buffers of
+ * the render in turn, so no Lua string is created between them. */
+static int io_strlib_filter_impl(lua_State *L, int direct)
+{
+	io_strlib_out_t out;
+	io_render_t *R;
+	io_filter_t filter;
+	char buf[IO_NUMBER_BUFSIZE];
+	const char *s, *name;
+	size_t len;
+	int top, arg, nargs, i = 0;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, "io_render");
+	R = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+
+	top = lua_gettop(L);
+	s = io_iolib_tostring(L, R, 1, buf, &len);
+
+	for (arg = 2; arg <= top; arg += nargs) {
+		name = luaL_checkstring(L, arg);
+		nargs = luaL_checkint(L, arg + 1);
+		filter = io_filter_get(name);
+		if (filter == NULL) {
+			return luaL_error(L, "unknown filter '%s'", name);
+		}
+		arg += 2;
+		if (nargs < 0 || arg + nargs - 1 > top) {
+			return luaL_error(L, "invalid arguments to filter '%s'", name);
+		}
+
+		if (R->filter[i] == NULL) {
+			R->filter[i] = sdsempty();
+		} else {
+			sdsclear(R->filter[i]);
+		}
+		filter(&(R->filter[i]), s, len, L, arg, nargs);
+		s = R->filter[i];
+		len = sdslen(R->filter[i]);
+		i = !i;
+	}
+
+	io_strlib_start(L, &out, direct);
+	io_strlib_write(&out, s, len);
+
+	return io_strlib_finish(&out);
+}
+
+IO_STRLIB_FUNCTIONS(filter)
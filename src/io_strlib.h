@@ -0,0 +1,54 @@
+/*
+ * Copyright 2014 Julian Maurice
+ *
+ * This file is part of libio
+ *
+ * libio is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef io_strlib_h_included
+#define io_strlib_h_included
+
+#include <lua.h>
+
+/* String helpers of the Io library. Each one returns a string, except the
+ * ones in Io.out (io_strlib_out_*) which write it to the output instead. */
+
+int io_strlib_join(lua_State *L);
+int io_strlib_format_number(lua_State *L);
+int io_strlib_format_date(lua_State *L);
+int io_strlib_url_encode(lua_State *L);
+int io_strlib_truncate(lua_State *L);
+int io_strlib_utf8_sub(lua_State *L);
+int io_strlib_utf8_len(lua_State *L);
+int io_strlib_filter(lua_State *L);
+
+int io_strlib_out_join(lua_State *L);
+int io_strlib_out_format_number(lua_State *L);
+int io_strlib_out_format_date(lua_State *L);
+int io_strlib_out_url_encode(lua_State *L);
+int io_strlib_out_truncate(lua_State *L);
+int io_strlib_out_utf8_sub(lua_State *L);
+int io_strlib_out_filter(lua_State *L);
+
+/* Byte offset of the character at index n (0-based) of a UTF-8 string, or
+ * len if it has less than n + 1 characters. */
+size_t
+io_utf8_offset(
+	const char *s,
+	size_t len,
+	size_t n
+);
+
+#endif /* ! io_strlib_h_included */
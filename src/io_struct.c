@@ -0,0 +1,368 @@
+/*
+ * Copyright 2014 Julian Maurice
+ *
+ * This file is part of libio
+ *
+ * libio is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include "io_struct.h"
+#include "io_template_private.h"
+
+static const char IO_STRUCT_ARRAY_METATABLE[] = "io_struct_array";
+
+/* Userdata of structs and arrays of structs. owner is the param they were
+ * read from, directly or through struct fields, of which they hold a
+ * reference. */
+typedef struct {
+	io_struct_t *owner;
+	const io_schema_t *schema;
+	const char *data;
+	size_t length;
+} io_struct_ref_t;
+
+static io_struct_t * io_struct_alloc(const io_schema_t *schema,
+	const void *data, size_t length, int array, void (*free_data)(void *))
+{
+	io_struct_t *s;
+
+	s = malloc(sizeof(io_struct_t));
+	if (s == NULL) {
+		fprintf(stderr, "Memory allocation error\n");
+		return NULL;
+	}
+
+	s->schema = schema;
+	s->data = data;
+	s->length = length;
+	s->array = array;
+	s->free = free_data;
+	s->refs = 1;
+
+	return s;
+}
+
+io_struct_t * io_struct_new(const io_schema_t *schema, const void *data,
+	void (*free_data)(void *data))
+{
+	return io_struct_alloc(schema, data, 1, 0, free_data);
+}
+
+io_struct_t * io_struct_array_new(const io_schema_t *schema,
+	const void *data, size_t length, void (*free_data)(void *data))
+{
+	return io_struct_alloc(schema, data, length, 1, free_data);
+}
+
+void io_struct_free(io_struct_t *s)
+{
+	if (s && __sync_sub_and_fetch(&(s->refs), 1) == 0) {
+		if (s->free) {
+			s->free((void *) s->data);
+		}
+		free(s);
+	}
+}
+
+static void io_struct_push(lua_State *L, io_struct_t *owner,
+	const io_schema_t *schema, const void *data);
+
+#define IO_STRUCT_READ(p, stype, utype, sign) do { \
+	stype v; \
+	memcpy(&v, p, sizeof(v)); \
+	return sign ? (lua_Number) v : (lua_Number) (utype) v; \
+} while (0)
+
+static lua_Number io_struct_read_int(const char *p, size_t size, int sign)
+{
+	switch (size) {
+		case 1: IO_STRUCT_READ(p, int8_t, uint8_t, sign);
+		case 2: IO_STRUCT_READ(p, int16_t, uint16_t, sign);
+		case 4: IO_STRUCT_READ(p, int32_t, uint32_t, sign);
+		case 8: IO_STRUCT_READ(p, int64_t, uint64_t, sign);
+	}
+
+	return 0;
+}
+
+static void io_struct_push_field(lua_State *L, io_struct_t *owner,
+	const io_field_t *field, const char *base)
+{
+	const char *p = base + field->offset;
+	const void *ptr;
+	size_t i;
+
+	switch (field->type) {
+		case IO_FIELD_INT:
+		case IO_FIELD_UINT:
+			lua_pushnumber(L, io_struct_read_int(p, field->size,
+				field->type == IO_FIELD_INT));
+			break;
+		case IO_FIELD_DOUBLE:
+			if (field->size == sizeof(float)) {
+				float f;
+				memcpy(&f, p, sizeof(f));
+				lua_pushnumber(L, f);
+			} else {
+				double d;
+				memcpy(&d, p, sizeof(d));
+				lua_pushnumber(L, d);
+			}
+			break;
+		case IO_FIELD_BOOL:
+			for (i = 0; i < field->size && !p[i]; i++);
+			lua_pushboolean(L, i < field->size);
+			break;
+		case IO_FIELD_STRING:
+			memcpy(&ptr, p, sizeof(ptr));
+			if (ptr) {
+				lua_pushstring(L, ptr);
+			} else {
+				lua_pushnil(L);
+			}
+			break;
+		case IO_FIELD_CHARS:
+			lua_pushlstring(L, p, strnlen(p, field->size));
+			break;
+		case IO_FIELD_STRUCT:
+			memcpy(&ptr, p, sizeof(ptr));
+			if (ptr && field->schema) {
+				io_struct_push(L, owner, field->schema, ptr);
+			} else {
+				lua_pushnil(L);
+			}
+			break;
+		case IO_FIELD_INLINE:
+			if (field->schema) {
+				io_struct_push(L, owner, field->schema, p);
+			} else {
+				lua_pushnil(L);
+			}
+			break;
+		default:
+			lua_pushnil(L);
+	}
+}
+
+/* Upvalue 1 maps field names to their io_field_t. */
+static int io_struct_index(lua_State *L)
+{
+	io_struct_ref_t *ref = lua_touserdata(L, 1);
+	const io_field_t *field;
+
+	lua_pushvalue(L, 2);
+	lua_rawget(L, lua_upvalueindex(1));
+	field = lua_touserdata(L, -1);
+	if (field == NULL) {
+		return 1;
+	}
+
+	io_struct_push_field(L, ref->owner, field, ref->data);
+
+	return 1;
+}
+
+static int io_struct_next(lua_State *L)
+{
+	io_struct_ref_t *ref = lua_touserdata(L, 1);
+	const io_field_t *field = ref->schema->fields;
+
+	if (!lua_isnil(L, 2)) {
+		lua_pushvalue(L, 2);
+		lua_rawget(L, lua_upvalueindex(1));
+		field = lua_touserdata(L, -1);
+		if (field == NULL) {
+			return 0;
+		}
+		field++;
+	}
+
+	if (field->name == NULL) {
+		return 0;
+	}
+
+	lua_pushstring(L, field->name);
+	io_struct_push_field(L, ref->owner, field, ref->data);
+
+	return 2;
+}
+
+static int io_struct_gc(lua_State *L)
+{
+	io_struct_ref_t *ref = lua_touserdata(L, 1);
+
+	io_struct_free(ref->owner);
+
+	return 0;
+}
+
+static int io_struct_pairs(lua_State *L)
+{
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_pushcclosure(L, io_struct_next, 1);
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+
+	return 3;
+}
+
+/* Metatables are built once per schema and Lua state, and kept in the
+ * registry with the schema as key. */
+static void io_struct_push_metatable(lua_State *L, const io_schema_t *schema)
+{
+	const io_field_t *field;
+
+	lua_pushlightuserdata(L, (void *) schema);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	if (!lua_isnil(L, -1)) {
+		return;
+	}
+	lua_pop(L, 1);
+
+	lua_newtable(L);
+	lua_newtable(L);
+	for (field = schema->fields; field->name; field++) {
+		lua_pushlightuserdata(L, (void *) field);
+		lua_setfield(L, -2, field->name);
+	}
+	lua_pushvalue(L, -1);
+	lua_pushcclosure(L, io_struct_index, 1);
+	lua_setfield(L, -3, "__index");
+	lua_pushcclosure(L, io_struct_pairs, 1);
+	lua_setfield(L, -2, "__pairs");
+	lua_pushcfunction(L, io_struct_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pushstring(L, schema->name);
+	lua_setfield(L, -2, "__metatable");
+
+	lua_pushlightuserdata(L, (void *) schema);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+/* Pushes a new userdata with a reference to owner, and the metatable
+ * on top of the stack. The metatable is pushed first so that nothing can
+ * fail between taking the reference and setting __gc. */
+static void io_struct_push_ref(lua_State *L, io_struct_t *owner,
+	const io_schema_t *schema, const void *data, size_t length)
+{
+	io_struct_ref_t *ref;
+
+	ref = lua_newuserdata(L, sizeof(io_struct_ref_t));
+	ref->owner = owner;
+	ref->schema = schema;
+	ref->data = data;
+	ref->length = length;
+	__sync_add_and_fetch(&(owner->refs), 1);
+	lua_insert(L, -2);
+	lua_setmetatable(L, -2);
+}
+
+static void io_struct_push(lua_State *L, io_struct_t *owner,
+	const io_schema_t *schema, const void *data)
+{
+	io_struct_push_metatable(L, schema);
+	io_struct_push_ref(L, owner, schema, data, 1);
+}
+
+static io_struct_ref_t * io_struct_array_check(lua_State *L, int idx)
+{
+	return luaL_checkudata(L, idx, IO_STRUCT_ARRAY_METATABLE);
+}
+
+static int io_struct_array_index(lua_State *L)
+{
+	io_struct_ref_t *ref = io_struct_array_check(L, 1);
+	lua_Number n = lua_tonumber(L, 2);
+
+	if (n >= 1 && n <= ref->length && n == (size_t) n) {
+		io_struct_push(L, ref->owner, ref->schema,
+			ref->data + ((size_t) n - 1) * ref->schema->size);
+	} else {
+		lua_pushnil(L);
+	}
+
+	return 1;
+}
+
+static int io_struct_array_len(lua_State *L)
+{
+	io_struct_ref_t *ref = io_struct_array_check(L, 1);
+
+	lua_pushunsigned(L, ref->length);
+
+	return 1;
+}
+
+static int io_struct_array_next(lua_State *L)
+{
+	io_struct_ref_t *ref = io_struct_array_check(L, 1);
+	lua_Unsigned i = luaL_checkunsigned(L, 2);
+
+	if (i >= ref->length) {
+		return 0;
+	}
+
+	lua_pushunsigned(L, i + 1);
+	io_struct_push(L, ref->owner, ref->schema,
+		ref->data + i * ref->schema->size);
+
+	return 2;
+}
+
+static int io_struct_array_ipairs(lua_State *L)
+{
+	io_struct_array_check(L, 1);
+
+	lua_pushcfunction(L, io_struct_array_next);
+	lua_pushvalue(L, 1);
+	lua_pushinteger(L, 0);
+
+	return 3;
+}
+
+static const luaL_Reg io_struct_array_metamethods[] = {
+	{ "__index", io_struct_array_index },
+	{ "__gc", io_struct_gc },
+	{ "__len", io_struct_array_len },
+	{ "__ipairs", io_struct_array_ipairs },
+	{ NULL, NULL }
+};
+
+/* Values read from the struct, including nested structs, hold a
+ * reference to it, so that it outlives a param freed or replaced while
+ * they are still reachable, as with lazy params, fetched values and kept
+ * states. */
+void io_struct_to_lua_stack(io_struct_t *s, lua_State *L)
+{
+	if (!s->array) {
+		io_struct_push(L, s, s->schema, s->data);
+		return;
+	}
+
+	if (luaL_newmetatable(L, IO_STRUCT_ARRAY_METATABLE)) {
+		luaL_setfuncs(L, io_struct_array_metamethods, 0);
+		lua_pushliteral(L, "io_struct_array");
+		lua_setfield(L, -2, "__metatable");
+	}
+	io_struct_push_ref(L, s, s->schema, s->data, s->length);
+}
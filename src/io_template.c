@@ -17,10 +17,14 @@
  * along with libio.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
@@ -31,11 +35,36 @@
 #include "io_globals.h"
 #include "io_iolib.h"
 #include "io_parser.h"
+#include "io_cache.h"
 #include "io_embody.h"
+#include "io_json.h"
 #include "io_lua_value.h"
+#include "io_lua_table.h"
 #include "io_config.h"
 #include "io_template_private.h"
 #include "io_template.h"
+#include "io_trace.h"
+#include "io_value.h"
+#include "io_pool.h"
+#include "io_readonly.h"
+
+struct io_spawn_s {
+	io_template_t *T;
+	sds path;
+	sds params;
+	void ***items;
+	size_t item_count;
+	size_t item_base;
+	size_t offset;
+	volatile int *cancelled;
+	unsigned long long deadline;
+	unsigned long instruction_limit;
+	io_pool_task_t task;
+	int started;
+	io_render_status_t status;
+	sds output;
+	struct io_spawn_s *next;
+};
 
 io_template_t * io_template_new(io_config_t *config)
 {
@@ -53,14 +82,37 @@ io_template_t * io_template_new(io_config_t *config)
 		T->config = io_globals_get_default_config();
 	}
 
-	gds_hash_map_t *stash = gds_hash_map_new(128, gds_hash_djb2, strcmp,
-		NULL, emb_container_free, emb_container_free);
-	T->stash = emb_new("gds_hash_map", stash);
+	T->stash = emb_new("gds_hash_map", io_lua_table_new());
+	T->changed = NULL;
 
 	T->name = NULL;
 	T->code = NULL;
+	T->file = 0;
+	T->stream = 0;
+	T->version = 0;
+	T->dependencies = NULL;
+	T->lazy = NULL;
 	T->last_render = NULL;
 
+	T->state = NULL;
+	T->params_version = 0;
+
+	T->allocator = IO_ALLOCATOR_DEFAULT;
+	T->arena = NULL;
+	T->gc_enabled = 1;
+	T->gc_pause = 0;
+	T->gc_stepmul = 0;
+	T->isolated = 0;
+
+	T->memory_limit = 0;
+	T->timeout = 0;
+	T->instruction_limit = 0;
+	T->cancelled = 0;
+	T->status = IO_RENDER_OK;
+	T->stats.heap_peak = 0;
+	T->stats.output_size = 0;
+	T->stats.instructions = 0;
+
 	return T;
 }
 
@@ -69,6 +121,17 @@ io_config_t * io_template_get_config(io_template_t *T)
 	return T ? T->config : NULL;
 }
 
+static void io_template_inline_includes(io_template_t *T)
+{
+	io_dependency_free(T->dependencies);
+	T->dependencies = NULL;
+
+	if (T->config->inline_includes) {
+		T->code = io_inline_includes(T->code, T->config,
+			&(T->dependencies));
+	}
+}
+
 int io_template_set_template_string(io_template_t *T, const char *tpl)
 {
 	if (T == NULL) {
@@ -79,12 +142,18 @@ int io_template_set_template_string(io_template_t *T, const char *tpl)
 	sdsfree(T->code);
 	T->name = sdsnew("(Io:main)");
 	T->code = io_parser_parse(tpl, T->config);
+	T->file = 0;
+	T->stream = 0;
+	io_template_inline_includes(T);
 
 	return 0;
 }
 
+/* With a loader, filename is a template name given to the loader. */
 int io_template_set_template_file(io_template_t *T, const char *filename)
 {
+	sds key, source;
+
 	if (T == NULL) {
 		return -1;
 	}
@@ -92,22 +161,333 @@ int io_template_set_template_file(io_template_t *T, const char *filename)
 	sdsfree(T->name);
 	sdsfree(T->code);
 	T->name = sdsnew(filename);
-	T->code = io_parser_parse_file(filename, T->config);
+	T->code = NULL;
+	T->stream = 0;
+	if (T->config->loader) {
+		key = io_config_lookup(T->config, filename);
+		source = key ? io_config_load(T->config, key) : NULL;
+		if (source != NULL) {
+			T->code = io_parser_parse(source, T->config);
+		} else {
+			fprintf(stderr, "Template %s not found\n", filename);
+		}
+		sdsfree(source);
+		sdsfree(key);
+	} else {
+		T->version = io_config_version(T->config, filename);
+		T->stream = io_config_streamed(T->config, filename);
+		if (!T->stream) {
+			T->code = io_parser_parse_file(filename, T->config);
+		}
+	}
+	T->file = (T->config->loader == NULL);
+	if (T->stream) {
+		io_dependency_free(T->dependencies);
+		T->dependencies = NULL;
+	} else {
+		io_template_inline_includes(T);
+	}
+
+	return 0;
+}
+
+/* Takes the code from the include cache. Inlined templates are tracked by
+ * the cache entry, not by T. */
+static void io_template_set_template_key(io_template_t *T, const char *key)
+{
+	sdsfree(T->name);
+	sdsfree(T->code);
+	io_dependency_free(T->dependencies);
+	T->dependencies = NULL;
+	T->name = sdsnew(key);
+	T->stream = io_config_streamed(T->config, key);
+	T->code = T->stream ? NULL
+		: io_cache_get(T->config->cache, T->config, key);
+	T->file = 0;
+}
+
+/* When the config watches its directories, a template set from a file is
+ * recompiled if the file or one of the files inlined in it has changed.
+ * This only reads the versions kept by the watcher. */
+static void io_template_reload(io_template_t *T)
+{
+	sds filename;
+
+	if (T->config->watch == NULL || !T->file) {
+		return;
+	}
+
+	if (io_config_version(T->config, T->name) != T->version
+	|| io_template_is_stale(T))
+	{
+		filename = sdsnew(T->name);
+		io_template_set_template_file(T, filename);
+		sdsfree(filename);
+	}
+}
+
+const char * io_template_get_dependency(io_template_t *T, unsigned int i)
+{
+	io_dependency_t *dep;
+
+	if (T == NULL) {
+		return NULL;
+	}
+
+	for (dep = T->dependencies; dep && i > 0; dep = dep->next, i--);
+
+	return dep ? dep->key : NULL;
+}
+
+int io_template_is_stale(io_template_t *T)
+{
+	return T ? io_dependency_changed(T->dependencies, T->config) : 0;
+}
+
+static void * io_default_lua_alloc(void *ud, void *ptr, size_t osize,
+	size_t nsize);
+
+static void io_template_close_state(io_template_t *T)
+{
+	if (T->state != NULL) {
+		lua_close(T->state);
+		T->state = NULL;
+	}
+}
+
+int io_template_set_allocator(io_template_t *T, io_allocator_t allocator)
+{
+	if (T == NULL) {
+		return -1;
+	}
+
+	io_template_close_state(T);
+	T->allocator = allocator;
+	if (allocator != IO_ALLOCATOR_ARENA) {
+		io_arena_free(T->arena);
+		T->arena = NULL;
+	}
+
+	return 0;
+}
+
+int io_template_set_gc(io_template_t *T, int enabled, int pause, int stepmul)
+{
+	if (T == NULL) {
+		return -1;
+	}
+
+	T->gc_enabled = enabled;
+	T->gc_pause = pause;
+	T->gc_stepmul = stepmul;
+
+	return 0;
+}
+
+int io_template_set_isolated(io_template_t *T, int isolated)
+{
+	if (T == NULL) {
+		return -1;
+	}
+
+	io_template_close_state(T);
+	T->isolated = isolated;
+
+	return 0;
+}
+
+int io_template_set_memory_limit(io_template_t *T, size_t limit)
+{
+	if (T == NULL) {
+		return -1;
+	}
+
+	T->memory_limit = limit;
+
+	return 0;
+}
+
+int io_template_set_timeout(io_template_t *T, unsigned long msec)
+{
+	if (T == NULL) {
+		return -1;
+	}
+
+	T->timeout = msec;
+
+	return 0;
+}
+
+int io_template_set_instruction_limit(io_template_t *T, unsigned long count)
+{
+	if (T == NULL) {
+		return -1;
+	}
+
+	T->instruction_limit = count;
 
 	return 0;
 }
 
+void io_template_cancel(io_template_t *T)
+{
+	if (T != NULL) {
+		__sync_lock_test_and_set(&(T->cancelled), 1);
+	}
+}
+
+static void io_template_param_changed(io_template_t *T, const char *name)
+{
+	sds key;
+
+	if (T->changed == NULL) {
+		T->changed = gds_hash_map_new(128, gds_hash_djb2, strcmp, NULL,
+			sdsfree, NULL);
+		if (T->changed == NULL) {
+			fprintf(stderr, "Memory allocation error\n");
+			return;
+		}
+	}
+
+	if (gds_hash_map_get(T->changed, name) == NULL) {
+		key = sdsnew(name);
+		gds_hash_map_set(T->changed, key, key);
+	}
+}
+
+static void io_template_changed_free(io_template_t *T)
+{
+	if (T->changed) {
+		gds_hash_map_free(T->changed);
+		T->changed = NULL;
+	}
+}
+
 void io_template_param(io_template_t *T, const char *name, void *value)
 {
 	if (T != NULL) {
 		gds_hash_map_t *stash_p = *(T->stash);
 		gds_hash_map_set(stash_p, emb_new("sds", sdsnew(name)), value);
+		io_template_param_changed(T, name);
 	} else {
 		fprintf(stderr, "T is NULL in io_template_param\n");
 	}
 }
 
-void io_object_to_lua_stack(void **object, lua_State *L);
+static int io_template_check_json(const char *json, size_t len)
+{
+	if (io_json_skip(json, json + len) != json + len) {
+		fprintf(stderr, "Invalid JSON\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+int io_template_param_json(io_template_t *T, const char *name,
+	const char *json, size_t len)
+{
+	if (T == NULL) {
+		fprintf(stderr, "T is NULL in io_template_param_json\n");
+		return -1;
+	}
+
+	if (io_template_check_json(json, len)) {
+		return -1;
+	}
+
+	io_template_param(T, name, emb_new("io_json", sdsnewlen(json, len)));
+
+	return 0;
+}
+
+static void io_template_param_json_member(void *data, sds name,
+	const char *value, size_t len)
+{
+	io_template_param(data, name, emb_new("io_json",
+		sdsnewlen(value, len)));
+}
+
+int io_template_params_json(io_template_t *T, const char *json, size_t len)
+{
+	const char *p = json;
+
+	if (T == NULL) {
+		fprintf(stderr, "T is NULL in io_template_params_json\n");
+		return -1;
+	}
+
+	if (io_template_check_json(json, len)) {
+		return -1;
+	}
+	while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+		p++;
+	}
+	if (*p != '{') {
+		fprintf(stderr, "JSON params must be an object\n");
+		return -1;
+	}
+
+	io_json_each_member(json, len, io_template_param_json_member, T);
+
+	return 0;
+}
+
+void io_template_param_remove(io_template_t *T, const char *name)
+{
+	void **key;
+
+	if (T == NULL) {
+		fprintf(stderr, "T is NULL in io_template_param_remove\n");
+		return;
+	}
+
+	key = emb_new("sds", sdsnew(name));
+	gds_hash_map_unset(*(T->stash), key);
+	emb_free(key);
+	io_template_param_changed(T, name);
+}
+
+void io_template_param_update(io_template_t *T, const char *name)
+{
+	if (T == NULL) {
+		fprintf(stderr, "T is NULL in io_template_param_update\n");
+		return;
+	}
+
+	io_template_param_changed(T, name);
+}
+
+void io_template_param_lazy(io_template_t *T, const char *name,
+	io_template_lazy_t callback, void *data)
+{
+	io_lazy_param_t *lazy;
+
+	if (T == NULL) {
+		fprintf(stderr, "T is NULL in io_template_param_lazy\n");
+		return;
+	}
+
+	for (lazy = T->lazy; lazy; lazy = lazy->next) {
+		if (!strcmp(lazy->name, name)) {
+			break;
+		}
+	}
+
+	if (lazy == NULL) {
+		lazy = malloc(sizeof(io_lazy_param_t));
+		if (lazy == NULL) {
+			fprintf(stderr, "Memory allocation error\n");
+			return;
+		}
+		lazy->name = sdsnew(name);
+		lazy->next = T->lazy;
+		T->lazy = lazy;
+	}
+
+	lazy->callback = callback;
+	lazy->data = data;
+}
 
 static void io_list_to_lua_stack(void **list, lua_State *L)
 {
@@ -204,6 +584,15 @@ void io_object_to_lua_stack(void **object, lua_State *L)
 			case LUA_VALUE_TYPE_LIGHTUSERDATA:
 				lua_pushlightuserdata(L, lua_value.value.lightuserdata);
 				break;
+			case LUA_VALUE_TYPE_ARRAY:
+				io_array_to_lua_stack(lua_value.value.array, L);
+				break;
+			case LUA_VALUE_TYPE_STRUCT:
+				io_struct_to_lua_stack(lua_value.value.structure, L);
+				break;
+			case LUA_VALUE_TYPE_JSON:
+				io_json_to_lua_stack(lua_value.value.json, L);
+				break;
 			default:
 				lua_pushnil(L);
 		}
@@ -214,65 +603,1095 @@ void io_object_to_lua_stack(void **object, lua_State *L)
 	}
 }
 
-const char * io_template_render(io_template_t *T)
+static int io_template_panic(lua_State *L)
 {
-	lua_State *L;
-	size_t len;
-	char *lua_code, *lua_name;
+	fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n",
+		lua_tostring(L, -1));
 
-	L = luaL_newstate();
+	return 0;
+}
 
-	luaL_openlibs(L);
-	io_require_io(L);
+static void * io_default_lua_alloc(void *ud, void *ptr, size_t osize,
+	size_t nsize)
+{
+	(void) ud;
+	(void) osize;
 
-	lua_pushlightuserdata(L, T);
-	lua_setfield(L, LUA_REGISTRYINDEX, "io_template");
+	if (nsize == 0) {
+		free(ptr);
+		return NULL;
+	}
 
-	sds output = sdsempty();
-	lua_pushlightuserdata(L, &output);
-	lua_setfield(L, LUA_REGISTRYINDEX, "io_output");
+	return realloc(ptr, nsize);
+}
 
-	lua_code = T->code;
-	lua_name = T->name;
+/* Size of the output buffer once len more bytes are appended to it: sds
+ * preallocates up to twice the new length. */
+static size_t io_render_output_size(sds output, size_t len)
+{
+	size_t size = sdslen(output) + len;
 
-	if (luaL_loadbuffer(L, lua_code, strlen(lua_code), lua_name) == LUA_OK) {
-		// stash = ...
-		io_object_to_lua_stack(T->stash, L);
+	if (len <= sdsavail(output)) {
+		return sdslen(output) + sdsavail(output);
+	}
 
-		// stash_mt = { __index = _G }
-		lua_newtable(L);
-		lua_pushinteger(L, LUA_RIDX_GLOBALS);
-		lua_gettable(L, LUA_REGISTRYINDEX);
-		lua_setfield(L, -2, "__index");
+	return size < SDS_MAX_PREALLOC ? size * 2 : size + SDS_MAX_PREALLOC;
+}
 
-		// setmetatable(stash, stash_mt)
-		lua_setmetatable(L, -2);
+int io_render_output_exceeds(io_render_t *R, size_t len)
+{
+	if (R->memory_limit
+	&& R->heap + io_render_output_size(R->output, len) > R->memory_limit) {
+		R->status = IO_RENDER_ERRMEM;
+		return 1;
+	}
 
-		// Set environment and call function.
-		lua_setupvalue(L, -2, 1);
-		lua_pcall(L, 0, 0, 0);
-	} else {
-		fprintf(stderr, "Error: %s\n", lua_tostring(L, -1));
+	return 0;
+}
+
+/* Accounting allocator wrapped around the real one. Allocations that would
+ * make the Lua heap plus the output buffer exceed the render's memory limit
+ * fail, which makes Lua raise a memory error. With the arena allocator,
+ * freed blocks are not reused until the end of the render, so the heap is
+ * the size of all its chunks. */
+static void * io_render_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+	io_render_t *R = ud;
+	size_t old = ptr ? osize : 0;
+	void *newptr;
+
+	if (nsize > old && R->memory_limit
+	&& R->heap + (nsize - old) + io_render_output_size(R->output, 0)
+		> R->memory_limit) {
+		return NULL;
 	}
 
-	len = sdslen(output);
-	free(T->last_render);
-	T->last_render = malloc(sizeof(char) * (len+1));
-	strncpy(T->last_render, output, len+1);
-	sdsfree(output);
+	newptr = R->alloc(R->alloc_ud, ptr, osize, nsize);
+	if (newptr != NULL || nsize == 0) {
+		if (R->alloc == io_arena_lua_alloc) {
+			R->heap = ((io_arena_t *) R->alloc_ud)->allocated;
+		} else {
+			R->heap = R->heap - old + nsize;
+		}
+		if (R->heap > R->heap_peak) {
+			R->heap_peak = R->heap;
+		}
+	}
 
-	lua_close(L);
+	return newptr;
+}
 
-	return T->last_render;
+static unsigned long long io_render_clock(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+
+	return (unsigned long long) tp.tv_sec * 1000000000ULL + tp.tv_nsec;
 }
 
-void io_template_free(io_template_t *T)
+/* Count hook, installed on the main thread before anything runs so that
+ * every coroutine inherits it. Once a limit is hit, the hook fires on every
+ * instruction so that templates cannot recover by catching the error. */
+static void io_render_hook(lua_State *L, lua_Debug *ar)
 {
-	if (T != NULL) {
+	io_render_t *R;
+	void *ud;
+
+	(void) ar;
+
+	/* The accounting allocator's userdata is the render itself. */
+	lua_getallocf(L, &ud);
+	R = ud;
+
+	if (R->status == IO_RENDER_OK) {
+		R->instructions += IO_RENDER_HOOK_COUNT;
+		if (*R->cancelled) {
+			R->status = IO_RENDER_CANCELLED;
+		} else if (R->instruction_limit
+		&& R->instructions >= R->instruction_limit) {
+			R->status = IO_RENDER_ERRINSTR;
+		} else if (R->deadline && io_render_clock() >= R->deadline) {
+			R->status = IO_RENDER_ERRTIME;
+		}
+		if (R->status == IO_RENDER_OK) {
+			return;
+		}
+		lua_sethook(L, io_render_hook, LUA_MASKCOUNT, 1);
+	}
+
+	switch (R->status) {
+		case IO_RENDER_CANCELLED:
+			luaL_error(L, "render cancelled");
+			break;
+		case IO_RENDER_ERRINSTR:
+			luaL_error(L, "instruction limit exceeded");
+			break;
+		case IO_RENDER_ERRTIME:
+			luaL_error(L, "timeout exceeded");
+			break;
+		default:
+			luaL_error(L, "render aborted");
+	}
+}
+
+static void io_render_init(io_render_t *R, io_template_t *T)
+{
+	io_template_reload(T);
+
+	R->T = T;
+	R->L = NULL;
+	R->co = NULL;
+	R->output = sdsempty();
+	R->filter[0] = NULL;
+	R->filter[1] = NULL;
+	R->number_precision = T->config->number_precision;
+	R->threshold = 0;
+	R->flushed = 0;
+	R->finished = 0;
+	R->status = IO_RENDER_OK;
+	R->fetch = NULL;
+	R->fetch_value = NULL;
+	R->fetch_ready = 0;
+	R->params = NULL;
+	R->items = NULL;
+	R->item_count = 0;
+	R->item_base = 0;
+	R->spawns = NULL;
+	R->spawns_tail = NULL;
+	R->threads = 0;
+	R->memory_limit = T->memory_limit;
+	R->heap = 0;
+	R->heap_peak = 0;
+	R->instruction_limit = T->instruction_limit;
+	R->instructions = 0;
+	R->cancelled = &(T->cancelled);
+	R->deadline = 0;
+	R->suspended = 0;
+	if (T->timeout) {
+		R->deadline = io_render_clock()
+			+ (unsigned long long) T->timeout * 1000000ULL;
+	}
+	if (T->allocator == IO_ALLOCATOR_ARENA) {
+		R->alloc = io_arena_lua_alloc;
+		R->alloc_ud = T->arena;
+	} else {
+		R->alloc = io_default_lua_alloc;
+		R->alloc_ud = NULL;
+	}
+}
+
+static lua_State * io_render_new_state(io_render_t *R)
+{
+	io_template_t *T = R->T;
+	lua_State *L;
+
+	if (T->allocator == IO_ALLOCATOR_ARENA && T->arena == NULL) {
+		T->arena = io_arena_new(IO_ARENA_CHUNK_SIZE);
+		if (T->arena == NULL) {
+			return NULL;
+		}
+		R->alloc_ud = T->arena;
+	}
+
+	if (T->state != NULL) {
+		L = T->state;
+		T->state = NULL;
+		lua_setallocf(L, io_render_alloc, R);
+		R->heap = (size_t) lua_gc(L, LUA_GCCOUNT, 0) * 1024
+			+ lua_gc(L, LUA_GCCOUNTB, 0);
+		R->heap_peak = R->heap;
+	} else {
+		L = lua_newstate(io_render_alloc, R);
+		if (L == NULL) {
+			return NULL;
+		}
+		lua_atpanic(L, io_template_panic);
+	}
+	lua_sethook(L, io_render_hook, LUA_MASKCOUNT, IO_RENDER_HOOK_COUNT);
+
+	if (!T->gc_enabled) {
+		lua_gc(L, LUA_GCSTOP, 0);
+	} else {
+		if (T->gc_pause) {
+			lua_gc(L, LUA_GCSETPAUSE, T->gc_pause);
+		}
+		if (T->gc_stepmul) {
+			lua_gc(L, LUA_GCSETSTEPMUL, T->gc_stepmul);
+		}
+	}
+
+	R->L = L;
+
+	return L;
+}
+
+/* __index of the environment when the template has lazy parameters.
+ * Upvalue 1 maps names of lazy parameters not evaluated yet to their
+ * definition, upvalue 2 is the stash. Evaluated values are stored in the
+ * environment, so they do not outlive the render. */
+static int io_render_index(lua_State *L)
+{
+	io_lazy_param_t *lazy;
+	io_render_t *R;
+	void **value;
+
+	lua_pushvalue(L, 2);
+	lua_rawget(L, lua_upvalueindex(2));
+	if (!lua_isnil(L, -1)) {
+		return 1;
+	}
+	lua_pop(L, 1);
+
+	lua_pushvalue(L, 2);
+	lua_rawget(L, lua_upvalueindex(1));
+	lazy = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+
+	if (lazy == NULL) {
+		lua_pushvalue(L, 2);
+		lua_gettable(L, lua_upvalueindex(2));
+		return 1;
+	}
+
+	lua_pushvalue(L, 2);
+	lua_pushnil(L);
+	lua_rawset(L, lua_upvalueindex(1));
+
+	lua_getfield(L, LUA_REGISTRYINDEX, "io_render");
+	R = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+
+	value = lazy->callback(R->T, lazy->name, lazy->data);
+	io_object_to_lua_stack(value, L);
+	if (value) {
+		emb_free(value);
+	}
+
+	lua_pushvalue(L, 2);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, 1);
+
+	return 1;
+}
+
+/* Pushes the table holding the config's global params, whose __index is
+ * _G, or _G itself if there is none. It is converted only when the state
+ * is new or the params have changed, so the tables in it are sealed: the
+ * template cannot change what the following renders see. */
+static void io_render_push_globals(lua_State *L, io_template_t *T)
+{
+	io_config_t *config = T->config;
+
+	if (config->params == NULL) {
+		lua_pushglobaltable(L);
+		return;
+	}
+
+	lua_getfield(L, LUA_REGISTRYINDEX, "io_globals");
+	if (lua_istable(L, -1) && T->params_version == config->params_version) {
+		return;
+	}
+	lua_pop(L, 1);
+
+	io_trace_begin("io_render_push_globals");
+	io_object_to_lua_stack(config->params, L);
+	io_readonly_seal(L, -1);
+	lua_newtable(L);
+	lua_pushglobaltable(L);
+	lua_setfield(L, -2, "__index");
+	lua_setmetatable(L, -2);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, LUA_REGISTRYINDEX, "io_globals");
+	T->params_version = config->params_version;
+	io_trace_end("io_render_push_globals");
+}
+
+/* Pushes the __index of the environment, for the stash at index idx. */
+static void io_render_push_index(lua_State *L, io_template_t *T, int idx)
+{
+	io_lazy_param_t *lazy;
+
+	idx = lua_absindex(L, idx);
+	if (T->lazy) {
+		lua_newtable(L);
+		for (lazy = T->lazy; lazy; lazy = lazy->next) {
+			lua_pushlightuserdata(L, lazy);
+			lua_setfield(L, -2, lazy->name);
+		}
+		lua_pushvalue(L, idx);
+		lua_pushcclosure(L, io_render_index, 2);
+	} else {
+		lua_pushvalue(L, idx);
+	}
+}
+
+static void ** io_template_stash_get(io_template_t *T, const char *name)
+{
+	void **key, **value;
+
+	key = emb_new("sds", sdsnew(name));
+	value = gds_hash_map_get(*(T->stash), key);
+	emb_free(key);
+
+	return value;
+}
+
+/* Pushes the stash converted to Lua. It is kept in the registry, and only
+ * the params changed since the previous render are converted. */
+static void io_render_push_stash(lua_State *L, io_render_t *R)
+{
+	io_template_t *T = R->T;
+	gds_iterator_t *it;
+	const char *name;
+	void **value;
+
+	if (R->params) {
+		const char *end = R->params + sdslen(R->params);
+		if (io_value_load(L, R->params, end) == NULL || !lua_istable(L, -1)) {
+			lua_pop(L, 1);
+			lua_newtable(L);
+		}
+		return;
+	}
+
+	lua_getfield(L, LUA_REGISTRYINDEX, "io_stash");
+	if (lua_istable(L, -1)) {
+		it = T->changed ? gds_hash_map_iterator_new(T->changed) : NULL;
+		while (it && !gds_iterator_step(it)) {
+			name = gds_iterator_getkey(it);
+			value = io_template_stash_get(T, name);
+			lua_pushstring(L, name);
+			if (value) {
+				io_object_to_lua_stack(value, L);
+			} else {
+				lua_pushnil(L);
+			}
+			lua_rawset(L, -3);
+		}
+		if (it) {
+			gds_iterator_free(it);
+		}
+	} else {
+		lua_pop(L, 1);
+		io_object_to_lua_stack(T->stash, L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, "io_stash");
+	}
+	io_template_changed_free(T);
+}
+
+static const char * io_render_read_parser(lua_State *L, void *data,
+	size_t *size)
+{
+	(void) L;
+
+	return io_parser_next(data, size);
+}
+
+int io_render_load_file(lua_State *L, io_config_t *config, const char *key,
+	const char *chunkname)
+{
+	io_parser_t *parser;
+	FILE *fp;
+	int status;
+
+	fp = fopen(key, "r");
+	if (fp == NULL) {
+		lua_pushfstring(L, "cannot open %s", key);
+		return LUA_ERRFILE;
+	}
+
+	parser = io_parser_new_filep(fp, config);
+	if (parser == NULL) {
+		fclose(fp);
+		lua_pushliteral(L, "not enough memory");
+		return LUA_ERRMEM;
+	}
+
+	io_trace_begin("lua_load");
+	status = lua_load(L, io_render_read_parser, parser, chunkname, NULL);
+	io_trace_end("lua_load");
+
+	io_parser_free(parser);
+	fclose(fp);
+
+	return status;
+}
+
+/* Runs in protected mode so that memory errors while opening libraries,
+ * loading the chunk or converting the stash do not panic. Leaves the main
+ * function of the template on the stack, with the stash as environment.
+ * For pull-based renders, the function is moved into a new coroutine and
+ * the coroutine is left on the stack instead. */
+static int io_render_prepare(lua_State *L)
+{
+	io_render_t *R = lua_touserdata(L, 1);
+	io_template_t *T = R->T;
+	int status;
+
+	/* io_render is only missing from the registry of new states. */
+	lua_getfield(L, LUA_REGISTRYINDEX, "io_render");
+	if (lua_isnil(L, -1)) {
+		luaL_openlibs(L);
+		io_require_io(L);
+	}
+	lua_pop(L, 1);
+
+	lua_pushvalue(L, 1);
+	lua_setfield(L, LUA_REGISTRYINDEX, "io_render");
+
+	/* The hook only checks every IO_RENDER_HOOK_COUNT instructions. */
+	if (*R->cancelled) {
+		R->status = IO_RENDER_CANCELLED;
+		return luaL_error(L, "render cancelled");
+	}
+
+	if (T->stream) {
+		status = io_render_load_file(L, T->config, T->name, T->name);
+	} else if (T->code == NULL) {
+		return luaL_error(L, "no template code");
+	} else {
+		io_trace_begin("lua_load");
+		status = luaL_loadbuffer(L, T->code, strlen(T->code), T->name);
+		io_trace_end("lua_load");
+	}
+	if (status != LUA_OK) {
+		return lua_error(L);
+	}
+
+	// stash = ...
+	io_trace_begin("io_object_to_lua_stack");
+	io_render_push_stash(L, R);
+	io_trace_end("io_object_to_lua_stack");
+
+	// setmetatable(stash, { __index = globals or _G })
+	lua_newtable(L);
+	io_render_push_globals(L, T);
+	lua_setfield(L, -2, "__index");
+	lua_setmetatable(L, -2);
+
+	// env = setmetatable({}, { __index = stash })
+	// Variables set by the template go to env, which is not kept.
+	lua_newtable(L);
+	lua_newtable(L);
+	io_render_push_index(L, T, -3);
+	lua_setfield(L, -2, "__index");
+	lua_setmetatable(L, -2);
+	lua_remove(L, -2);
+
+	// Set environment
+	lua_setupvalue(L, -2, 1);
+
+	if (R->threshold) {
+		R->co = lua_newthread(L);
+		lua_insert(L, -2);
+		lua_xmove(L, R->co, 1);
+	}
+
+	return 1;
+}
+
+static void io_render_set_error(io_render_t *R, lua_State *L, int status)
+{
+	if (R->status != IO_RENDER_OK) {
+		return;
+	}
+
+	if (status == LUA_ERRMEM) {
+		R->status = IO_RENDER_ERRMEM;
+	} else {
+		const char *msg = lua_tostring(L, -1);
+		R->status = IO_RENDER_ERROR;
+		fprintf(stderr, "Error: %s\n", msg ? msg : "(error object is not a string)");
+	}
+}
+
+static void io_render_join(io_render_t *R);
+
+static void io_render_finish(io_render_t *R)
+{
+	io_template_t *T = R->T;
+
+	io_render_join(R);
+
+	T->status = R->status;
+	T->stats.heap_peak = R->heap_peak;
+	T->stats.output_size = R->flushed + sdslen(R->output);
+	T->stats.instructions = R->instructions;
+
+	/* The state is kept for the next render unless it lives in the arena
+	 * or holds all the garbage of the render, or the template is isolated.
+	 * A render that was aborted may have left it anywhere, so it is not
+	 * reused. */
+	if (R->L != NULL) {
+		if (T->allocator != IO_ALLOCATOR_ARENA && T->gc_enabled
+		&& !T->isolated
+		&& T->state == NULL
+		&& (R->status == IO_RENDER_OK || R->status == IO_RENDER_ERROR))
+		{
+			lua_settop(R->L, 0);
+			lua_sethook(R->L, NULL, 0, 0);
+			lua_setallocf(R->L, io_default_lua_alloc, NULL);
+			T->state = R->L;
+		} else {
+			lua_close(R->L);
+		}
+		R->L = NULL;
+		R->co = NULL;
+	}
+	if (T->arena) {
+		io_arena_reset(T->arena);
+	}
+	sdsfree(R->filter[0]);
+	sdsfree(R->filter[1]);
+	R->filter[0] = R->filter[1] = NULL;
+
+	/* A cancel received while no render was in progress applies to the
+	 * next one, so the flag is only cleared once a render has ended. */
+	__sync_lock_test_and_set(&(T->cancelled), 0);
+
+	R->finished = 1;
+}
+
+/* Calls the template function (argument 2) once per item of the render's
+ * partition. Each row gets a fresh environment holding item and index,
+ * whose __index is the shared one, so variables set by a row do not leak
+ * into the next. */
+static int io_render_each(lua_State *L)
+{
+	io_render_t *R = lua_touserdata(L, 1);
+	size_t i;
+
+	// row_mt = { __index = env }
+	lua_newtable(L);
+	lua_getupvalue(L, 2, 1);
+	lua_setfield(L, 3, "__index");
+	for (i = 0; i < R->item_count; i++) {
+		lua_pushvalue(L, 2);
+		lua_newtable(L);
+		lua_pushvalue(L, 3);
+		lua_setmetatable(L, -2);
+		io_object_to_lua_stack(R->items[i], L);
+		lua_setfield(L, -2, "item");
+		lua_pushunsigned(L, R->item_base + i + 1);
+		lua_setfield(L, -2, "index");
+		lua_setupvalue(L, -2, 1);
+		lua_call(L, 0, 0);
+	}
+
+	return 0;
+}
+
+static void io_render_run(io_render_t *R)
+{
+	lua_State *L;
+	int status;
+
+	L = io_render_new_state(R);
+	if (L == NULL) {
+		R->status = IO_RENDER_ERRMEM;
+		return;
+	}
+
+	lua_pushcfunction(L, io_render_prepare);
+	lua_pushlightuserdata(L, R);
+	status = lua_pcall(L, 1, 1, 0);
+	if (status == LUA_OK) {
+		io_trace_begin("lua_pcall");
+		if (R->items) {
+			lua_pushcfunction(L, io_render_each);
+			lua_insert(L, -2);
+			lua_pushlightuserdata(L, R);
+			lua_insert(L, -2);
+			status = lua_pcall(L, 2, 0, 0);
+		} else {
+			status = lua_pcall(L, 0, 0, 0);
+		}
+		io_trace_end("lua_pcall");
+	}
+	if (status != LUA_OK) {
+		io_render_set_error(R, L, status);
+	}
+}
+
+/* Spawned blocks share the deadline and cancel flag of the top render, and
+ * get the instructions it had left when they were spawned. */
+static void io_spawn_run(void *data)
+{
+	io_spawn_t *job = data;
+	io_template_t *T;
+	io_render_t R;
+
+	io_trace_begin("io_spawn_run");
+
+	T = io_template_new(job->T->config);
+	if (T != NULL) {
+		T->memory_limit = job->T->memory_limit;
+		io_template_set_template_key(T, job->path);
+
+		io_render_init(&R, T);
+		R.cancelled = job->cancelled;
+		R.deadline = job->deadline;
+		R.instruction_limit = job->instruction_limit;
+		R.params = job->params;
+		R.items = job->items;
+		R.item_count = job->item_count;
+		R.item_base = job->item_base;
+		io_render_run(&R);
+		io_render_finish(&R);
+
+		job->status = R.status;
+		if (R.status == IO_RENDER_OK || R.status == IO_RENDER_ERROR) {
+			job->output = R.output;
+		} else {
+			fprintf(stderr, "Spawned block %s aborted\n", job->path);
+			sdsfree(R.output);
+		}
+		io_template_free(T);
+	}
+
+	io_trace_end("io_spawn_run");
+}
+
+static void io_render_add_spawn(io_render_t *R, sds path, sds params,
+	void ***items, size_t item_count, size_t item_base)
+{
+	io_spawn_t *job;
+
+	job = malloc(sizeof(io_spawn_t));
+	if (job == NULL) {
+		fprintf(stderr, "Memory allocation error\n");
+		sdsfree(path);
+		sdsfree(params);
+		return;
+	}
+
+	job->T = R->T;
+	job->path = path;
+	job->params = params;
+	job->items = items;
+	job->item_count = item_count;
+	job->item_base = item_base;
+	job->offset = sdslen(R->output);
+	job->cancelled = R->cancelled;
+	job->deadline = R->deadline;
+	job->instruction_limit = 0;
+	if (R->instruction_limit) {
+		job->instruction_limit = R->instructions < R->instruction_limit
+			? R->instruction_limit - R->instructions : 1;
+	}
+	job->task.run = io_spawn_run;
+	job->task.data = job;
+	job->started = 0;
+	job->status = IO_RENDER_OK;
+	job->output = NULL;
+	job->next = NULL;
+
+	if (R->threads < IO_SPAWN_MAX_THREADS
+	&& io_pool_submit(&(job->task)) == 0) {
+		job->started = 1;
+		R->threads++;
+	} else {
+		io_spawn_run(job);
+	}
+
+	if (R->spawns_tail) {
+		R->spawns_tail->next = job;
+	} else {
+		R->spawns = job;
+	}
+	R->spawns_tail = job;
+}
+
+/* Blocks are rendered in their own Lua state, with the copied params as
+ * environment, on a worker thread or, past IO_SPAWN_MAX_THREADS for the
+ * render or when every worker of the pool is busy, right away.
+ * Their output is spliced at the position the block was spawned from by
+ * io_render_join(). */
+void io_render_spawn(io_render_t *R, sds path, sds params)
+{
+	io_render_add_spawn(R, path, params, NULL, 0, 0);
+}
+
+/* Renders path once for each element of the stash list name, with the list
+ * split in contiguous partitions rendered like spawned blocks. Workers read
+ * their partition directly from the stash and convert one element at a
+ * time. Returns -1 if name is not a list. */
+int io_render_spawn_each(io_render_t *R, const char *name, sds path,
+	sds params, unsigned int partitions)
+{
+	gds_iterator_t *(*iterator_callback)(void *);
+	gds_iterator_t *it;
+	io_lua_value_t lua_value;
+	void **list, ***items = NULL, ***tmp;
+	size_t count = 0, size = 0, start, n, i;
+
+	list = io_template_stash_get(R->T, name);
+	lua_value.type = LUA_VALUE_TYPE_NONE;
+	io_emb_data_to_lua_value(list, &lua_value);
+	iterator_callback = list ? emb_type_get_callback(emb_type(list),
+		"gds_iterator") : NULL;
+	if (lua_value.type != LUA_VALUE_TYPE_LIST || iterator_callback == NULL) {
+		sdsfree(path);
+		sdsfree(params);
+		return -1;
+	}
+
+	it = iterator_callback(*list);
+	while (!gds_iterator_step(it)) {
+		if (count == size) {
+			size = size ? size * 2 : 256;
+			tmp = realloc(items, size * sizeof(void **));
+			if (tmp == NULL) {
+				break;
+			}
+			items = tmp;
+		}
+		items[count++] = gds_iterator_get(it);
+	}
+	gds_iterator_free(it);
+
+	if (partitions == 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		partitions = ncpu > 0 ? ncpu : 1;
+#else
+		partitions = 1;
+#endif
+	}
+	if (partitions > IO_SPAWN_MAX_THREADS) {
+		partitions = IO_SPAWN_MAX_THREADS;
+	}
+	if (partitions > count) {
+		partitions = count;
+	}
+
+	for (i = 0, start = 0; i < partitions; i++, start += n) {
+		void ***slice;
+
+		n = count / partitions + (i < count % partitions ? 1 : 0);
+		slice = malloc(n * sizeof(void **));
+		if (slice == NULL) {
+			fprintf(stderr, "Memory allocation error\n");
+			break;
+		}
+		memcpy(slice, items + start, n * sizeof(void **));
+		io_render_add_spawn(R, sdsdup(path),
+			params ? sdsdup(params) : NULL, slice, n, start);
+	}
+
+	free(items);
+	sdsfree(path);
+	sdsfree(params);
+
+	return 0;
+}
+
+/* Waits for spawned blocks and splices their output, unless the render
+ * has been aborted. A block stopped by the deadline, the instruction limit
+ * or a cancel aborts the whole render, as these limits are shared. */
+static void io_render_join(io_render_t *R)
+{
+	io_spawn_t *job, *next;
+	size_t offset, last = 0, len;
+	sds out;
+	int splice;
+
+	if (R->spawns == NULL) {
+		return;
+	}
+
+	splice = (R->status == IO_RENDER_OK || R->status == IO_RENDER_ERROR);
+
+	len = sdslen(R->output);
+	out = sdsempty();
+	for (job = R->spawns; job; job = next) {
+		next = job->next;
+		if (job->started) {
+			io_pool_wait(&(job->task));
+		}
+		if (splice && (job->status == IO_RENDER_CANCELLED
+		|| job->status == IO_RENDER_ERRTIME
+		|| job->status == IO_RENDER_ERRINSTR)) {
+			R->status = job->status;
+			splice = 0;
+		}
+
+		offset = job->offset < len ? job->offset : len;
+		out = sdscatlen(out, R->output + last, offset - last);
+		if (job->output && splice) {
+			out = sdscatsds(out, job->output);
+		}
+		last = offset;
+
+		sdsfree(job->path);
+		sdsfree(job->params);
+		sdsfree(job->output);
+		free(job->items);
+		free(job);
+	}
+	out = sdscatlen(out, R->output + last, len - last);
+
+	sdsfree(R->output);
+	R->output = out;
+	R->spawns = R->spawns_tail = NULL;
+	R->threads = 0;
+}
+
+const char * io_template_render(io_template_t *T)
+{
+	io_render_t R;
+	size_t len;
+
+	if (T == NULL) {
+		return NULL;
+	}
+
+	io_trace_begin("io_template_render");
+
+	io_render_init(&R, T);
+	io_render_run(&R);
+	io_render_join(&R);
+
+	/* Output of a render that hit a limit is not returned. */
+	io_trace_begin("output flush");
+	free(T->last_render);
+	T->last_render = NULL;
+	if (R.status == IO_RENDER_OK || R.status == IO_RENDER_ERROR) {
+		len = sdslen(R.output);
+		T->last_render = malloc(sizeof(char) * (len+1));
+		if (T->last_render) {
+			memcpy(T->last_render, R.output, len+1);
+		}
+	}
+	io_trace_end("output flush");
+
+	io_render_finish(&R);
+	sdsfree(R.output);
+
+	io_trace_end("io_template_render");
+
+	return T->last_render;
+}
+
+io_render_t * io_template_render_start(io_template_t *T, size_t threshold)
+{
+	io_render_t *R;
+	lua_State *L;
+	int status;
+
+	if (T == NULL) {
+		return NULL;
+	}
+
+	R = malloc(sizeof(io_render_t));
+	if (R == NULL) {
+		fprintf(stderr, "Memory allocation error\n");
+		return NULL;
+	}
+
+	io_render_init(R, T);
+	R->threshold = threshold ? threshold : 1;
+
+	L = io_render_new_state(R);
+	if (L == NULL) {
+		R->status = IO_RENDER_ERRMEM;
+		io_render_finish(R);
+		return R;
+	}
+
+	lua_pushcfunction(L, io_render_prepare);
+	lua_pushlightuserdata(L, R);
+	status = lua_pcall(L, 1, 1, 0);
+	if (status != LUA_OK) {
+		io_render_set_error(R, L, status);
+		io_render_finish(R);
+	} else if (R->deadline) {
+		R->suspended = io_render_clock();
+	}
+
+	return R;
+}
+
+static int io_render_push_value(lua_State *L)
+{
+	io_object_to_lua_stack(lua_touserdata(L, 1), L);
+
+	return 1;
+}
+
+/* Push the value fetched by the host on the coroutine's stack, so that it
+ * is returned by Io.fetch. */
+static int io_render_resume_fetch(io_render_t *R)
+{
+	int status;
+
+	lua_pushcfunction(R->L, io_render_push_value);
+	lua_pushlightuserdata(R->L, R->fetch_value);
+	status = lua_pcall(R->L, 1, 1, 0);
+	if (status == LUA_OK && !lua_checkstack(R->co, 1)) {
+		status = LUA_ERRMEM;
+	}
+
+	if (status == LUA_OK) {
+		lua_xmove(R->L, R->co, 1);
+	} else {
+		io_render_set_error(R, R->L, status);
+	}
+
+	if (R->fetch_value) {
+		emb_free(R->fetch_value);
+		R->fetch_value = NULL;
+	}
+	sdsfree(R->fetch);
+	R->fetch = NULL;
+	R->fetch_ready = 0;
+
+	return status;
+}
+
+io_render_step_t io_template_render_next(io_render_t *R, const char **chunk,
+	size_t *len)
+{
+	int status, nargs = 0;
+
+	if (R == NULL) {
+		return IO_RENDER_DONE;
+	}
+
+	R->flushed += sdslen(R->output);
+	sdsclear(R->output);
+
+	if (R->fetch && !R->fetch_ready && !R->finished) {
+		return IO_RENDER_FETCH;
+	}
+
+	if (!R->finished) {
+		status = LUA_OK;
+		if (R->fetch) {
+			status = io_render_resume_fetch(R);
+			nargs = 1;
+		}
+
+		if (status == LUA_OK) {
+			if (R->deadline) {
+				R->deadline += io_render_clock() - R->suspended;
+			}
+
+			io_trace_begin("lua_resume");
+			status = lua_resume(R->co, R->L, nargs);
+			io_trace_end("lua_resume");
+		}
+
+		if (status == LUA_YIELD) {
+			if (R->deadline) {
+				R->suspended = io_render_clock();
+			}
+			if (R->fetch) {
+				io_render_join(R);
+				if (sdslen(R->output) == 0) {
+					return IO_RENDER_FETCH;
+				}
+			}
+		} else {
+			if (status != LUA_OK) {
+				io_render_set_error(R, R->co, status);
+			}
+			/* Output of a render that hit a limit is not returned. */
+			if (R->status != IO_RENDER_OK
+			&& R->status != IO_RENDER_ERROR) {
+				sdsclear(R->output);
+			}
+			io_render_finish(R);
+		}
+	}
+
+	io_render_join(R);
+
+	if (sdslen(R->output) == 0) {
+		return IO_RENDER_DONE;
+	}
+
+	if (chunk) {
+		*chunk = R->output;
+	}
+	if (len) {
+		*len = sdslen(R->output);
+	}
+
+	return IO_RENDER_CHUNK;
+}
+
+const char * io_template_render_get_fetch(io_render_t *R)
+{
+	return (R && !R->finished) ? R->fetch : NULL;
+}
+
+int io_template_render_fulfil(io_render_t *R, void *value)
+{
+	if (R == NULL || R->fetch == NULL || R->fetch_ready) {
+		fprintf(stderr, "No pending fetch in io_template_render_fulfil\n");
+		if (value) {
+			emb_free(value);
+		}
+		return -1;
+	}
+
+	R->fetch_value = value;
+	R->fetch_ready = 1;
+
+	return 0;
+}
+
+void io_template_render_free(io_render_t *R)
+{
+	if (R != NULL) {
+		if (!R->finished) {
+			if (R->status == IO_RENDER_OK) {
+				R->status = IO_RENDER_CANCELLED;
+			}
+			io_render_finish(R);
+		}
+		sdsfree(R->fetch);
+		if (R->fetch_value) {
+			emb_free(R->fetch_value);
+		}
+		sdsfree(R->output);
+		free(R);
+	}
+}
+
+io_render_status_t io_template_get_status(io_template_t *T)
+{
+	return T ? T->status : IO_RENDER_ERROR;
+}
+
+void io_template_get_stats(io_template_t *T, io_render_stats_t *stats)
+{
+	if (T && stats) {
+		*stats = T->stats;
+	}
+}
+
+void io_template_free(io_template_t *T)
+{
+	io_lazy_param_t *lazy, *next;
+
+	if (T != NULL) {
+		for (lazy = T->lazy; lazy; lazy = next) {
+			next = lazy->next;
+			sdsfree(lazy->name);
+			free(lazy);
+		}
 		sdsfree(T->name);
 		sdsfree(T->code);
+		io_dependency_free(T->dependencies);
 		emb_free(T->stash);
+		io_template_changed_free(T);
+		io_template_close_state(T);
 		free(T->last_render);
+		io_arena_free(T->arena);
 		free(T);
 	}
 }
@@ -20,12 +20,152 @@
 #ifndef io_template_private_h_included
 #define io_template_private_h_included
 
+#include <sds.h>
+#include <lua.h>
+#include <libgends/hash_map.h>
+#include "io_template.h"
+#include "io_array.h"
+#include "io_struct.h"
+#include "io_arena.h"
+#include "io_inline.h"
+
+#define IO_ARENA_CHUNK_SIZE (256 * 1024)
+#define IO_RENDER_HOOK_COUNT 1000
+#define IO_SPAWN_MAX_THREADS 16
+
+typedef struct io_spawn_s io_spawn_t;
+
+typedef struct io_lazy_param_s {
+	sds name;
+	io_template_lazy_t callback;
+	void *data;
+	struct io_lazy_param_s *next;
+} io_lazy_param_t;
+
 struct io_template_s {
 	io_config_t *config;
 	char *name;
 	sds code;
+	int file;
+	/* Set instead of code when the file name is streamed on each render,
+	 * see io_config_t.stream_size. */
+	int stream;
+	unsigned long version;
+	io_dependency_t *dependencies;
 	void **stash;
+	/* Names of the params set since the previous render, as keys. */
+	gds_hash_map_t *changed;
+	io_lazy_param_t *lazy;
 	char *last_render;
+
+	/* Lua state kept between renders, see io_render_finish(). */
+	lua_State *state;
+	unsigned long params_version;
+
+	io_allocator_t allocator;
+	io_arena_t *arena;
+	int gc_enabled;
+	int gc_pause;
+	int gc_stepmul;
+	int isolated;
+
+	size_t memory_limit;
+	unsigned long timeout;
+	unsigned long instruction_limit;
+	volatile int cancelled;
+	io_render_status_t status;
+	io_render_stats_t stats;
+};
+
+struct io_render_s {
+	io_template_t *T;
+	lua_State *L;
+	lua_State *co;
+	sds output;
+	sds filter[2];
+	int number_precision;
+	size_t threshold;
+	size_t flushed;
+	int finished;
+	io_render_status_t status;
+
+	sds fetch;
+	void **fetch_value;
+	int fetch_ready;
+
+	sds params;
+	void ***items;
+	size_t item_count;
+	size_t item_base;
+	io_spawn_t *spawns;
+	io_spawn_t *spawns_tail;
+	unsigned int threads;
+
+	lua_Alloc alloc;
+	void *alloc_ud;
+	size_t memory_limit;
+	size_t heap;
+	size_t heap_peak;
+
+	/* The cancel flag of the template, or of the top render for
+	 * spawned blocks. */
+	volatile int *cancelled;
+	unsigned long long deadline;
+	unsigned long long suspended;
+	unsigned long instruction_limit;
+	unsigned long instructions;
 };
 
+void
+io_render_spawn(
+	io_render_t *R,
+	sds path,
+	sds params
+);
+
+int
+io_render_spawn_each(
+	io_render_t *R,
+	const char *name,
+	sds path,
+	sds params,
+	unsigned int partitions
+);
+
+/* Parses the template file key straight into the Lua compiler and pushes
+ * the compiled chunk, or an error message, as lua_load() does. */
+int
+io_render_load_file(
+	lua_State *L,
+	io_config_t *config,
+	const char *key,
+	const char *chunkname
+);
+
+/* Returns 1, and sets the status of R to IO_RENDER_ERRMEM, if appending
+ * len bytes to the output would exceed the memory limit. */
+int
+io_render_output_exceeds(
+	io_render_t *R,
+	size_t len
+);
+
+void
+io_object_to_lua_stack(
+	void **object,
+	lua_State *L
+);
+
+void
+io_array_to_lua_stack(
+	io_array_t *array,
+	lua_State *L
+);
+
+void
+io_struct_to_lua_stack(
+	io_struct_t *s,
+	lua_State *L
+);
+
 #endif /* ! io_template_private_h_included */
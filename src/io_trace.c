@@ -0,0 +1,271 @@
+/*
+ * Copyright 2014 Julian Maurice
+ *
+ * This file is part of libio
+ *
+ * libio is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "io_trace.h"
+
+typedef struct {
+	const char *name;
+	char phase;
+	unsigned int tid;
+	unsigned long long ts;
+} io_trace_event_t;
+
+/* Each buffer is written by its owner thread only. Registering a buffer,
+ * releasing it when its thread exits and dumping take a lock; recording an
+ * event does not. Buffers of exited threads are kept with their events,
+ * and reused by the next thread that needs one, so there are never more
+ * buffers than threads that were tracing at the same time. */
+typedef struct io_trace_buffer_s {
+	io_trace_event_t events[IO_TRACE_BUFFER_SIZE];
+	volatile unsigned long head;
+	unsigned int tid;
+	int owned;
+	volatile int orphan;
+	struct io_trace_buffer_s *next;
+} io_trace_buffer_t;
+
+static volatile int io_trace_on = 0;
+static io_trace_buffer_t *io_trace_buffers = NULL;
+static pthread_mutex_t io_trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int io_trace_tid = 0;
+static volatile unsigned long long io_trace_cleared = 0;
+
+static pthread_once_t io_trace_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t io_trace_key;
+static __thread io_trace_buffer_t *io_trace_thread_buffer = NULL;
+
+static unsigned long long io_trace_now(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+
+	return (unsigned long long) tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+}
+
+/* Called when a thread that recorded events exits. */
+static void io_trace_release(void *data)
+{
+	io_trace_buffer_t *buffer = data;
+
+	pthread_mutex_lock(&io_trace_mutex);
+	if (buffer->orphan) {
+		free(buffer);
+	} else {
+		buffer->owned = 0;
+	}
+	pthread_mutex_unlock(&io_trace_mutex);
+}
+
+static void io_trace_key_create(void)
+{
+	pthread_key_create(&io_trace_key, io_trace_release);
+}
+
+static io_trace_buffer_t * io_trace_get_buffer(void)
+{
+	io_trace_buffer_t *buffer = io_trace_thread_buffer;
+
+	if (buffer && !buffer->orphan) {
+		return buffer;
+	}
+
+	pthread_once(&io_trace_key_once, io_trace_key_create);
+
+	/* The buffer was dropped by io_trace_free(), and only this thread
+	 * can still reach it. */
+	if (buffer) {
+		free(buffer);
+		io_trace_thread_buffer = NULL;
+		pthread_setspecific(io_trace_key, NULL);
+	}
+
+	pthread_mutex_lock(&io_trace_mutex);
+	for (buffer = io_trace_buffers; buffer; buffer = buffer->next) {
+		if (!buffer->owned) {
+			break;
+		}
+	}
+	if (buffer == NULL) {
+		buffer = malloc(sizeof(io_trace_buffer_t));
+		if (buffer == NULL) {
+			pthread_mutex_unlock(&io_trace_mutex);
+			return NULL;
+		}
+		buffer->head = 0;
+		buffer->next = io_trace_buffers;
+		io_trace_buffers = buffer;
+	}
+	buffer->owned = 1;
+	buffer->orphan = 0;
+	buffer->tid = ++io_trace_tid;
+	pthread_mutex_unlock(&io_trace_mutex);
+
+	io_trace_thread_buffer = buffer;
+	pthread_setspecific(io_trace_key, buffer);
+
+	return buffer;
+}
+
+static void io_trace_record(const char *name, char phase)
+{
+	io_trace_buffer_t *buffer;
+	io_trace_event_t *event;
+
+	buffer = io_trace_get_buffer();
+	if (buffer == NULL) {
+		return;
+	}
+
+	event = &(buffer->events[buffer->head % IO_TRACE_BUFFER_SIZE]);
+	event->name = name;
+	event->phase = phase;
+	event->tid = buffer->tid;
+	event->ts = io_trace_now();
+
+	/* Make the event visible before publishing the new head. */
+	__sync_synchronize();
+	buffer->head++;
+}
+
+void io_trace_enable(void)
+{
+	io_trace_on = 1;
+}
+
+void io_trace_disable(void)
+{
+	io_trace_on = 0;
+}
+
+int io_trace_enabled(void)
+{
+	return io_trace_on;
+}
+
+void io_trace_begin(const char *name)
+{
+	if (io_trace_on) {
+		io_trace_record(name, 'B');
+	}
+}
+
+void io_trace_end(const char *name)
+{
+	if (io_trace_on) {
+		io_trace_record(name, 'E');
+	}
+}
+
+/* Events recorded before now are not dumped anymore. Buffers are only
+ * written by their owner, so nothing is reset. */
+void io_trace_clear(void)
+{
+	io_trace_cleared = io_trace_now();
+}
+
+static void io_trace_dump_string(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\') {
+			fprintf(fp, "\\%c", *s);
+		} else if ((unsigned char) *s < 0x20) {
+			fprintf(fp, "\\u%04x", (unsigned char) *s);
+		} else {
+			fputc(*s, fp);
+		}
+	}
+	fputc('"', fp);
+}
+
+int io_trace_dump(FILE *fp)
+{
+	io_trace_buffer_t *buffer;
+	io_trace_event_t *event;
+	unsigned long i, head, start;
+	unsigned long long cleared = io_trace_cleared;
+	int first = 1;
+
+	if (fp == NULL) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&io_trace_mutex);
+	fputs("{\"traceEvents\":[", fp);
+	for (buffer = io_trace_buffers; buffer; buffer = buffer->next) {
+		head = buffer->head;
+		__sync_synchronize();
+		start = 0;
+		if (head > IO_TRACE_BUFFER_SIZE) {
+			start = head - IO_TRACE_BUFFER_SIZE;
+		}
+		for (i = start; i < head; i++) {
+			event = &(buffer->events[i % IO_TRACE_BUFFER_SIZE]);
+			if (event->ts < cleared) {
+				continue;
+			}
+			fputs(first ? "\n" : ",\n", fp);
+			fputs("{\"name\":", fp);
+			io_trace_dump_string(fp, event->name);
+			fprintf(fp, ",\"ph\":\"%c\",\"ts\":%llu.%03llu,"
+				"\"pid\":1,\"tid\":%u}", event->phase,
+				event->ts / 1000, event->ts % 1000, event->tid);
+			first = 0;
+		}
+	}
+	fputs("\n],\"displayTimeUnit\":\"ms\"}\n", fp);
+	pthread_mutex_unlock(&io_trace_mutex);
+
+	return ferror(fp) ? -1 : 0;
+}
+
+/* Buffers still owned by a thread are left to it: the thread frees its
+ * buffer on its next event or when it exits. */
+void io_trace_free(void)
+{
+	io_trace_buffer_t *buffer, *next;
+
+	io_trace_on = 0;
+
+	pthread_mutex_lock(&io_trace_mutex);
+	buffer = io_trace_buffers;
+	io_trace_buffers = NULL;
+	while (buffer) {
+		next = buffer->next;
+		if (buffer == io_trace_thread_buffer) {
+			free(buffer);
+			io_trace_thread_buffer = NULL;
+			pthread_setspecific(io_trace_key, NULL);
+		} else if (buffer->owned) {
+			buffer->orphan = 1;
+		} else {
+			free(buffer);
+		}
+		buffer = next;
+	}
+	pthread_mutex_unlock(&io_trace_mutex);
+}
@@ -0,0 +1,157 @@
+/*
+ * Copyright 2014 Julian Maurice
+ *
+ * This file is part of libio
+ *
+ * libio is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <sds.h>
+#include "io_value.h"
+#include "io_readonly.h"
+
+/* Copies Lua values from one state to another (possibly on another thread)
+ * through a flat buffer. Only nil, booleans, numbers, strings and tables of
+ * those are copied; other values, and tables nested deeper than
+ * IO_VALUE_MAX_DEPTH (which also stops reference cycles), become nil. Table
+ * entries whose key becomes nil are dropped. */
+
+enum {
+	IO_VALUE_NIL = 'n',
+	IO_VALUE_FALSE = 'f',
+	IO_VALUE_TRUE = 't',
+	IO_VALUE_NUMBER = 'd',
+	IO_VALUE_STRING = 's',
+	IO_VALUE_TABLE = 'T',
+	IO_VALUE_END = 'e'
+};
+
+static sds io_value_dump_depth(lua_State *L, int idx, sds buf,
+	unsigned int depth)
+{
+	lua_Number n;
+	const char *s;
+	size_t len;
+	char tag;
+
+	idx = lua_absindex(L, idx);
+
+	switch (lua_type(L, idx)) {
+		case LUA_TBOOLEAN:
+			tag = lua_toboolean(L, idx) ? IO_VALUE_TRUE : IO_VALUE_FALSE;
+			buf = sdscatlen(buf, &tag, 1);
+			break;
+		case LUA_TNUMBER:
+			tag = IO_VALUE_NUMBER;
+			n = lua_tonumber(L, idx);
+			buf = sdscatlen(buf, &tag, 1);
+			buf = sdscatlen(buf, &n, sizeof(n));
+			break;
+		case LUA_TSTRING:
+			tag = IO_VALUE_STRING;
+			s = lua_tolstring(L, idx, &len);
+			buf = sdscatlen(buf, &tag, 1);
+			buf = sdscatlen(buf, &len, sizeof(len));
+			buf = sdscatlen(buf, s, len);
+			break;
+		case LUA_TTABLE:
+			if (depth < IO_VALUE_MAX_DEPTH && lua_checkstack(L, 4)) {
+				tag = IO_VALUE_TABLE;
+				buf = sdscatlen(buf, &tag, 1);
+				/* A copy, as idx may be the key of the caller's traversal. */
+				lua_pushvalue(L, idx);
+				io_readonly_unwrap(L, -1);
+				lua_pushnil(L);
+				while (lua_next(L, -2)) {
+					buf = io_value_dump_depth(L, -2, buf, depth + 1);
+					buf = io_value_dump_depth(L, -1, buf, depth + 1);
+					lua_pop(L, 1);
+				}
+				lua_pop(L, 1);
+				tag = IO_VALUE_END;
+				buf = sdscatlen(buf, &tag, 1);
+				break;
+			}
+			/* Fall through */
+		default:
+			tag = IO_VALUE_NIL;
+			buf = sdscatlen(buf, &tag, 1);
+	}
+
+	return buf;
+}
+
+sds io_value_dump(lua_State *L, int idx, sds buf)
+{
+	return io_value_dump_depth(L, idx, buf, 0);
+}
+
+/* Pushes the value serialized at ptr and returns a pointer past it, or NULL
+ * if the buffer is truncated. Can raise memory errors. */
+const char * io_value_load(lua_State *L, const char *ptr, const char *end)
+{
+	lua_Number n;
+	size_t len;
+
+	if (ptr == NULL || ptr >= end) {
+		return NULL;
+	}
+
+	luaL_checkstack(L, 3, "io_value_load");
+
+	switch (*ptr++) {
+		case IO_VALUE_FALSE:
+			lua_pushboolean(L, 0);
+			break;
+		case IO_VALUE_TRUE:
+			lua_pushboolean(L, 1);
+			break;
+		case IO_VALUE_NUMBER:
+			if ((size_t) (end - ptr) < sizeof(n)) return NULL;
+			memcpy(&n, ptr, sizeof(n));
+			ptr += sizeof(n);
+			lua_pushnumber(L, n);
+			break;
+		case IO_VALUE_STRING:
+			if ((size_t) (end - ptr) < sizeof(len)) return NULL;
+			memcpy(&len, ptr, sizeof(len));
+			ptr += sizeof(len);
+			if ((size_t) (end - ptr) < len) return NULL;
+			lua_pushlstring(L, ptr, len);
+			ptr += len;
+			break;
+		case IO_VALUE_TABLE:
+			lua_newtable(L);
+			while (ptr < end && *ptr != IO_VALUE_END) {
+				ptr = io_value_load(L, ptr, end);
+				ptr = io_value_load(L, ptr, end);
+				if (ptr == NULL) return NULL;
+				if (lua_isnil(L, -2)) {
+					lua_pop(L, 2);
+				} else {
+					lua_rawset(L, -3);
+				}
+			}
+			if (ptr >= end) return NULL;
+			ptr++;
+			break;
+		default:
+			lua_pushnil(L);
+	}
+
+	return ptr;
+}
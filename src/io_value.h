@@ -0,0 +1,42 @@
+/*
+ * Copyright 2014 Julian Maurice
+ *
+ * This file is part of libio
+ *
+ * libio is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef io_value_h_included
+#define io_value_h_included
+
+#include <lua.h>
+#include <sds.h>
+
+#define IO_VALUE_MAX_DEPTH 64
+
+sds
+io_value_dump(
+	lua_State *L,
+	int idx,
+	sds buf
+);
+
+const char *
+io_value_load(
+	lua_State *L,
+	const char *ptr,
+	const char *end
+);
+
+#endif /* ! io_value_h_included */
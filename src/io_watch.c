@@ -0,0 +1,376 @@
+/*
+ * Copyright 2014 Julian Maurice
+ *
+ * This file is part of libio
+ *
+ * libio is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sds.h>
+#include <libgends/slist.h>
+#include <libgends/hash_map.h>
+#include <libgends/hash_functions.h>
+#include "io_watch.h"
+
+#ifdef __linux__
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#define IO_WATCH_SIZE 256
+#define IO_WATCH_EVENTS (IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE \
+	| IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)
+
+typedef struct {
+	unsigned long version;
+	int exists;
+} io_watch_file_t;
+
+typedef struct io_watch_dir_s {
+	int wd;
+	sds path;
+	struct io_watch_dir_s *next;
+} io_watch_dir_t;
+
+/* Files of the watched directories, with a version that is bumped by the
+ * watcher thread on each change, so that readers never touch the
+ * filesystem. Files in subdirectories are not tracked. */
+struct io_watch_s {
+	int fd;
+	int pipe[2];
+	pthread_t thread;
+	pthread_rwlock_t lock;
+	unsigned long counter;
+	io_watch_dir_t *dirs;
+	/* Keyed by path. */
+	gds_hash_map_t *files;
+};
+
+static gds_hash_map_t * io_watch_files_new(void)
+{
+	return gds_hash_map_new(IO_WATCH_SIZE, gds_hash_djb2, strcmp, NULL,
+		sdsfree, free);
+}
+
+/* Must be called with the write lock held. */
+static void io_watch_set(io_watch_t *watch, sds path, int exists)
+{
+	io_watch_file_t *file;
+
+	file = gds_hash_map_get(watch->files, path);
+	if (file == NULL) {
+		file = malloc(sizeof(io_watch_file_t));
+		if (file == NULL) {
+			fprintf(stderr, "Memory allocation error\n");
+			sdsfree(path);
+			return;
+		}
+		gds_hash_map_set(watch->files, path, file);
+	} else {
+		sdsfree(path);
+	}
+
+	file->version = watch->counter;
+	file->exists = exists;
+}
+
+static void io_watch_scan(io_watch_t *watch, io_watch_dir_t *dir)
+{
+	struct dirent *entry;
+	struct stat st;
+	DIR *dp;
+	sds path;
+
+	dp = opendir(dir->path);
+	if (dp == NULL) {
+		return;
+	}
+
+	while ((entry = readdir(dp))) {
+		path = sdscatprintf(sdsdup(dir->path), "/%s", entry->d_name);
+		if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+			io_watch_set(watch, path, 1);
+		} else {
+			sdsfree(path);
+		}
+	}
+
+	closedir(dp);
+}
+
+static void io_watch_event(io_watch_t *watch, struct inotify_event *event)
+{
+	gds_hash_map_t *files;
+	io_watch_dir_t *dir;
+	sds path;
+
+	if (event->mask & IN_Q_OVERFLOW) {
+		/* Events were lost, consider that every file has changed. */
+		watch->counter++;
+		files = io_watch_files_new();
+		if (files != NULL) {
+			gds_hash_map_free(watch->files);
+			watch->files = files;
+		}
+		for (dir = watch->dirs; dir; dir = dir->next) {
+			io_watch_scan(watch, dir);
+		}
+		return;
+	}
+
+	if (event->len == 0 || (event->mask & IN_ISDIR)) {
+		return;
+	}
+
+	for (dir = watch->dirs; dir && dir->wd != event->wd; dir = dir->next);
+	if (dir == NULL) {
+		return;
+	}
+
+	path = sdscatprintf(sdsdup(dir->path), "/%s", event->name);
+	watch->counter++;
+	io_watch_set(watch, path,
+		!(event->mask & (IN_DELETE | IN_MOVED_FROM)));
+}
+
+static void * io_watch_run(void *data)
+{
+	io_watch_t *watch = data;
+	char buf[4096]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *event;
+	struct pollfd fds[2];
+	ssize_t len;
+	char *p;
+
+	fds[0].fd = watch->fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = watch->pipe[0];
+	fds[1].events = POLLIN;
+
+	for (;;) {
+		if (poll(fds, 2, -1) < 0) {
+			continue;
+		}
+		if (fds[1].revents) {
+			break;
+		}
+
+		len = read(watch->fd, buf, sizeof(buf));
+		if (len <= 0) {
+			continue;
+		}
+
+		pthread_rwlock_wrlock(&(watch->lock));
+		for (p = buf; p < buf + len;
+			p += sizeof(struct inotify_event) + event->len)
+		{
+			event = (struct inotify_event *) p;
+			io_watch_event(watch, event);
+		}
+		pthread_rwlock_unlock(&(watch->lock));
+	}
+
+	return NULL;
+}
+
+io_watch_t * io_watch_new(gds_slist_t *directories)
+{
+	io_watch_t *watch;
+	io_watch_dir_t *dir;
+	sds d;
+
+	watch = calloc(1, sizeof(io_watch_t));
+	if (watch == NULL) {
+		fprintf(stderr, "Memory allocation error\n");
+		return NULL;
+	}
+
+	watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watch->fd < 0) {
+		perror("inotify_init1");
+		free(watch);
+		return NULL;
+	}
+	if (pipe(watch->pipe) < 0) {
+		perror("pipe");
+		close(watch->fd);
+		free(watch);
+		return NULL;
+	}
+	watch->files = io_watch_files_new();
+	if (watch->files == NULL) {
+		fprintf(stderr, "Memory allocation error\n");
+		close(watch->pipe[0]);
+		close(watch->pipe[1]);
+		close(watch->fd);
+		free(watch);
+		return NULL;
+	}
+	pthread_rwlock_init(&(watch->lock), NULL);
+
+	/* Directories are watched before being scanned, so that no change
+	 * can be missed. */
+	gds_slist_foreach(d, directories) {
+		dir = malloc(sizeof(io_watch_dir_t));
+		if (dir == NULL) {
+			fprintf(stderr, "Memory allocation error\n");
+			continue;
+		}
+		dir->wd = inotify_add_watch(watch->fd, d, IO_WATCH_EVENTS);
+		if (dir->wd < 0) {
+			free(dir);
+			continue;
+		}
+		dir->path = sdsdup(d);
+		dir->next = watch->dirs;
+		watch->dirs = dir;
+		io_watch_scan(watch, dir);
+	}
+
+	if (pthread_create(&(watch->thread), NULL, io_watch_run, watch)) {
+		fprintf(stderr, "Cannot start watcher thread\n");
+		watch->thread = pthread_self();
+		io_watch_free(watch);
+		return NULL;
+	}
+
+	return watch;
+}
+
+/* path is in a watched directory if it is the path of the directory, a
+ * slash, and a name without slashes. */
+static int io_watch_tracks(io_watch_t *watch, const char *path)
+{
+	io_watch_dir_t *dir;
+	size_t len;
+
+	for (dir = watch->dirs; dir; dir = dir->next) {
+		len = sdslen(dir->path);
+		if (!strncmp(path, dir->path, len) && path[len] == '/'
+		&& strchr(path + len + 1, '/') == NULL)
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int io_watch_exists(io_watch_t *watch, const char *path)
+{
+	io_watch_file_t *file;
+	int exists;
+
+	if (!io_watch_tracks(watch, path)) {
+		return -1;
+	}
+
+	pthread_rwlock_rdlock(&(watch->lock));
+	file = gds_hash_map_get(watch->files, path);
+	exists = file ? file->exists : 0;
+	pthread_rwlock_unlock(&(watch->lock));
+
+	return exists;
+}
+
+int io_watch_version(io_watch_t *watch, const char *path,
+	unsigned long *version)
+{
+	io_watch_file_t *file;
+
+	if (!io_watch_tracks(watch, path)) {
+		return -1;
+	}
+
+	pthread_rwlock_rdlock(&(watch->lock));
+	file = gds_hash_map_get(watch->files, path);
+	*version = file ? file->version : 0;
+	pthread_rwlock_unlock(&(watch->lock));
+
+	return 0;
+}
+
+void io_watch_free(io_watch_t *watch)
+{
+	io_watch_dir_t *dir, *next;
+
+	if (watch == NULL) {
+		return;
+	}
+
+	if (!pthread_equal(watch->thread, pthread_self())) {
+		if (write(watch->pipe[1], "", 1) == 1) {
+			pthread_join(watch->thread, NULL);
+		}
+	}
+
+	for (dir = watch->dirs; dir; dir = next) {
+		next = dir->next;
+		sdsfree(dir->path);
+		free(dir);
+	}
+	gds_hash_map_free(watch->files);
+	pthread_rwlock_destroy(&(watch->lock));
+	close(watch->pipe[0]);
+	close(watch->pipe[1]);
+	close(watch->fd);
+	free(watch);
+}
+
+#else
+
+io_watch_t * io_watch_new(gds_slist_t *directories)
+{
+	(void) directories;
+
+	fprintf(stderr, "Watching directories is not supported\n");
+
+	return NULL;
+}
+
+int io_watch_exists(io_watch_t *watch, const char *path)
+{
+	(void) watch;
+	(void) path;
+
+	return -1;
+}
+
+int io_watch_version(io_watch_t *watch, const char *path,
+	unsigned long *version)
+{
+	(void) watch;
+	(void) path;
+	(void) version;
+
+	return -1;
+}
+
+void io_watch_free(io_watch_t *watch)
+{
+	(void) watch;
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,54 @@
+/*
+ * Copyright 2014 Julian Maurice
+ *
+ * This file is part of libio
+ *
+ * libio is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef io_watch_h_included
+#define io_watch_h_included
+
+#include <libgends/slist.h>
+
+typedef struct io_watch_s io_watch_t;
+
+/* Returns NULL if the directories cannot be watched. */
+io_watch_t *
+io_watch_new(
+	gds_slist_t *directories
+);
+
+/* Returns 1 if path is a file of a watched directory, 0 if it is not, and
+ * -1 if path is not in a watched directory. */
+int
+io_watch_exists(
+	io_watch_t *watch,
+	const char *path
+);
+
+/* Returns -1 if path is not in a watched directory. */
+int
+io_watch_version(
+	io_watch_t *watch,
+	const char *path,
+	unsigned long *version
+);
+
+void
+io_watch_free(
+	io_watch_t *watch
+);
+
+#endif /* ! io_watch_h_included */
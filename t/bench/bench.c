@@ -0,0 +1,437 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <sds.h>
+#include <embody/embody.h>
+#include <libgends/slist.h>
+#include "io.h"
+#include "io_parser.h"
+#include "io_template_private.h"
+
+/* Each benchmark is calibrated until one round takes at least this long,
+ * then run IO_BENCH_ROUNDS times; the median round is reported. */
+#define IO_BENCH_MIN_ROUND_NS 100000000ULL
+#define IO_BENCH_ROUNDS 5
+
+typedef struct {
+	const char *name;
+	void (*setup)(void *arg);
+	void (*run)(void *arg);
+	void (*teardown)(void *arg);
+	void *arg;
+	size_t bytes;
+} io_bench_t;
+
+typedef struct {
+	char name[128];
+	double ns_per_op;
+} io_bench_result_t;
+
+static unsigned long io_bench_seed = 42;
+
+static unsigned long io_bench_rand(void)
+{
+	io_bench_seed = io_bench_seed * 1103515245UL + 12345UL;
+	return (io_bench_seed / 65536) % 32768;
+}
+
+static unsigned long long io_bench_clock(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+
+	return (unsigned long long) tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+}
+
+/* Generate a template of n_lines lines of ten words, where each word has a
+ * density/100 chance of being an expression or code tag instead of text. */
+static sds io_bench_gen_template(unsigned int n_lines, unsigned int density)
+{
+	static const char *words[] = {
+		"lorem", "ipsum", "dolor", "sit", "amet", "consectetur",
+		"adipiscing", "elit", "sed", "do"
+	};
+	sds tpl = sdsempty();
+	unsigned int i, j;
+
+	io_bench_seed = 42;
+	for (i = 0; i < n_lines; i++) {
+		for (j = 0; j < 10; j++) {
+			unsigned long r = io_bench_rand();
+			if (r % 100 < density) {
+				if (r % 3) {
+					tpl = sdscatprintf(tpl, "{{ v%lu }} ", r % 50);
+				} else {
+					tpl = sdscatprintf(tpl,
+						"{%%- if v%lu then -%%}x{%% end %%} ",
+						r % 50);
+				}
+			} else {
+				tpl = sdscat(tpl, words[r % 10]);
+				tpl = sdscat(tpl, " ");
+			}
+		}
+		tpl = sdscat(tpl, "\n");
+	}
+
+	return tpl;
+}
+
+/* Parser */
+
+typedef struct {
+	unsigned int n_lines;
+	unsigned int density;
+	sds tpl;
+	io_config_t *config;
+} io_bench_parse_t;
+
+static void io_bench_parse_setup(void *arg)
+{
+	io_bench_parse_t *b = arg;
+
+	b->tpl = io_bench_gen_template(b->n_lines, b->density);
+	b->config = io_config_new_default();
+}
+
+static void io_bench_parse_run(void *arg)
+{
+	io_bench_parse_t *b = arg;
+
+	sdsfree(io_parser_parse(b->tpl, b->config));
+}
+
+static void io_bench_parse_teardown(void *arg)
+{
+	io_bench_parse_t *b = arg;
+
+	sdsfree(b->tpl);
+	io_config_free(b->config);
+}
+
+/* Render with includes */
+
+typedef struct {
+	unsigned int n_includes;
+	char dir[64];
+	sds inc_path;
+	io_config_t *config;
+	io_template_t *T;
+} io_bench_include_t;
+
+static void io_bench_include_setup(void *arg)
+{
+	io_bench_include_t *b = arg;
+	sds tpl, inc;
+	FILE *fp;
+
+	strcpy(b->dir, "/tmp/io-bench-XXXXXX");
+	if (mkdtemp(b->dir) == NULL) {
+		perror("mkdtemp");
+		exit(1);
+	}
+	b->inc_path = sdscatprintf(sdsempty(), "%s/item.inc", b->dir);
+	inc = io_bench_gen_template(5, 0);
+	inc = sdscat(inc, "Item {{ i }}: {{ name }}\n");
+	fp = fopen(b->inc_path, "w");
+	fputs(inc, fp);
+	fclose(fp);
+	sdsfree(inc);
+
+	b->config = io_config_new_default();
+	gds_slist_unshift(b->config->directories, sdsnew(b->dir));
+
+	tpl = sdscatprintf(sdsempty(),
+		"{%% for i = 1, %u do Io.include('item.inc') end %%}",
+		b->n_includes);
+	b->T = io_template_new(b->config);
+	io_template_set_template_string(b->T, tpl);
+	io_template_param(b->T, "name", emb_new("sds", sdsnew("bench")));
+	sdsfree(tpl);
+}
+
+static void io_bench_include_run(void *arg)
+{
+	io_bench_include_t *b = arg;
+
+	io_template_render(b->T);
+}
+
+static void io_bench_include_teardown(void *arg)
+{
+	io_bench_include_t *b = arg;
+
+	io_template_free(b->T);
+	io_config_free(b->config);
+	unlink(b->inc_path);
+	rmdir(b->dir);
+	sdsfree(b->inc_path);
+}
+
+/* Stash conversion */
+
+typedef struct {
+	unsigned int n_rows;
+	void **stash;
+	lua_State *L;
+} io_bench_stash_t;
+
+static void io_bench_stash_setup(void *arg)
+{
+	io_bench_stash_t *b = arg;
+	gds_hash_map_t *stash, *row;
+	gds_slist_t *rows;
+	unsigned int i;
+
+	rows = gds_slist_new(emb_container_free);
+	for (i = 0; i < b->n_rows; i++) {
+		row = io_lua_table_new();
+		gds_hash_map_set(row, emb_new("sds", sdsnew("id")),
+			emb_new_int(i));
+		gds_hash_map_set(row, emb_new("sds", sdsnew("name")),
+			emb_new("sds", sdscatprintf(sdsempty(), "row %u", i)));
+		gds_hash_map_set(row, emb_new("sds", sdsnew("price")),
+			emb_new_double(i * 1.25));
+		gds_hash_map_set(row, emb_new("sds", sdsnew("active")),
+			emb_new_bool(i % 2));
+		gds_slist_push(rows, emb_new("gds_hash_map", row));
+	}
+
+	stash = io_lua_table_new();
+	gds_hash_map_set(stash, emb_new("sds", sdsnew("rows")),
+		emb_new("gds_slist", rows));
+	b->stash = emb_new("gds_hash_map", stash);
+	b->L = luaL_newstate();
+}
+
+static void io_bench_stash_run(void *arg)
+{
+	io_bench_stash_t *b = arg;
+
+	io_object_to_lua_stack(b->stash, b->L);
+	lua_settop(b->L, 0);
+	lua_gc(b->L, LUA_GCCOLLECT, 0);
+}
+
+static void io_bench_stash_teardown(void *arg)
+{
+	io_bench_stash_t *b = arg;
+
+	lua_close(b->L);
+	emb_free(b->stash);
+}
+
+/* Plain render */
+
+typedef struct {
+	unsigned int n_lines;
+	io_template_t *T;
+} io_bench_render_t;
+
+static void io_bench_render_setup(void *arg)
+{
+	io_bench_render_t *b = arg;
+	sds tpl;
+
+	tpl = io_bench_gen_template(b->n_lines, 10);
+	b->T = io_template_new(NULL);
+	io_template_set_template_string(b->T, tpl);
+	io_template_param(b->T, "v1", emb_new("sds", sdsnew("value")));
+	sdsfree(tpl);
+}
+
+static void io_bench_render_run(void *arg)
+{
+	io_bench_render_t *b = arg;
+
+	io_template_render(b->T);
+}
+
+static void io_bench_render_teardown(void *arg)
+{
+	io_bench_render_t *b = arg;
+
+	io_template_free(b->T);
+}
+
+static int io_bench_cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+static double io_bench_measure(io_bench_t *bench, unsigned long *iterations)
+{
+	unsigned long n = 1, i;
+	unsigned long long start, elapsed;
+	double rounds[IO_BENCH_ROUNDS];
+	int r;
+
+	/* Calibrate (this also warms caches up). */
+	for (;;) {
+		start = io_bench_clock();
+		for (i = 0; i < n; i++) {
+			bench->run(bench->arg);
+		}
+		elapsed = io_bench_clock() - start;
+		if (elapsed >= IO_BENCH_MIN_ROUND_NS) {
+			break;
+		}
+		n *= 2;
+	}
+
+	for (r = 0; r < IO_BENCH_ROUNDS; r++) {
+		start = io_bench_clock();
+		for (i = 0; i < n; i++) {
+			bench->run(bench->arg);
+		}
+		elapsed = io_bench_clock() - start;
+		rounds[r] = (double) elapsed / n;
+	}
+	qsort(rounds, IO_BENCH_ROUNDS, sizeof(double), io_bench_cmp_double);
+
+	*iterations = n;
+
+	return rounds[IO_BENCH_ROUNDS / 2];
+}
+
+/* Read a file previously written by this program. Only the name and
+ * ns_per_op fields of each line are used. */
+static int io_bench_load_baseline(const char *filename,
+	io_bench_result_t *results, int max)
+{
+	FILE *fp;
+	char line[512];
+	int n = 0;
+
+	fp = fopen(filename, "r");
+	if (fp == NULL) {
+		perror(filename);
+		return -1;
+	}
+
+	while (n < max && fgets(line, sizeof(line), fp)) {
+		char *p = strstr(line, "\"name\":\"");
+		char *q = strstr(line, "\"ns_per_op\":");
+		if (p && q && sscanf(p, "\"name\":\"%127[^\"]\"", results[n].name) == 1
+		&& sscanf(q, "\"ns_per_op\":%lf", &(results[n].ns_per_op)) == 1) {
+			n++;
+		}
+	}
+	fclose(fp);
+
+	return n;
+}
+
+static void io_bench_usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [-b baseline.json] [-t threshold] [-f filter]\n"
+		"  -b FILE  compare results against FILE\n"
+		"  -t PCT   regression threshold in percent (default: 10)\n"
+		"  -f STR   only run benchmarks whose name contains STR\n",
+		progname);
+}
+
+int main(int argc, char **argv)
+{
+	io_bench_parse_t parse[] = {
+		{ 100, 5, NULL, NULL }, { 100, 50, NULL, NULL },
+		{ 10000, 5, NULL, NULL }, { 10000, 50, NULL, NULL },
+	};
+	io_bench_include_t include[] = {
+		{ 10, "", NULL, NULL, NULL }, { 100, "", NULL, NULL, NULL }
+	};
+	io_bench_stash_t stash[] = { { 100, NULL, NULL }, { 10000, NULL, NULL } };
+	io_bench_render_t render[] = { { 10, NULL }, { 1000, NULL } };
+	io_bench_t benches[] = {
+		{ "parse/100-lines/5%", io_bench_parse_setup, io_bench_parse_run, io_bench_parse_teardown, &parse[0], 0 },
+		{ "parse/100-lines/50%", io_bench_parse_setup, io_bench_parse_run, io_bench_parse_teardown, &parse[1], 0 },
+		{ "parse/10000-lines/5%", io_bench_parse_setup, io_bench_parse_run, io_bench_parse_teardown, &parse[2], 0 },
+		{ "parse/10000-lines/50%", io_bench_parse_setup, io_bench_parse_run, io_bench_parse_teardown, &parse[3], 0 },
+		{ "render/include/10", io_bench_include_setup, io_bench_include_run, io_bench_include_teardown, &include[0], 0 },
+		{ "render/include/100", io_bench_include_setup, io_bench_include_run, io_bench_include_teardown, &include[1], 0 },
+		{ "stash/100-rows", io_bench_stash_setup, io_bench_stash_run, io_bench_stash_teardown, &stash[0], 0 },
+		{ "stash/10000-rows", io_bench_stash_setup, io_bench_stash_run, io_bench_stash_teardown, &stash[1], 0 },
+		{ "render/10-lines", io_bench_render_setup, io_bench_render_run, io_bench_render_teardown, &render[0], 0 },
+		{ "render/1000-lines", io_bench_render_setup, io_bench_render_run, io_bench_render_teardown, &render[1], 0 },
+	};
+	int n_benches = sizeof(benches) / sizeof(benches[0]);
+	io_bench_result_t baseline[64];
+	int n_baseline = 0;
+	const char *baseline_file = NULL, *filter = NULL;
+	double threshold = 10;
+	int regressions = 0, first = 1;
+	int i, j, opt;
+
+	while ((opt = getopt(argc, argv, "b:t:f:h")) != -1) {
+		switch (opt) {
+			case 'b': baseline_file = optarg; break;
+			case 't': threshold = atof(optarg); break;
+			case 'f': filter = optarg; break;
+			default:
+				io_bench_usage(argv[0]);
+				return 2;
+		}
+	}
+
+	if (baseline_file) {
+		n_baseline = io_bench_load_baseline(baseline_file, baseline, 64);
+		if (n_baseline < 0) {
+			return 2;
+		}
+	}
+
+	io_initialize();
+
+	printf("{\"benchmarks\":[");
+	for (i = 0; i < n_benches; i++) {
+		io_bench_t *bench = &benches[i];
+		unsigned long iterations;
+		double ns;
+
+		if (filter && !strstr(bench->name, filter)) {
+			continue;
+		}
+
+		bench->setup(bench->arg);
+		if (bench->setup == io_bench_parse_setup) {
+			bench->bytes = sdslen(((io_bench_parse_t *) bench->arg)->tpl);
+		}
+		ns = io_bench_measure(bench, &iterations);
+		bench->teardown(bench->arg);
+
+		printf("%s\n{\"name\":\"%s\",\"iterations\":%lu,\"ns_per_op\":%.1f",
+			first ? "" : ",", bench->name, iterations, ns);
+		if (bench->bytes) {
+			printf(",\"mb_per_s\":%.2f", bench->bytes / ns * 1e9 / 1e6);
+		}
+		for (j = 0; j < n_baseline; j++) {
+			if (!strcmp(baseline[j].name, bench->name)) {
+				double change = (ns / baseline[j].ns_per_op - 1) * 100;
+				printf(",\"baseline_ns_per_op\":%.1f,\"change_pct\":%.1f",
+					baseline[j].ns_per_op, change);
+				if (change > threshold) {
+					printf(",\"regression\":true");
+					regressions++;
+				}
+				break;
+			}
+		}
+		printf("}");
+		fflush(stdout);
+		first = 0;
+	}
+	printf("\n]}\n");
+
+	io_finalize();
+
+	return regressions ? 1 : 0;
+}
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sds.h>
 #include <libtap13/tap.h>
 #include "io_parser.h"
@@ -19,6 +20,47 @@ static void test_parser_parse(const char *tpl, const char *exp, const char *msg)
 	sdsfree(code);
 }
 
+typedef struct {
+	const char *ptr;
+	size_t chunk;
+} test_reader_t;
+
+static size_t test_reader(void *data, char *buf, size_t size)
+{
+	test_reader_t *reader = data;
+	size_t n = strlen(reader->ptr);
+
+	if (n > reader->chunk) n = reader->chunk;
+	if (n > size) n = size;
+	memcpy(buf, reader->ptr, n);
+	reader->ptr += n;
+
+	return n;
+}
+
+/* Feed the template to the streaming parser a few bytes at a time, so
+ * that every tag straddles a read boundary. */
+static void test_parser_stream(const char *tpl, const char *exp,
+	size_t chunk, const char *msg)
+{
+	test_reader_t reader = { tpl, chunk };
+	io_config_t *config = io_config_new_default();
+	io_parser_t *parser;
+	const char *code;
+	size_t len;
+	sds out = sdsempty();
+
+	parser = io_parser_new(test_reader, &reader, config);
+	while ((code = io_parser_next(parser, &len))) {
+		out = sdscatlen(out, code, len);
+	}
+	str_eq(out, exp, msg);
+
+	io_parser_free(parser);
+	io_config_free(config);
+	sdsfree(out);
+}
+
 #define to_s(s) #s
 
 static void test_simple_text(void)
@@ -95,6 +137,15 @@ static void test_unterminated_string(void)
 	test_parser_parse(tpl, exp, __func__);
 }
 
+static void test_filters(void)
+{
+	const char *tpl = "{{ a or 'x|y' | trim | truncate(f(1, 2), \"|\") | upper }}";
+	const char *exp = "Io.out.filter( a or 'x|y' , \"trim\", 0,"
+		" \"truncate\", 2, f(1, 2), \"|\", \"upper\", 0);";
+
+	test_parser_parse(tpl, exp, __func__);
+}
+
 static void test_pre_chomp_one(void)
 {
 	const char *tpl = "foo\n"
@@ -141,6 +192,24 @@ static void test_post_chomp_collapse(void)
 	test_parser_parse(tpl, exp, __func__);
 }
 
+static void test_adjacent_chomp_collapse(void)
+{
+	const char *tpl = "{% a :%}{%: b %}";
+	const char *exp = " a Io.output(\" \"); b ";
+
+	test_parser_parse(tpl, exp, __func__);
+}
+
+static void test_separated_chomp_collapse(void)
+{
+	const char *tpl = "{% a :%}  \n"
+		"  {{: 'b' }}";
+	const char *exp = " a Io.output(\" \");  \n"
+		"  Io.output(\" \");Io.output( 'b' );";
+
+	test_parser_parse(tpl, exp, __func__);
+}
+
 static void test_pre_chomp_greedy(void)
 {
 	const char *tpl = "foo\n"
@@ -165,9 +234,43 @@ static void test_post_chomp_greedy(void)
 	test_parser_parse(tpl, exp, __func__);
 }
 
+static void test_stream(void)
+{
+	const char *tpl = "foo\n"
+		"  \n"
+		"\t  {{: 'foo}}' }}  {% x = [==[ %} ]] ]==] -%}\n"
+		"bar {# \"#}\" #}";
+	const char *exp = to_s( Io.output("foo"); ) "\n"
+		"  \n"
+		"\t  Io.output(\" \");Io.output( 'foo}}' );"
+		to_s( Io.output("  "); ) " x = [==[ %} ]] ]==] \n"
+		to_s( Io.output("bar");Io.output(" "); );
+
+	test_parser_stream(tpl, exp, 1, "stream one byte at a time");
+	test_parser_stream(tpl, exp, 7, "stream seven bytes at a time");
+}
+
+static void test_stream_large(void)
+{
+	size_t i, n = 10000;
+	sds tpl = sdsempty();
+	sds exp;
+	io_config_t *config = io_config_new_default();
+
+	for (i = 0; i < n; i++) {
+		tpl = sdscat(tpl, "{{ i }} word\n");
+	}
+	exp = io_parser_parse(tpl, config);
+	test_parser_stream(tpl, exp, 1000, "stream large template");
+
+	io_config_free(config);
+	sdsfree(tpl);
+	sdsfree(exp);
+}
+
 int main()
 {
-	plan(13);
+	plan(19);
 
 	test_simple_text();
 	test_simple_expr();
@@ -176,13 +279,19 @@ int main()
 	test_simple_text_with_quotes();
 	test_newlines();
 	test_unterminated_string();
+	test_filters();
 
 	test_pre_chomp_one();
 	test_post_chomp_one();
 	test_pre_chomp_collapse();
 	test_post_chomp_collapse();
+	test_adjacent_chomp_collapse();
+	test_separated_chomp_collapse();
 	test_pre_chomp_greedy();
 	test_post_chomp_greedy();
 
+	test_stream();
+	test_stream_large();
+
 	return 0;
 }
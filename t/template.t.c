@@ -1,7 +1,14 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <libgen.h>
 #include <limits.h>
+#include <locale.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <libgends/hash_map.h>
 #include <embody/embody.h>
 #include <sds.h>
@@ -45,6 +52,68 @@ static void test_include(int argc, char **argv)
 			"Hello again, WORLD?\n") == 0, "output is ok");
 		io_template_free(T);
 	}
+
+	config->inline_includes = 1;
+	T = io_template_new(config);
+	io_template_set_template_string(T, tpl);
+	io_template_param(T, "name", emb_new("sds", sdsnew("world!")));
+	out = io_template_render(T);
+	ok(out && strcmp(out,
+		"Hello, world! \n"
+		"Test inclusion WORLD!\n"
+		"\n"
+		"Hello again, WORLD?\n") == 0, "output with inlined include is ok");
+	ok(io_template_get_dependency(T, 0) != NULL
+		&& strstr(io_template_get_dependency(T, 0), "test.inc")
+		&& io_template_get_dependency(T, 1) == NULL
+		&& !io_template_is_stale(T),
+		"inlined include is recorded as a dependency");
+	io_template_free(T);
+
+	T = io_template_new(config);
+	io_template_set_template_string(T,
+		"a{% Io.spawn('widget.inc', { title = 'x', n = 1 }) %}b"
+		"{% Io.spawn('widget.inc', { title = 'y', n = 2 }) %}c");
+	out = io_template_render(T);
+	ok(out && !strcmp(out, "a[x:2]b[y:4]c"),
+		"spawned blocks are spliced in order");
+	io_template_free(T);
+
+	T = io_template_new(config);
+	io_template_set_timeout(T, 50);
+	io_template_set_template_string(T,
+		"{% Io.spawn('loop.inc') %}{% Io.spawn('loop.inc') %}");
+	out = io_template_render(T);
+	ok(out == NULL && io_template_get_status(T) == IO_RENDER_ERRTIME,
+		"spawned blocks share the deadline of the render");
+	io_template_free(T);
+
+	gds_slist_t *rows = gds_slist_new(emb_container_free);
+	for (int i = 1; i <= 10; i++) {
+		gds_slist_push(rows, emb_new_int8(i * 10));
+	}
+	T = io_template_new(config);
+	io_template_param(T, "rows", emb_new("gds_slist", rows));
+	io_template_set_template_string(T,
+		"<{% Io.spawn_each('rows', 'row.inc', { sep = ';' }, 3) %}>");
+	out = io_template_render(T);
+	ok(out && !strcmp(out, "<1=10;2=20;3=30;4=40;5=50;6=60;7=70;8=80;9=90;10=100;>"),
+		"list partitions are rendered and concatenated in order");
+	io_template_free(T);
+
+	rows = gds_slist_new(emb_container_free);
+	for (int i = 1; i <= 3; i++) {
+		gds_slist_push(rows, emb_new_int8(i));
+	}
+	T = io_template_new(config);
+	io_template_param(T, "rows", emb_new("gds_slist", rows));
+	io_template_set_template_string(T,
+		"{% Io.spawn_each('rows', 'rowvar.inc', nil, 1) %}");
+	out = io_template_render(T);
+	ok(out && !strcmp(out, "1:1;2:-;3:-;"),
+		"variables set by a row do not leak into the next");
+	io_template_free(T);
+
 	io_config_free(config);
 }
 
@@ -124,15 +193,874 @@ void test_end_tag_in_string(void)
 	io_template_free(T);
 }
 
+static void test_arena_allocator(void)
+{
+	io_template_t *T;
+	const char *out;
+	const char *tpl =
+		"{% t = {} for i = 1, 1000 do t[i] = string.rep('x', i % 10) end %}"
+		"{{ #t }} {{ table.concat(t, '', 1, 4) }}";
+
+	T = io_template_new(NULL);
+	io_template_set_allocator(T, IO_ALLOCATOR_ARENA);
+	io_template_set_gc(T, 0, 0, 0);
+	io_template_set_template_string(T, tpl);
+
+	out = io_template_render(T);
+	ok(out && !strcmp(out, "1000 xxxxxxxxxx"), "render with arena allocator");
+
+	out = io_template_render(T);
+	ok(out && !strcmp(out, "1000 xxxxxxxxxx"), "render again after arena reset");
+
+	io_template_free(T);
+}
+
+static void test_memory_limit(void)
+{
+	io_template_t *T;
+	io_render_stats_t stats;
+	const char *out;
+
+	T = io_template_new(NULL);
+	io_template_set_template_string(T, "{{ string.rep('a', 10) }}");
+	out = io_template_render(T);
+	io_template_get_stats(T, &stats);
+	ok(out && stats.output_size == 10 && stats.heap_peak > 0,
+		"render stats are reported");
+
+	io_template_set_memory_limit(T, 1024 * 1024);
+	io_template_set_template_string(T,
+		"{% t = {} for i = 1, 1e7 do t[i] = {} end %}done");
+	out = io_template_render(T);
+	ok(out == NULL && io_template_get_status(T) == IO_RENDER_ERRMEM,
+		"render is aborted when Lua heap exceeds the limit");
+
+	io_template_set_template_string(T,
+		"{% for i = 1, 1e7 do Io.output('abcdefgh') end %}");
+	out = io_template_render(T);
+	ok(out == NULL && io_template_get_status(T) == IO_RENDER_ERRMEM,
+		"render is aborted when output exceeds the limit");
+
+	io_template_set_template_string(T, "ok");
+	out = io_template_render(T);
+	ok(out && !strcmp(out, "ok") && io_template_get_status(T) == IO_RENDER_OK,
+		"template can be rendered again after an abort");
+
+	io_template_free(T);
+}
+
+static void test_arena_memory_limit(void)
+{
+	io_template_t *T;
+	const char *out;
+
+	T = io_template_new(NULL);
+	io_template_set_allocator(T, IO_ALLOCATOR_ARENA);
+	io_template_set_memory_limit(T, 4 * 1024 * 1024);
+	io_template_set_template_string(T,
+		"{% for i = 1, 1e7 do local s = 'x' .. i end %}done");
+	out = io_template_render(T);
+	ok(out == NULL && io_template_get_status(T) == IO_RENDER_ERRMEM,
+		"memory freed into the arena counts against the limit");
+
+	io_template_free(T);
+}
+
+static void test_cancel_before_render(void)
+{
+	io_template_t *T;
+	const char *out;
+
+	T = io_template_new(NULL);
+	io_template_set_template_string(T, "ok");
+	io_template_cancel(T);
+	out = io_template_render(T);
+	ok(out == NULL && io_template_get_status(T) == IO_RENDER_CANCELLED,
+		"a cancel issued before the render is not lost");
+
+	out = io_template_render(T);
+	ok(out && !strcmp(out, "ok"), "the cancel only applies to one render");
+
+	io_template_free(T);
+}
+
+static void test_render_limits(void)
+{
+	io_template_t *T;
+	io_render_stats_t stats;
+	const char *out;
+
+	T = io_template_new(NULL);
+	io_template_set_timeout(T, 50);
+	io_template_set_template_string(T, "{% while true do end %}");
+	out = io_template_render(T);
+	ok(out == NULL && io_template_get_status(T) == IO_RENDER_ERRTIME,
+		"render is aborted when the deadline is reached");
+
+	io_template_set_template_string(T,
+		"{% while true do pcall(function() while true do end end) end %}");
+	out = io_template_render(T);
+	ok(out == NULL && io_template_get_status(T) == IO_RENDER_ERRTIME,
+		"templates cannot catch the timeout error");
+	io_template_set_timeout(T, 0);
+
+	io_template_set_instruction_limit(T, 100000);
+	io_template_set_template_string(T, "{% for i = 1, 1e9 do end %}");
+	out = io_template_render(T);
+	io_template_get_stats(T, &stats);
+	ok(out == NULL && io_template_get_status(T) == IO_RENDER_ERRINSTR
+		&& stats.instructions >= 100000,
+		"render is aborted when the instruction limit is reached");
+
+	io_template_free(T);
+}
+
+static void test_render_stream(void)
+{
+	io_template_t *T;
+	io_render_t *R;
+	const char *chunk, *out;
+	size_t len, max = 0;
+	int n = 0;
+	sds buf;
+
+	T = io_template_new(NULL);
+	io_template_set_template_string(T,
+		"{% for i = 1, 100 do %}line {{ i }}\n{% end %}"
+		"{% pcall(function() Io.output(string.rep('x', 50)) end) %}"
+		"{% table.sort({2, 1}, function(a, b) Io.output('.') return a < b end) %}");
+
+	buf = sdsempty();
+	R = io_template_render_start(T, 64);
+	while (io_template_render_next(R, &chunk, &len) == IO_RENDER_CHUNK) {
+		buf = sdscatlen(buf, chunk, len);
+		if (len > max) max = len;
+		n++;
+	}
+	io_template_render_free(R);
+
+	ok(n > 10 && max < 128, "output is pulled in bounded chunks");
+	ok(io_template_get_status(T) == IO_RENDER_OK, "pulled render succeeds");
+
+	out = io_template_render(T);
+	ok(out && !strcmp(out, buf), "pulled output matches render output");
+
+	io_template_set_template_string(T,
+		"{% for i = 1, 100 do Io.out.join({'a', 'b', 'c'}, '-')"
+		" Io.out.json({i}) Io.out.filter('x', 'upper', 0) end %}");
+	n = 0;
+	max = 0;
+	R = io_template_render_start(T, 64);
+	while (io_template_render_next(R, &chunk, &len) == IO_RENDER_CHUNK) {
+		if (len > max) max = len;
+		n++;
+	}
+	io_template_render_free(R);
+	ok(n > 10 && max < 128, "Io.out helpers are pulled in bounded chunks");
+
+	sdsfree(buf);
+	io_template_free(T);
+}
+
+static void test_render_fetch(void)
+{
+	io_template_t *T;
+	io_render_t *R;
+	io_render_step_t step;
+	const char *chunk, *name;
+	size_t len;
+	sds buf, names;
+
+	T = io_template_new(NULL);
+	io_template_set_template_string(T,
+		"a{{ Io.fetch('x') }}b{{ Io.fetch('y') + 1 }}c");
+
+	buf = sdsempty();
+	names = sdsempty();
+	R = io_template_render_start(T, 4096);
+	while ((step = io_template_render_next(R, &chunk, &len))) {
+		if (step == IO_RENDER_CHUNK) {
+			buf = sdscatlen(buf, chunk, len);
+		} else {
+			name = io_template_render_get_fetch(R);
+			names = sdscat(names, name);
+			if (!strcmp(name, "x")) {
+				io_template_render_fulfil(R, emb_new("sds", sdsnew("X")));
+			} else {
+				io_template_render_fulfil(R, emb_new_int8(41));
+			}
+		}
+	}
+	io_template_render_free(R);
+
+	ok(!strcmp(names, "xy"), "fetch requests are returned to the host");
+	ok(!strcmp(buf, "aXb42c"), "fetched values are returned by Io.fetch");
+
+	io_template_render(T);
+	ok(io_template_get_status(T) == IO_RENDER_ERROR,
+		"Io.fetch fails outside of pull-based renders");
+
+	sdsfree(buf);
+	sdsfree(names);
+	io_template_free(T);
+}
+
+static void * test_lazy_callback(io_template_t *T, const char *name,
+	void *data)
+{
+	int *calls = data;
+
+	(void) T;
+	(void) name;
+	(*calls)++;
+
+	return emb_new("sds", sdsnew("computed"));
+}
+
+static void test_param_lazy(void)
+{
+	io_template_t *T;
+	const char *out;
+	int used = 0, unused = 0;
+
+	T = io_template_new(NULL);
+	io_template_param_lazy(T, "used", test_lazy_callback, &used);
+	io_template_param_lazy(T, "unused", test_lazy_callback, &unused);
+	io_template_set_template_string(T,
+		"{% if false then Io.output(unused) end %}{{ used }} {{ used }}");
+
+	out = io_template_render(T);
+	ok(out && !strcmp(out, "computed computed"), "lazy param is rendered");
+	ok(used == 1 && unused == 0,
+		"lazy param is computed once and only when read");
+
+	io_template_free(T);
+}
+
+static void test_loader(void)
+{
+	io_config_t *config;
+	io_loader_t *loader;
+	io_template_t *T;
+	const char *out;
+
+	config = io_config_new_default();
+	loader = io_loader_memory_new();
+	io_loader_memory_set(loader, "main", "<{% Io.include('part') %}>");
+	io_loader_memory_set(loader, "part", "{{ name }}");
+	io_config_set_loader(config, loader);
+
+	T = io_template_new(config);
+	io_template_set_template_file(T, "main");
+	io_template_param(T, "name", emb_new("sds", sdsnew("one")));
+	out = io_template_render(T);
+	ok(out && !strcmp(out, "<one>"), "templates are served from memory");
+
+	io_loader_memory_set(loader, "part", "{{ name }}!");
+	out = io_template_render(T);
+	ok(out && !strcmp(out, "<one!>"), "updated include is recompiled");
+
+	io_loader_memory_remove(loader, "part");
+	out = io_template_render(T);
+	ok(out && !strcmp(out, "<>"), "removed include renders nothing");
+
+	io_template_free(T);
+	io_config_free(config);
+}
+
+static void test_write_file(const char *dir, const char *name,
+	const char *content)
+{
+	sds path = sdscatprintf(sdsempty(), "%s/%s", dir, name);
+	FILE *fp = fopen(path, "w");
+
+	if (fp) {
+		fputs(content, fp);
+		fclose(fp);
+	}
+	sdsfree(path);
+}
+
+static void test_watch(void)
+{
+	char dir[] = "/tmp/io-watch-XXXXXX";
+	struct timespec delay = { 0, 10000000 };
+	io_config_t *config;
+	io_template_t *T;
+	const char *out = NULL;
+	sds path;
+	int i;
+
+	if (mkdtemp(dir) == NULL) {
+		ok(0, "cannot create temporary directory");
+		ok(0, "cannot create temporary directory");
+		return;
+	}
+	test_write_file(dir, "page.tpl", "[{% Io.include('part.inc') %}]");
+	test_write_file(dir, "part.inc", "one");
+
+	config = io_config_new_default();
+	gds_slist_unshift(config->directories, sdsnew(dir));
+	config->inline_includes = 1;
+	io_config_watch(config);
+
+	path = io_config_find_file(config, "page.tpl");
+	T = io_template_new(config);
+	io_template_set_template_file(T, path);
+	out = io_template_render(T);
+	ok(out && !strcmp(out, "[one]"), "watched template is rendered");
+
+	test_write_file(dir, "part.inc", "two");
+	for (i = 0; i < 100; i++) {
+		out = io_template_render(T);
+		if (out && !strcmp(out, "[two]")) {
+			break;
+		}
+		nanosleep(&delay, NULL);
+	}
+	ok(out && !strcmp(out, "[two]"), "parent of a changed include is reloaded");
+
+	io_template_free(T);
+	io_config_free(config);
+	sdsfree(path);
+
+	path = sdscatprintf(sdsempty(), "%s/page.tpl", dir);
+	unlink(path);
+	sdsfree(path);
+	path = sdscatprintf(sdsempty(), "%s/part.inc", dir);
+	unlink(path);
+	sdsfree(path);
+	rmdir(dir);
+}
+
+static void test_stream_file(void)
+{
+	char dir[] = "/tmp/io-stream-XXXXXX";
+	io_config_t *config;
+	io_template_t *T;
+	const char *out;
+	sds path;
+
+	if (mkdtemp(dir) == NULL) {
+		ok(0, "cannot create temporary directory");
+		ok(0, "cannot create temporary directory");
+		return;
+	}
+	test_write_file(dir, "page.tpl",
+		"[{% for i = 1, 3 do %}{{ i }}{% end %}"
+		"{% Io.include('part.inc') %}]");
+	test_write_file(dir, "part.inc", "{{ 'one' }}");
+
+	config = io_config_new_default();
+	gds_slist_unshift(config->directories, sdsnew(dir));
+	config->inline_includes = 1;
+	config->stream_size = 8;
+
+	path = io_config_find_file(config, "page.tpl");
+	T = io_template_new(config);
+	io_template_set_template_file(T, path);
+	out = io_template_render(T);
+	ok(out && !strcmp(out, "[123one]")
+		&& io_template_get_dependency(T, 0) == NULL,
+		"large template and include are streamed");
+
+	test_write_file(dir, "part.inc", "{{ 'two' }}");
+	out = io_template_render(T);
+	ok(out && !strcmp(out, "[123two]"), "streamed files are read on each render");
+
+	io_template_free(T);
+	io_config_free(config);
+	sdsfree(path);
+
+	path = sdscatprintf(sdsempty(), "%s/page.tpl", dir);
+	unlink(path);
+	sdsfree(path);
+	path = sdscatprintf(sdsempty(), "%s/part.inc", dir);
+	unlink(path);
+	sdsfree(path);
+	rmdir(dir);
+}
+
+static void test_global_params(void)
+{
+	io_config_t *config;
+	io_template_t *T;
+	const char *out;
+
+	config = io_config_new_default();
+	io_config_param(config, "site", emb_new("sds", sdsnew("libio")));
+	io_config_param(config, "name", emb_new("sds", sdsnew("global")));
+
+	T = io_template_new(config);
+	io_template_param(T, "name", emb_new("sds", sdsnew("local")));
+	io_template_set_template_string(T, "{{ site }}:{{ name }}");
+	out = io_template_render(T);
+	ok(out && !strcmp(out, "libio:local"),
+		"template params take precedence over global params");
+
+	out = io_template_render(T);
+	ok(out && !strcmp(out, "libio:local"), "global params are reused");
+
+	io_config_param(config, "site", emb_new("sds", sdsnew("changed")));
+	out = io_template_render(T);
+	ok(out && !strcmp(out, "changed:local"),
+		"global params are converted again when they change");
+
+	io_template_free(T);
+
+	gds_hash_map_t *flags = io_lua_table_new();
+	gds_hash_map_set(flags, emb_new("sds", sdsnew("beta")), emb_new_int8(1));
+	gds_slist_t *langs = gds_slist_new(emb_container_free);
+	gds_slist_push(langs, emb_new("sds", sdsnew("en")));
+	gds_slist_push(langs, emb_new("sds", sdsnew("fr")));
+	gds_hash_map_set(flags, emb_new("sds", sdsnew("langs")),
+		emb_new("gds_slist", langs));
+	io_config_param(config, "flags", emb_new("gds_hash_map", flags));
+
+	T = io_template_new(config);
+	io_template_set_template_string(T,
+		"{{ tostring(pcall(function () flags.beta = 2 end)) }}"
+		"{{ tostring(pcall(function () flags.langs[3] = 'de' end)) }}"
+		"{{ flags.beta }}{% for i, l in ipairs(flags.langs) do %},{{ l }}{% end %}"
+		",{{ #flags.langs }},{{ Io.join(flags.langs, '+') }},"
+		"{% Io.out.json(flags.langs) %}");
+	io_template_render(T);
+	out = io_template_render(T);
+	ok(out && !strcmp(out, "falsefalse1,en,fr,2,en+fr,[\"en\",\"fr\"]"),
+		"tables in global params are read-only");
+
+	io_template_free(T);
+	io_config_free(config);
+}
+
+static void test_isolated(void)
+{
+	io_template_t *T;
+	const char *out;
+
+	T = io_template_new(NULL);
+	io_template_set_template_string(T,
+		"{% string.n = (string.n or 0) + 1; x = (x or 0) + 1 %}"
+		"{{ string.n }}:{{ x }}");
+	io_template_render(T);
+	out = io_template_render(T);
+	ok(out && !strcmp(out, "2:1"),
+		"library tables outlive the render, variables do not");
+
+	io_template_set_isolated(T, 1);
+	io_template_render(T);
+	out = io_template_render(T);
+	ok(out && !strcmp(out, "1:1"), "isolated renders get a new state");
+
+	io_template_free(T);
+}
+
+static void test_param_update(void)
+{
+	io_template_t *T;
+	const char *out;
+
+	T = io_template_new(NULL);
+	io_template_param(T, "a", emb_new_int(1));
+	io_template_param(T, "b", emb_new("sds", sdsnew("b")));
+	io_template_set_template_string(T,
+		"{% n = (n or 0) + 1 %}{{ n }}{{ a }}{{ b or '-' }}");
+	out = io_template_render(T);
+	ok(out && !strcmp(out, "11b"), "first render converts the stash");
+
+	io_template_param(T, "a", emb_new_int(2));
+	out = io_template_render(T);
+	ok(out && !strcmp(out, "12b"),
+		"changed param is updated and variables are not kept");
+
+	io_template_param_remove(T, "b");
+	out = io_template_render(T);
+	ok(out && !strcmp(out, "12-"), "removed param is nil");
+
+	io_template_free(T);
+}
+
+static int test_array_frees;
+
+static void test_array_free_data(void *data)
+{
+	test_array_frees++;
+	free(data);
+}
+
+static void * test_array_lazy_callback(io_template_t *T, const char *name,
+	void *data)
+{
+	int64_t *values = malloc(3 * sizeof(int64_t));
+
+	(void) T;
+	(void) name;
+	(void) data;
+	values[0] = 1;
+	values[1] = 2;
+	values[2] = 3;
+
+	return emb_new("io_array", io_array_new(IO_ARRAY_INT64, values, 3, 0,
+		test_array_free_data));
+}
+
+static void test_array_param(void)
+{
+	static const double points[] = { 1.5, 2, 3.25 };
+	static const char names[][4] = { "ab", "cde", "fghi" };
+	io_template_t *T;
+	io_render_t *R;
+	io_render_step_t step;
+	const char *out, *chunk;
+	size_t len;
+	sds buf;
+
+	T = io_template_new(NULL);
+	io_template_param(T, "points", emb_new("io_array",
+		io_array_new(IO_ARRAY_DOUBLE, points, 3, 0, NULL)));
+	io_template_param(T, "names", emb_new("io_array",
+		io_array_new(IO_ARRAY_STRING, names, 3, 4, NULL)));
+	io_template_set_template_string(T,
+		"{{ #points }}{% for i, p in ipairs(points) do %} {{ i }}={{ p }}{% end %}"
+		" {{ names[1] }},{{ names[3] }},{{ tostring(names[4]) }}");
+	out = io_template_render(T);
+	ok(out && !strcmp(out, "3 1=1.5 2=2 3=3.25 ab,fghi,nil"),
+		"C arrays are indexed and iterated from templates");
+
+	io_template_free(T);
+
+	test_array_frees = 0;
+	T = io_template_new(NULL);
+	io_template_param_lazy(T, "lazy", test_array_lazy_callback, NULL);
+	io_template_set_template_string(T,
+		"{% local a = lazy %}{{ a[1] }},{{ lazy[3] }},{{ #a }}|"
+		"{% local f = Io.fetch('f') %}{{ f[2] }},{{ #f }}");
+	R = io_template_render_start(T, 4096);
+	buf = sdsempty();
+	while ((step = io_template_render_next(R, &chunk, &len))) {
+		if (step == IO_RENDER_CHUNK) {
+			buf = sdscatlen(buf, chunk, len);
+		} else {
+			io_template_render_fulfil(R, test_array_lazy_callback(T,
+				io_template_render_get_fetch(R), NULL));
+		}
+	}
+	io_template_render_free(R);
+	ok(!strcmp(buf, "1,3,3|2,3"),
+		"lazy and fetched arrays outlive the param they came from");
+	io_template_free(T);
+	ok(test_array_frees == 2, "arrays are freed with their last reference");
+	sdsfree(buf);
+}
+
+typedef struct {
+	const char *name;
+} test_author_t;
+
+typedef struct {
+	char code[4];
+	int year;
+	double price;
+	_Bool available;
+	test_author_t *author;
+} test_book_t;
+
+static const io_field_t test_author_fields[] = {
+	IO_FIELD(test_author_t, name, IO_FIELD_STRING),
+	IO_FIELD_END
+};
+static const io_schema_t test_author_schema =
+	IO_SCHEMA(test_author_t, test_author_fields);
+
+static const io_field_t test_book_fields[] = {
+	IO_FIELD(test_book_t, code, IO_FIELD_CHARS),
+	IO_FIELD(test_book_t, year, IO_FIELD_INT),
+	IO_FIELD(test_book_t, price, IO_FIELD_DOUBLE),
+	IO_FIELD(test_book_t, available, IO_FIELD_BOOL),
+	IO_FIELD_REF(test_book_t, author, IO_FIELD_STRUCT, &test_author_schema),
+	IO_FIELD_END
+};
+static const io_schema_t test_book_schema =
+	IO_SCHEMA(test_book_t, test_book_fields);
+
+static int test_struct_frees;
+
+static void test_struct_free_data(void *data)
+{
+	test_struct_frees++;
+	free(data);
+}
+
+/* Returns an array of two books, whose first author is in the same block
+ * as the books. */
+static void * test_struct_lazy_callback(io_template_t *T, const char *name,
+	void *data)
+{
+	struct {
+		test_book_t books[2];
+		test_author_t author;
+	} *block = calloc(1, sizeof(*block));
+
+	(void) T;
+	(void) name;
+	(void) data;
+	block->author.name = "Bob";
+	strcpy(block->books[0].code, "l1");
+	block->books[0].author = &block->author;
+	strcpy(block->books[1].code, "l2");
+
+	return emb_new("io_struct", io_struct_array_new(&test_book_schema,
+		block->books, 2, test_struct_free_data));
+}
+
+static void test_struct_param(void)
+{
+	static test_author_t author = { "Ann" };
+	static test_book_t books[] = {
+		{ "abc", -300, 9.5, 1, &author },
+		{ "xy", 2014, 12, 0, NULL },
+	};
+	io_template_t *T;
+	io_render_t *R;
+	io_render_step_t step;
+	const char *out, *chunk;
+	size_t len;
+	sds buf;
+
+	T = io_template_new(NULL);
+	io_template_param(T, "book", emb_new("io_struct",
+		io_struct_new(&test_book_schema, &books[0], NULL)));
+	io_template_param(T, "books", emb_new("io_struct",
+		io_struct_array_new(&test_book_schema, books, 2, NULL)));
+	io_template_set_template_string(T,
+		"{{ book.code }} {{ book.year }} {{ book.author.name }}"
+		"{% for i, b in ipairs(books) do %}"
+		" {{ #books }}:{{ b.code }},{{ b.price }},{{ tostring(b.available) }},"
+		"{{ b.author and b.author.name or '-' }}{% end %}");
+	out = io_template_render(T);
+	ok(out && !strcmp(out,
+		"abc -300 Ann 2:abc,9.5,true,Ann 2:xy,12,false,-"),
+		"struct fields are read from templates");
+
+	io_template_free(T);
+
+	test_struct_frees = 0;
+	T = io_template_new(NULL);
+	io_template_param_lazy(T, "lazy", test_struct_lazy_callback, NULL);
+	io_template_set_template_string(T,
+		"{% local a = lazy[1].author %}{{ a.name }},{{ lazy[2].code }}|"
+		"{% local f = Io.fetch('f')[1] %}{{ f.code }},{{ f.author.name }}");
+	R = io_template_render_start(T, 4096);
+	buf = sdsempty();
+	while ((step = io_template_render_next(R, &chunk, &len))) {
+		if (step == IO_RENDER_CHUNK) {
+			buf = sdscatlen(buf, chunk, len);
+		} else {
+			io_template_render_fulfil(R, test_struct_lazy_callback(T,
+				io_template_render_get_fetch(R), NULL));
+		}
+	}
+	io_template_render_free(R);
+	ok(!strcmp(buf, "Bob,l2|l1,Bob"),
+		"lazy, fetched and nested structs outlive the param they came from");
+	io_template_free(T);
+	ok(test_struct_frees == 2, "structs are freed with their last reference");
+	sdsfree(buf);
+}
+
+static void test_string_helpers(void)
+{
+	io_template_t *T;
+	const char *out;
+
+	T = io_template_new(NULL);
+	io_template_set_template_string(T,
+		"{{ Io.join({'a', 1, 'b'}, '-') }}|"
+		"{{ Io.format_number(-1234567.891, 2, ' ') }}|"
+		"{{ Io.format_date(0, '%Y-%m-%d', true) }}|"
+		"{{ Io.url_encode('a b&c/~') }}|"
+		"{{ Io.truncate('h\xc3\xa9llo', 2) }}|"
+		"{{ Io.utf8_len('h\xc3\xa9llo') }}|"
+		"{{ Io.utf8_sub('h\xc3\xa9llo', 2, -2) }}|"
+		"{% Io.out.join({1, 2, 3}, ',') %}");
+	out = io_template_render(T);
+	ok(out && !strcmp(out, "a-1-b|-1 234 567.89|1970-01-01|a%20b%26c%2F~|"
+		"h\xc3\xa9...|5|\xc3\xa9ll|1,2,3"),
+		"string helpers");
+
+	if (setlocale(LC_NUMERIC, "de_DE.UTF-8") == NULL) {
+		setlocale(LC_NUMERIC, "fr_FR.UTF-8");
+	}
+	io_template_set_template_string(T,
+		"{{ Io.format_number(1234.5, 2, '.', ',') }}");
+	out = io_template_render(T);
+	setlocale(LC_NUMERIC, "C");
+	ok(out && !strcmp(out, "1.234,50"),
+		"format_number does not depend on the locale");
+
+	io_template_free(T);
+}
+
+static void test_filter_repeat(sds *out, const char *in, size_t len,
+	struct lua_State *L, int arg, int nargs)
+{
+	long i, n = nargs ? (long) io_filter_arg_number(L, arg) : 2;
+
+	for (i = 0; i < n; i++) {
+		*out = sdscatlen(*out, in, len);
+	}
+}
+
+static void test_filters(void)
+{
+	io_template_t *T;
+	const char *out;
+
+	io_filter_register("repeat", test_filter_repeat);
+
+	T = io_template_new(NULL);
+	io_template_set_template_string(T,
+		"{{ '  <b>' | trim | upper | escape }}|"
+		"{{ 'ab' | repeat(3) | truncate(4, '~') }}|"
+		"{{ Io.filter(12, 'repeat', 0) }}");
+	out = io_template_render(T);
+	ok(out && !strcmp(out, "&lt;B&gt;|abab~|1212"),
+		"filters are applied in expression tags");
+
+	io_template_set_template_string(T,
+		"{{ 0.1 + 0.2 | trim }}|{{ 1 < 2 | trim }}|{{ {} | upper }}");
+	out = io_template_render(T);
+	ok(out && !strcmp(out, "0.3|1|TABLE"),
+		"filters convert values as Io.output does");
+
+	io_template_free(T);
+}
+
+static void test_json(void)
+{
+	static const double points[] = { 1.5, 2, 3.25 };
+	static test_author_t author = { "Ann" };
+	static test_book_t book = { "abc", -300, 9.5, 1, &author };
+	io_template_t *T;
+	const char *out;
+
+	T = io_template_new(NULL);
+	io_template_param(T, "points", emb_new("io_array",
+		io_array_new(IO_ARRAY_DOUBLE, points, 3, 0, NULL)));
+	io_template_param(T, "book", emb_new("io_struct",
+		io_struct_new(&test_book_schema, &book, NULL)));
+	io_template_set_template_string(T,
+		"{{ Io.json({1, 'a</b>', true, {x = 'it\\'s\\n'} }) }}|"
+		"{% Io.out.json(points) %}|{% Io.out.json(book) %}");
+	out = io_template_render(T);
+	ok(out && !strcmp(out,
+		"[1,\"a\\u003c/b\\u003e\",true,{\"x\":\"it\\u0027s\\n\"}]|"
+		"[1.5,2,3.25]|{\"code\":\"abc\",\"year\":-300,\"price\":9.5,"
+		"\"available\":true,\"author\":{\"name\":\"Ann\"}}"),
+		"values are encoded as JSON");
+
+	io_template_set_template_string(T,
+		"{% local t = { a = 'x', b = { print } } %}"
+		"{{ tostring(pcall(Io.json, t)) }}|"
+		"{{ tostring(pcall(Io.out.json, t)) }}|");
+	out = io_template_render(T);
+	ok(out && !strcmp(out, "false|false|"),
+		"values that cannot be encoded leave no partial JSON");
+
+	io_template_free(T);
+}
+
+static void test_json_params(void)
+{
+	const char *doc = "{\"user\": {\"name\": \"Ann\", \"tags\": [\"a\", \"b\"]},"
+		" \"n\": 3}";
+	const char *list = "[1.5, -2, \"x\\u00e9\"]";
+	io_template_t *T;
+	const char *out;
+
+	T = io_template_new(NULL);
+	ok(io_template_params_json(T, doc, strlen(doc)) == 0
+		&& io_template_param_json(T, "list", list, strlen(list)) == 0
+		&& io_template_param_json(T, "bad", "[1,", 3) == -1,
+		"JSON params are validated");
+	io_template_set_template_string(T,
+		"{{ user.name }} {{ #user.tags }} {{ n }}"
+		" {{ list[1] }} {{ list[2] }} {{ list[3] }}");
+	out = io_template_render(T);
+	ok(out && !strcmp(out, "Ann 2 3 1.5 -2 x\xc3\xa9"),
+		"JSON params are converted to Lua values");
+
+	/* Decimal commas must not change how JSON numbers are read. */
+	if (setlocale(LC_NUMERIC, "de_DE.UTF-8") == NULL) {
+		setlocale(LC_NUMERIC, "fr_FR.UTF-8");
+	}
+	io_template_param_json(T, "zero", "-0", 2);
+	io_template_param_json(T, "list", "[0.25,1e2]", 10);
+	io_template_set_template_string(T,
+		"{{ 1 / zero < 0 }} {{ list[1] * 4 }} {{ list[2] }}");
+	out = io_template_render(T);
+	setlocale(LC_NUMERIC, "C");
+	ok(out && !strcmp(out, "1 1 100"),
+		"JSON numbers keep their sign and ignore the locale");
+
+	io_template_free(T);
+}
+
+static void test_number_output(void)
+{
+	io_config_t *config;
+	io_template_t *T;
+	const char *tpl = "{{ 42, -7, 1/3, 2^53, 0.1, true }}";
+	const char *out;
+
+	T = io_template_new(NULL);
+	io_template_set_template_string(T, tpl);
+	out = io_template_render(T);
+	ok(out && !strcmp(out, "42-70.333333333333339.007199254741e+150.11"),
+		"numbers are written as with tostring by default");
+	io_template_free(T);
+
+	config = io_config_new_default();
+	config->number_precision = 0;
+	T = io_template_new(config);
+	io_template_set_template_string(T, tpl);
+	out = io_template_render(T);
+	ok(out && !strcmp(out, "42-70.333333333333333390071992547409920.11"),
+		"numbers are written in their shortest exact form");
+	io_template_free(T);
+	io_config_free(config);
+}
+
 int main(int argc, char **argv)
 {
-	plan(8);
+	plan(68);
 
 	io_initialize();
 
 	test_include(argc, argv);
 	test_types();
 	test_end_tag_in_string();
+	test_arena_allocator();
+	test_memory_limit();
+	test_arena_memory_limit();
+	test_render_limits();
+	test_cancel_before_render();
+	test_render_stream();
+	test_render_fetch();
+	test_param_lazy();
+	test_loader();
+	test_watch();
+	test_stream_file();
+	test_global_params();
+	test_isolated();
+	test_param_update();
+	test_array_param();
+	test_struct_param();
+	test_string_helpers();
+	test_filters();
+	test_json();
+	test_json_params();
+	test_number_output();
 
 	io_finalize();
 
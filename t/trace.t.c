@@ -0,0 +1,118 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sds.h>
+#include <libtap13/tap.h>
+#include "io.h"
+
+static sds dump_trace(void)
+{
+	FILE *fp;
+	char buf[1024];
+	sds out = sdsempty();
+
+	fp = tmpfile();
+	io_trace_dump(fp);
+	rewind(fp);
+	while (fgets(buf, sizeof(buf), fp)) {
+		out = sdscat(out, buf);
+	}
+	fclose(fp);
+
+	return out;
+}
+
+static void test_trace_disabled(void)
+{
+	io_template_t *T;
+	sds out;
+
+	T = io_template_new(NULL);
+	io_template_set_template_string(T, "foo {{ 1 + 1 }}");
+	io_template_render(T);
+	io_template_free(T);
+
+	out = dump_trace();
+	ok(strstr(out, "\"ph\"") == NULL, "no events recorded when disabled");
+	sdsfree(out);
+}
+
+static void test_trace_render(void)
+{
+	io_template_t *T;
+	sds out;
+
+	io_trace_enable();
+	T = io_template_new(NULL);
+	io_template_set_template_string(T, "foo {{ 1 + 1 }}");
+	io_template_render(T);
+	io_template_free(T);
+	io_trace_disable();
+
+	out = dump_trace();
+	ok(!strncmp(out, "{\"traceEvents\":[", 16), "dump is a trace-event object");
+	ok(strstr(out, "{\"name\":\"io_parser_parse\",\"ph\":\"B\"") != NULL,
+		"parse begin recorded");
+	ok(strstr(out, "{\"name\":\"io_parser_parse\",\"ph\":\"E\"") != NULL,
+		"parse end recorded");
+	ok(strstr(out, "\"name\":\"lua_load\"") != NULL, "chunk load recorded");
+	ok(strstr(out, "\"name\":\"io_object_to_lua_stack\"") != NULL,
+		"stash conversion recorded");
+	ok(strstr(out, "\"name\":\"output flush\"") != NULL,
+		"output flush recorded");
+	sdsfree(out);
+
+	io_trace_clear();
+	out = dump_trace();
+	ok(strstr(out, "\"ph\"") == NULL, "clear drops recorded events");
+	sdsfree(out);
+}
+
+static void * trace_thread(void *data)
+{
+	(void) data;
+
+	io_trace_begin("thread");
+	io_trace_end("thread");
+
+	return NULL;
+}
+
+static void test_trace_threads(void)
+{
+	pthread_t thread;
+	const char *p;
+	sds out;
+	int i, n = 0;
+
+	io_trace_clear();
+	io_trace_enable();
+	for (i = 0; i < 4; i++) {
+		pthread_create(&thread, NULL, trace_thread, NULL);
+		pthread_join(thread, NULL);
+	}
+	io_trace_disable();
+
+	out = dump_trace();
+	for (p = out; (p = strstr(p, "{\"name\":\"thread\",\"ph\":\"B\"")); p++) {
+		n++;
+	}
+	ok(n == 4, "events of exited threads are kept");
+	sdsfree(out);
+}
+
+int main()
+{
+	plan(9);
+
+	io_initialize();
+
+	test_trace_disabled();
+	test_trace_render();
+	test_trace_threads();
+
+	io_finalize();
+
+	return 0;
+}
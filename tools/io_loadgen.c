@@ -0,0 +1,389 @@
+/*
+ * Copyright 2014 Julian Maurice
+ *
+ * This file is part of libio
+ *
+ * libio is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libio.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * io-loadgen: replay renders of every template found in a directory from
+ * several threads for a fixed duration, then report throughput and latency
+ * percentiles.
+ *
+ * The parameter corpus is a text file made of records separated by blank
+ * lines. Each line of a record is a "name=value" pair, passed to the
+ * template as a string. Lines starting with '#' are ignored.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sds.h>
+#include <embody/embody.h>
+#include <libgends/slist.h>
+#include "io.h"
+
+typedef struct {
+	sds name;
+	sds value;
+} io_loadgen_param_t;
+
+typedef struct {
+	io_loadgen_param_t *params;
+	unsigned int n_params;
+} io_loadgen_record_t;
+
+typedef struct {
+	unsigned int id;
+	pthread_t thread;
+	unsigned long long *latencies;
+	unsigned long n_latencies;
+	unsigned long size_latencies;
+	unsigned long renders;
+	unsigned long errors;
+} io_loadgen_worker_t;
+
+static io_config_t *io_loadgen_config;
+static sds *io_loadgen_templates;
+static unsigned int io_loadgen_n_templates;
+static io_loadgen_record_t *io_loadgen_records;
+static unsigned int io_loadgen_n_records;
+static volatile int io_loadgen_measuring = 0;
+static volatile int io_loadgen_stop = 0;
+
+static unsigned long long io_loadgen_clock(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+
+	return (unsigned long long) tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+}
+
+static int io_loadgen_cmp_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *) a;
+	unsigned long long y = *(const unsigned long long *) b;
+
+	return (x > y) - (x < y);
+}
+
+static int io_loadgen_cmp_sds(const void *a, const void *b)
+{
+	return strcmp(*(const sds *) a, *(const sds *) b);
+}
+
+static int io_loadgen_load_templates(const char *dirname)
+{
+	DIR *dir;
+	struct dirent *entry;
+	struct stat st;
+	sds path;
+	unsigned int size = 16;
+
+	dir = opendir(dirname);
+	if (dir == NULL) {
+		perror(dirname);
+		return -1;
+	}
+
+	io_loadgen_templates = malloc(sizeof(sds) * size);
+	while ((entry = readdir(dir))) {
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+		path = sdscatprintf(sdsempty(), "%s/%s", dirname, entry->d_name);
+		if (stat(path, &st) || !S_ISREG(st.st_mode)) {
+			sdsfree(path);
+			continue;
+		}
+		if (io_loadgen_n_templates == size) {
+			size *= 2;
+			io_loadgen_templates = realloc(io_loadgen_templates,
+				sizeof(sds) * size);
+		}
+		io_loadgen_templates[io_loadgen_n_templates++] = path;
+	}
+	closedir(dir);
+
+	/* Keep the order stable between runs. */
+	qsort(io_loadgen_templates, io_loadgen_n_templates, sizeof(sds),
+		io_loadgen_cmp_sds);
+
+	return io_loadgen_n_templates ? 0 : -1;
+}
+
+static void io_loadgen_record_add(io_loadgen_record_t *record, sds line)
+{
+	char *eq = strchr(line, '=');
+	io_loadgen_param_t *param;
+
+	if (eq == NULL) {
+		fprintf(stderr, "Ignoring malformed line: %s\n", line);
+		return;
+	}
+
+	record->params = realloc(record->params,
+		sizeof(io_loadgen_param_t) * (record->n_params + 1));
+	param = &(record->params[record->n_params++]);
+	param->name = sdsnewlen(line, eq - line);
+	param->value = sdsnew(eq + 1);
+}
+
+static int io_loadgen_load_corpus(const char *filename)
+{
+	FILE *fp;
+	char buf[4096];
+	sds line;
+	io_loadgen_record_t *record = NULL;
+
+	fp = fopen(filename, "r");
+	if (fp == NULL) {
+		perror(filename);
+		return -1;
+	}
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		line = sdsnew(buf);
+		sdstrim(line, "\r\n");
+		if (sdslen(line) == 0) {
+			record = NULL;
+		} else if (line[0] != '#') {
+			if (record == NULL) {
+				io_loadgen_records = realloc(io_loadgen_records,
+					sizeof(io_loadgen_record_t)
+					* (io_loadgen_n_records + 1));
+				record = &(io_loadgen_records[io_loadgen_n_records++]);
+				record->params = NULL;
+				record->n_params = 0;
+			}
+			io_loadgen_record_add(record, line);
+		}
+		sdsfree(line);
+	}
+	fclose(fp);
+
+	return 0;
+}
+
+static void io_loadgen_record_latency(io_loadgen_worker_t *w,
+	unsigned long long ns)
+{
+	if (w->n_latencies == w->size_latencies) {
+		w->size_latencies = w->size_latencies ? w->size_latencies * 2 : 4096;
+		w->latencies = realloc(w->latencies,
+			sizeof(unsigned long long) * w->size_latencies);
+	}
+	w->latencies[w->n_latencies++] = ns;
+}
+
+static void * io_loadgen_worker(void *arg)
+{
+	io_loadgen_worker_t *w = arg;
+	io_template_t **templates;
+	io_template_t *T;
+	io_loadgen_record_t *record;
+	unsigned long long start, elapsed;
+	unsigned long k;
+	unsigned int i;
+
+	/* io_template_t is not thread safe: each worker has its own. */
+	templates = malloc(sizeof(io_template_t *) * io_loadgen_n_templates);
+	for (i = 0; i < io_loadgen_n_templates; i++) {
+		templates[i] = io_template_new(io_loadgen_config);
+		io_template_set_template_file(templates[i], io_loadgen_templates[i]);
+	}
+
+	for (k = w->id; !io_loadgen_stop; k++) {
+		T = templates[k % io_loadgen_n_templates];
+
+		start = io_loadgen_clock();
+		if (io_loadgen_n_records) {
+			record = &(io_loadgen_records[k % io_loadgen_n_records]);
+			for (i = 0; i < record->n_params; i++) {
+				io_template_param(T, record->params[i].name,
+					emb_new("sds", sdsdup(record->params[i].value)));
+			}
+		}
+		io_template_render(T);
+		elapsed = io_loadgen_clock() - start;
+
+		if (io_loadgen_measuring) {
+			w->renders++;
+			if (io_template_get_status(T) != IO_RENDER_OK) {
+				w->errors++;
+			}
+			io_loadgen_record_latency(w, elapsed);
+		}
+	}
+
+	for (i = 0; i < io_loadgen_n_templates; i++) {
+		io_template_free(templates[i]);
+	}
+	free(templates);
+
+	return NULL;
+}
+
+static double io_loadgen_percentile(unsigned long long *sorted,
+	unsigned long n, double p)
+{
+	unsigned long idx;
+
+	if (n == 0) {
+		return 0;
+	}
+	idx = (unsigned long) (p / 100 * (n - 1) + 0.5);
+
+	return sorted[idx] / 1000.0;
+}
+
+static void io_loadgen_usage(const char *progname)
+{
+	fprintf(stderr,
+		"Usage: %s -d DIR [-p FILE] [-t THREADS] [-s SECONDS] [-w SECONDS] [-j]\n"
+		"  -d DIR   render every file found in DIR (also used for includes)\n"
+		"  -p FILE  parameter corpus (records of name=value lines)\n"
+		"  -t N     number of threads (default: 4)\n"
+		"  -s N     measurement duration in seconds (default: 10)\n"
+		"  -w N     warm-up duration in seconds (default: 1)\n"
+		"  -j       print the report as JSON\n",
+		progname);
+}
+
+int main(int argc, char **argv)
+{
+	const char *dir = NULL, *corpus = NULL;
+	unsigned int n_threads = 4, duration = 10, warmup = 1, i;
+	int json = 0, opt;
+	io_loadgen_worker_t *workers;
+	unsigned long long *all, start, elapsed;
+	unsigned long n_all = 0, renders = 0, errors = 0;
+	double seconds, p50, p90, p99, p999, max;
+
+	while ((opt = getopt(argc, argv, "d:p:t:s:w:jh")) != -1) {
+		switch (opt) {
+			case 'd': dir = optarg; break;
+			case 'p': corpus = optarg; break;
+			case 't': n_threads = atoi(optarg); break;
+			case 's': duration = atoi(optarg); break;
+			case 'w': warmup = atoi(optarg); break;
+			case 'j': json = 1; break;
+			default:
+				io_loadgen_usage(argv[0]);
+				return 2;
+		}
+	}
+
+	if (dir == NULL || n_threads == 0 || duration == 0) {
+		io_loadgen_usage(argv[0]);
+		return 2;
+	}
+
+	if (io_loadgen_load_templates(dir)) {
+		fprintf(stderr, "No template found in %s\n", dir);
+		return 1;
+	}
+	if (corpus && io_loadgen_load_corpus(corpus)) {
+		return 1;
+	}
+
+	io_initialize();
+	io_loadgen_config = io_config_new_default();
+	gds_slist_unshift(io_loadgen_config->directories, sdsnew(dir));
+
+	workers = calloc(n_threads, sizeof(io_loadgen_worker_t));
+	for (i = 0; i < n_threads; i++) {
+		workers[i].id = i;
+		pthread_create(&(workers[i].thread), NULL, io_loadgen_worker,
+			&workers[i]);
+	}
+
+	sleep(warmup);
+	io_loadgen_measuring = 1;
+	start = io_loadgen_clock();
+	sleep(duration);
+	io_loadgen_measuring = 0;
+	elapsed = io_loadgen_clock() - start;
+	io_loadgen_stop = 1;
+
+	for (i = 0; i < n_threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		n_all += workers[i].n_latencies;
+	}
+
+	all = malloc(sizeof(unsigned long long) * (n_all ? n_all : 1));
+	n_all = 0;
+	for (i = 0; i < n_threads; i++) {
+		memcpy(all + n_all, workers[i].latencies,
+			sizeof(unsigned long long) * workers[i].n_latencies);
+		n_all += workers[i].n_latencies;
+		renders += workers[i].renders;
+		errors += workers[i].errors;
+		free(workers[i].latencies);
+	}
+	qsort(all, n_all, sizeof(unsigned long long), io_loadgen_cmp_ull);
+
+	seconds = elapsed / 1e9;
+	p50 = io_loadgen_percentile(all, n_all, 50);
+	p90 = io_loadgen_percentile(all, n_all, 90);
+	p99 = io_loadgen_percentile(all, n_all, 99);
+	p999 = io_loadgen_percentile(all, n_all, 99.9);
+	max = n_all ? all[n_all - 1] / 1000.0 : 0;
+
+	if (json) {
+		printf("{\"threads\":%u,\"templates\":%u,\"seconds\":%.3f,"
+			"\"renders\":%lu,\"errors\":%lu,\"renders_per_s\":%.1f,"
+			"\"latency_us\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,"
+			"\"p99.9\":%.1f,\"max\":%.1f}}\n",
+			n_threads, io_loadgen_n_templates, seconds, renders, errors,
+			renders / seconds, p50, p90, p99, p999, max);
+	} else {
+		printf("threads:     %u\n", n_threads);
+		printf("templates:   %u\n", io_loadgen_n_templates);
+		printf("duration:    %.3f s\n", seconds);
+		printf("renders:     %lu (%lu errors)\n", renders, errors);
+		printf("throughput:  %.1f renders/s\n", renders / seconds);
+		printf("latency:     p50 %.1f us, p90 %.1f us, p99 %.1f us, "
+			"p99.9 %.1f us, max %.1f us\n", p50, p90, p99, p999, max);
+	}
+
+	free(all);
+	free(workers);
+	for (i = 0; i < io_loadgen_n_templates; i++) {
+		sdsfree(io_loadgen_templates[i]);
+	}
+	free(io_loadgen_templates);
+	for (i = 0; i < io_loadgen_n_records; i++) {
+		unsigned int j;
+		for (j = 0; j < io_loadgen_records[i].n_params; j++) {
+			sdsfree(io_loadgen_records[i].params[j].name);
+			sdsfree(io_loadgen_records[i].params[j].value);
+		}
+		free(io_loadgen_records[i].params);
+	}
+	free(io_loadgen_records);
+	io_config_free(io_loadgen_config);
+	io_finalize();
+
+	return 0;
+}